@@ -25,6 +25,17 @@
 #include "SDL_endian.h"
 #include "SDL_pixels.h"
 #include "SDL_stdinc.h"
+#include "SDL_cpuinfo.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#if defined(_POSIX_MAPPED_FILES) && (_POSIX_MAPPED_FILES > 0)
+#define HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#endif
 
 #include "pnglite.h"
 #include "SDL_pnglite.h"
@@ -152,140 +163,170 @@ SDL_HeaderCheckPNG_RW(SDL_RWops *src, int freesrc, int *w, int *h, int *pf)
     return rv;
 }
 
-SDL_Surface *
-SDL_LoadPNG_RW(SDL_RWops * src, int freesrc)
+/*  Byte order in memory of the 32-bit SDL formats pnglite can decode
+    to directly, PNG_FORMAT_AS_IS for the others. X formats get 255
+    in the unused byte. */
+static int
+format_order(Uint32 format)
+{
+    switch (format) {
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+    case SDL_PIXELFORMAT_RGBA8888:
+    case SDL_PIXELFORMAT_RGBX8888:
+        return PNG_FORMAT_RGBA;
+    case SDL_PIXELFORMAT_BGRA8888:
+    case SDL_PIXELFORMAT_BGRX8888:
+        return PNG_FORMAT_BGRA;
+    case SDL_PIXELFORMAT_ARGB8888:
+    case SDL_PIXELFORMAT_RGB888:
+        return PNG_FORMAT_ARGB;
+    case SDL_PIXELFORMAT_ABGR8888:
+    case SDL_PIXELFORMAT_BGR888:
+        return PNG_FORMAT_ABGR;
+#else
+    case SDL_PIXELFORMAT_RGBA8888:
+    case SDL_PIXELFORMAT_RGBX8888:
+        return PNG_FORMAT_ABGR;
+    case SDL_PIXELFORMAT_BGRA8888:
+    case SDL_PIXELFORMAT_BGRX8888:
+        return PNG_FORMAT_ARGB;
+    case SDL_PIXELFORMAT_ARGB8888:
+    case SDL_PIXELFORMAT_RGB888:
+        return PNG_FORMAT_BGRA;
+    case SDL_PIXELFORMAT_ABGR8888:
+    case SDL_PIXELFORMAT_BGR888:
+        return PNG_FORMAT_RGBA;
+#endif
+    default:
+        return PNG_FORMAT_AS_IS;
+    }
+}
+
+/*  Decodes into a surface of one of the formats format_order() knows,
+    pnglite expanding and swizzling each row as it's reconstructed. */
+static SDL_Surface *
+load_png_as(pnglite_t* png, Uint32 format)
+{
+    SDL_Surface *surface;
+    int bpp, rv;
+    Uint32 Rmask, Gmask, Bmask, Amask;
+
+    SDL_PixelFormatEnumToMasks(format, &bpp, &Rmask, &Gmask, &Bmask, &Amask);
+    surface = SDL_CreateRGBSurface(0, png->width, png->height, bpp,
+                                   Rmask, Gmask, Bmask, Amask);
+    if (!surface) {
+        pnglite_read_abort(png);
+        return NULL;
+    }
+
+    png->out_format = format_order(format);
+    rv = pnglite_read_image_pitch(png, surface->pixels, surface->pitch);
+    if (rv != PNG_NO_ERROR) {
+        SDL_SetError("pnglite_read_image(): %s", pnglite_error_string(rv));
+        SDL_FreeSurface(surface);
+        return NULL;
+    }
+
+    /* pnglite puts alpha and tRNS keys there too */
+    if (!Amask) {
+        Uint32 unused = ~(Rmask | Gmask | Bmask);
+        Uint32 *row;
+        int x, y;
+
+        for (y = 0; y < surface->h; y++) {
+            row = (Uint32 *)((Uint8 *)surface->pixels + y * surface->pitch);
+            for (x = 0; x < surface->w; x++)
+                row[x] |= unused;
+        }
+    }
+
+    return surface;
+}
+
+/* format is 0 for whatever fits the image best, see load_png_as() otherwise */
+static SDL_Surface *
+load_png(pnglite_t* png, Uint32 format)
 {
-    Sint64 fp_offset = 0;
     SDL_Surface *surface = NULL;
     SDL_Color colorset[256];
     SDL_Palette *palette = NULL;
     int rv;
-    pnglite_t png;
-    Uint8  *data = NULL;
     int bpp = 32;
     Uint32 Rmask = 0;
     Uint32 Gmask = 0;
     Uint32 Bmask = 0;
     Uint32 Amask = 0;
-    Uint64 row, col;
+    Uint64 col;
     Uint8 gray_level;
-    Uint8 alpha;
-    Uint64 pixel; /* what if we get 3-gigapixel PNG ? */
-    Uint8 *pitched_row;
-    Uint8 *packed_row;
-    Uint8 *pixel_start;
     Uint32 color;
     int colorkey; /* -1: no palette or zero-alpha colors */
 
-    if (src == NULL) {
-        SDL_SetError("Passed a NULL RWops");
-        goto error;
-    }
-
-    pnglite_init(&png, src, rwops_read_wrapper, 0, SDL_malloc, SDL_free, 0, 0);
-
-    fp_offset = SDL_RWtell(src);
-    if (fp_offset == -1)
-        goto error;
-
-    rv = pnglite_read_header(&png);
+    rv = pnglite_read_header(png);
     if (rv != PNG_NO_ERROR) {
         SDL_SetError("pnglite_read_header(): %s", pnglite_error_string(rv));
         goto error;
     }
 
-    if (png.depth > 8) {
+    if (png->depth > 8) {
         /* support loading 16bpc by losing lsbs ? */
-        SDL_SetError("depth %d is not supported", png.depth);
+        SDL_SetError("depth %d is not supported", png->depth);
         goto error;
     }
 
-    switch (png.color_type) {
+    if (format)
+        return load_png_as(png, format);
+
+    switch (png->color_type) {
         case PNG_TRUECOLOR_ALPHA:
             SDL_PixelFormatEnumToMasks(SDL_PIXELFORMAT_RGBA32, &bpp,
                                        &Rmask, &Gmask, &Bmask, &Amask);
-            surface = SDL_CreateRGBSurface(0, png.width, png.height, bpp,
+            surface = SDL_CreateRGBSurface(0, png->width, png->height, bpp,
                                            Rmask, Gmask, Bmask, Amask);
             if (!surface) {
                 goto error;
             }
-            rv = pnglite_read_image(&png, surface->pixels);
+            rv = pnglite_read_image_pitch(png, surface->pixels, surface->pitch);
             if (rv != PNG_NO_ERROR) {
                 SDL_SetError("pnglite_read_image(): %s", pnglite_error_string(rv));
                 goto error;
             }
-            if ((unsigned)surface->pitch != png.pitch) {
-                for (row = png.height; row > 0; row --) {
-                    pitched_row = (Uint8 *) surface->pixels + (row-1) * surface->pitch;
-                    packed_row  = (Uint8 *) surface->pixels + (row-1) * png.pitch;
-                    SDL_memmove(pitched_row, packed_row, png.pitch);
-                }
-            }
             break;
 
         case PNG_TRUECOLOR:
             SDL_PixelFormatEnumToMasks(SDL_PIXELFORMAT_RGB24, &bpp,
                                        &Rmask, &Gmask, &Bmask, &Amask);
-            surface = SDL_CreateRGBSurface(0, png.width, png.height, bpp,
+            surface = SDL_CreateRGBSurface(0, png->width, png->height, bpp,
                                            Rmask, Gmask, Bmask, Amask);
             if (!surface) {
                 goto error;
             }
-            rv = pnglite_read_image(&png, surface->pixels);
+            rv = pnglite_read_image_pitch(png, surface->pixels, surface->pitch);
             if (rv != PNG_NO_ERROR) {
                 SDL_SetError("pnglite_read_image(): %s", pnglite_error_string(rv));
                 goto error;
             }
-            for (row = png.height; row > 0; row --) {
-                pitched_row = (Uint8 *) surface->pixels + (row-1) * surface->pitch;
-                packed_row  = (Uint8 *) surface->pixels + (row-1) * png.pitch;
-                SDL_memmove(pitched_row, packed_row, png.pitch);
-            }
-            if (png.transparency_present) {
-                color = SDL_MapRGB(surface->format, png.colorkey[1],
-                                    png.colorkey[3], png.colorkey[5]);
+            if (png->transparency_present) {
+                color = SDL_MapRGB(surface->format, png->colorkey[1],
+                                    png->colorkey[3], png->colorkey[5]);
                 SDL_SetColorKey(surface, SDL_TRUE, color);
             }
             break;
 
         case PNG_GREYSCALE:
-            surface = SDL_CreateRGBSurface(0, png.width, png.height, 8,
+            surface = SDL_CreateRGBSurface(0, png->width, png->height, 8,
                                             0, 0, 0, 0);
             if (!surface) {
                 goto error;
             }
             /*  grayscale can be of any depth, and anything below 8
-                gets expanded to 8, so there. */
-            data = SDL_malloc(png.width * png.height);
-            if (!data) {
-                SDL_OutOfMemory();
-                goto error;
-            }
-
-            rv = pnglite_read_image(&png, data);
+                gets expanded to 8 as it is unpacked, so there. */
+            png->scale_grey = 1;
+            rv = pnglite_read_image_pitch(png, surface->pixels, surface->pitch);
             if (rv != PNG_NO_ERROR) {
                 SDL_SetError("pnglite_read_image(): %s", pnglite_error_string(rv));
                 goto error;
             }
 
-            for(pixel = 0 ; pixel < png.width * png.height ; pixel++) {
-                row = pixel / png.width;
-                col = pixel % png.width;
-
-                pixel_start = (Uint8*)(surface->pixels) +
-                                        row*surface->pitch + col;
-
-                *pixel_start = bit_replicate(*(data + pixel), png.depth);
-            }
-
-            if (surface->pitch != surface->w) {
-                for (row = png.height; row > 0; row --) {
-                    pitched_row = (Uint8 *) surface->pixels + (row-1) * surface->pitch;
-                    packed_row  = (Uint8 *) surface->pixels + (row-1) * png.width;
-                    SDL_memmove(pitched_row, packed_row, png.width);
-                }
-            }
-
             gray_level = 0;
             do {
                 colorset[gray_level].r = gray_level;
@@ -304,8 +345,8 @@ SDL_LoadPNG_RW(SDL_RWops * src, int freesrc)
             if (SDL_SetSurfacePalette(surface, palette))
                 goto error;
 
-            if (png.transparency_present) {
-                gray_level = bit_replicate(png.colorkey[1], png.depth);
+            if (png->transparency_present) {
+                gray_level = bit_replicate(png->colorkey[1], png->depth);
                 SDL_SetColorKey(surface, SDL_TRUE, gray_level);
             }
 
@@ -314,75 +355,52 @@ SDL_LoadPNG_RW(SDL_RWops * src, int freesrc)
         case PNG_GREYSCALE_ALPHA:
             SDL_PixelFormatEnumToMasks(SDL_PIXELFORMAT_RGBA32, &bpp,
                                        &Rmask, &Gmask, &Bmask, &Amask);
-            surface = SDL_CreateRGBSurface(0, png.width, png.height, bpp,
+            surface = SDL_CreateRGBSurface(0, png->width, png->height, bpp,
                                            Rmask, Gmask, Bmask, Amask);
             if (!surface) {
                 goto error;
             }
-            /*  grayscale+alpha is always 2 bytes per pixel,
-                so png.pitch is the right value */
-            data = SDL_malloc(png.height * png.pitch);
-            if (!data) {
-                SDL_OutOfMemory();
-                goto error;
-            }
-            rv = pnglite_read_image(&png, data);
+            /* RGBA32 is bytes R, G, B, A whatever the endianness */
+            png->out_format = PNG_FORMAT_RGBA;
+            rv = pnglite_read_image_pitch(png, surface->pixels, surface->pitch);
             if (rv != PNG_NO_ERROR) {
                 SDL_SetError("pnglite_read_image(): %s", pnglite_error_string(rv));
                 goto error;
             }
-            for(pixel = 0 ; pixel < png.width * png.height ; pixel++) {
-                row = pixel / png.width;
-                col = pixel % png.width;
-                gray_level = *(data + 2*pixel);
-                alpha = *(data + 2*pixel + 1);
-                Uint32 *pixel_ptr = (Uint32 *)((Uint8*)surface->pixels + row*surface->pitch) + col;
-                *pixel_ptr = SDL_MapRGBA(surface->format, gray_level, gray_level, gray_level, alpha);
-            }
             break;
 
         case PNG_INDEXED:
             /*  indexed always ends up as 8 bits per pixel. */
-            data = SDL_malloc(png.width * png.height);
-            if (!data) {
-                SDL_OutOfMemory();
+            surface = SDL_CreateRGBSurface(0, png->width, png->height, 8, 0, 0, 0, 0);
+            if (!surface) {
                 goto error;
             }
-            rv = pnglite_read_image(&png, data);
+            rv = pnglite_read_image_pitch(png, surface->pixels, surface->pitch);
             if (rv != PNG_NO_ERROR) {
                 SDL_SetError("pnglite_read_image(): %s", pnglite_error_string(rv));
                 goto error;
             }
-
-            surface = SDL_CreateRGBSurface(0, png.width, png.height, 8, 0, 0, 0, 0);
-            if (!surface) {
-                goto error;
-            }
-            if (surface->pitch != surface->w) {
-                for (row = png.height; row > 0; row --) {
-                    pitched_row = (Uint8 *) surface->pixels + (row-1) * surface->pitch;
-                    packed_row  = data + (row-1) * png.width;
-                    SDL_memcpy(pitched_row, packed_row, png.width);
-                }
-            } else {
-                SDL_memcpy(surface->pixels, data, surface->w * surface->h);
-            }
             colorkey = -1;
             for (col = 0; col < 256; col++) {
-                colorset[col].r = png.palette[3*col + 0];
-                colorset[col].g = png.palette[3*col + 1];
-                colorset[col].b = png.palette[3*col + 2];
-                colorset[col].a = png.palette[768 + col];
+                colorset[col].r = png->palette[3*col + 0];
+                colorset[col].g = png->palette[3*col + 1];
+                colorset[col].b = png->palette[3*col + 2];
+                colorset[col].a = png->palette[768 + col];
+                if (png->premultiply) {
+                    colorset[col].r = (colorset[col].r * colorset[col].a + 127) / 255;
+                    colorset[col].g = (colorset[col].g * colorset[col].a + 127) / 255;
+                    colorset[col].b = (colorset[col].b * colorset[col].a + 127) / 255;
+                }
                 if (colorset[col].a == 0) {
                     if (colorkey == -1) {
                         colorkey = col;
                     }
                 }
             }
-            if (NULL == (palette = SDL_AllocPalette(png.palette_size)))
+            if (NULL == (palette = SDL_AllocPalette(png->palette_size)))
                 goto error;
 
-            if (SDL_SetPaletteColors(palette, colorset, 0, png.palette_size))
+            if (SDL_SetPaletteColors(palette, colorset, 0, png->palette_size))
                 goto error;
 
             if (SDL_SetSurfacePalette(surface, palette))
@@ -394,36 +412,169 @@ SDL_LoadPNG_RW(SDL_RWops * src, int freesrc)
             break;
 
         default:
-            SDL_SetError("bogus color type %d", png.color_type);
+            SDL_SetError("bogus color type %d", png->color_type);
             goto error;
     }
 
     goto done;
 
   error:
-    if (src)
-        SDL_RWseek(src, fp_offset, RW_SEEK_SET);
-
     if (surface)
         SDL_FreeSurface(surface);
 
     surface = NULL;
+    /* whatever was read ahead after the header */
+    pnglite_read_abort(png);
 
   done:
     if (palette)
         SDL_FreePalette(palette);
 
-    if (data)
-        SDL_free(data);
+    return (surface);
+}
+
+static SDL_Surface *
+load_rw(SDL_RWops * src, int freesrc, Uint32 format, int premultiply)
+{
+    Sint64 fp_offset;
+    SDL_Surface *surface = NULL;
+    pnglite_t png;
+
+    if (src == NULL) {
+        SDL_SetError("Passed a NULL RWops");
+        return NULL;
+    }
+
+    fp_offset = SDL_RWtell(src);
+    if (fp_offset != -1) {
+        pnglite_init(&png, src, rwops_read_wrapper, 0, SDL_malloc, SDL_free, 0, 0);
+        /* where the stream is left at only matters if it is kept open */
+        if (freesrc)
+            png.read_ahead = 64 * 1024;
+        png.premultiply = premultiply;
+        surface = load_png(&png, format);
+        if (!surface)
+            SDL_RWseek(src, fp_offset, RW_SEEK_SET);
+    }
 
-    if (freesrc && src)
+    if (freesrc)
         SDL_RWclose(src);
 
-    return (surface);
+    return surface;
+}
+
+static SDL_Surface *
+load_rw_format(SDL_RWops * src, int freesrc, Uint32 format, int premultiply)
+{
+    SDL_Surface *surface, *converted;
+
+    if (format_order(format) != PNG_FORMAT_AS_IS)
+        return load_rw(src, freesrc, format, premultiply);
+
+    surface = load_rw(src, freesrc, 0, premultiply);
+    if (!surface || format == SDL_PIXELFORMAT_UNKNOWN)
+        return surface;
+
+    /* not one pnglite puts out, convert after the fact */
+    converted = SDL_ConvertSurfaceFormat(surface, format, 0);
+    SDL_FreeSurface(surface);
+
+    return converted;
+}
+
+SDL_Surface *
+SDL_LoadPNG_RW(SDL_RWops * src, int freesrc)
+{
+    return load_rw(src, freesrc, 0, 0);
+}
+
+SDL_Surface *
+SDL_LoadPNG_RW_Format(SDL_RWops * src, int freesrc, Uint32 format)
+{
+    return load_rw_format(src, freesrc, format, 0);
+}
+
+SDL_Surface *
+SDL_LoadPNG_RW_Premultiplied(SDL_RWops * src, int freesrc, Uint32 format)
+{
+    return load_rw_format(src, freesrc, format, 1);
+}
+
+#ifdef HAVE_MMAP
+/* maps a regular file in whole, NULL if that can't be done */
+static void *
+map_file(const char *file, size_t *size)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(file, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    if ((fstat(fd, &st) == -1) || !S_ISREG(st.st_mode) || (st.st_size <= 0)
+            || ((Uint64)st.st_size > (size_t)-1)) {
+        close(fd);
+        return NULL;
+    }
+
+    *size = (size_t)st.st_size;
+    map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    /* it is read once, front to back */
+    posix_madvise(map, *size, POSIX_MADV_SEQUENTIAL);
+    posix_madvise(map, *size, POSIX_MADV_WILLNEED);
+
+    return map;
+}
+#endif
+
+SDL_Surface *
+SDL_LoadPNG_File(const char *file)
+{
+#ifdef HAVE_MMAP
+    SDL_Surface *surface;
+    pnglite_t png;
+    size_t size;
+    void *map;
+
+    map = map_file(file, &size);
+    if (map) {
+        pnglite_init_mem(&png, map, size, SDL_malloc, SDL_free, 0, 0);
+        surface = load_png(&png, 0);
+        munmap(map, size);
+        return surface;
+    }
+#endif
+    /* pipes, empty files, no mmap() at all: let SDL deal with it */
+    return SDL_LoadPNG_RW(SDL_RWFromFile(file, "rb"), 1);
+}
+
+/*  Undoes premultiplied alpha of n RGBA32 pixels: c * 255 / a, rounded.
+    Dividing by a is done as multiplying by recip[a], ceil(2^24 / a),
+    and shifting, which is exact for all the numerators there can be. */
+static void
+unpremultiply_row(Uint8 *dst, const Uint8 *src, int n, const Uint32 *recip)
+{
+    Uint32 v;
+    int i, c;
+
+    for (i = 0; i < n; i++, dst += 4, src += 4) {
+        for (c = 0; c < 3; c++) {
+            v = (Uint32)(((Uint64)(src[c] * 255 + src[3] / 2) * recip[src[3]]) >> 24);
+            dst[c] = v > 255 ? 255 : v;
+        }
+        dst[3] = src[3];
+    }
 }
 
 static int
-SDL_SavePNG32_RW(SDL_Surface * src, SDL_RWops * dst, int freedst)
+SDL_SavePNG32_RW(SDL_Surface * src, SDL_RWops * dst, int freedst, int premultiplied)
 {
     SDL_Surface *tmp = NULL;
     SDL_PixelFormat *format = NULL;
@@ -435,6 +586,7 @@ SDL_SavePNG32_RW(SDL_Surface * src, SDL_RWops * dst, int freedst)
     Uint32 unpitched_row_bytes;
     Uint32 pitched_row_bytes;
     Uint32 colorkey;
+    Uint32 recip[256];
     int transparency_present = 0;
 
     if (src->format->Amask > 0) {
@@ -476,15 +628,29 @@ SDL_SavePNG32_RW(SDL_Surface * src, SDL_RWops * dst, int freedst)
         SDL_OutOfMemory();
         goto error;
     }
+    if (premultiplied && png_color_type == PNG_TRUECOLOR_ALPHA) {
+        /* fully transparent pixels come out black */
+        recip[0] = 0;
+        for (i = 1; i < 256; i++)
+            recip[i] = ((1u << 24) + i - 1) / i;
+    } else {
+        premultiplied = 0;
+    }
     /* now get rid of pitch */
     for(i = 0; i < tmp->h ; i++) {
-        SDL_memcpy(data + unpitched_row_bytes * i,
-                    (Uint8 *) tmp->pixels + pitched_row_bytes *i,
-                    pitched_row_bytes);
+        if (premultiplied)
+            unpremultiply_row(data + unpitched_row_bytes * i,
+                              (Uint8 *) tmp->pixels + pitched_row_bytes * i,
+                              tmp->w, recip);
+        else
+            SDL_memcpy(data + unpitched_row_bytes * i,
+                        (Uint8 *) tmp->pixels + pitched_row_bytes *i,
+                        unpitched_row_bytes);
     }
 
     /* write out and be done */
     pnglite_init(&png, dst, 0, rwops_write_wrapper, SDL_malloc, SDL_free, 0, 0);
+    png.threads = SDL_GetCPUCount();
 
     rv = pnglite_write_image(&png, tmp->w, tmp->h, 8, png_color_type, transparency_present, data);
     if (rv != PNG_NO_ERROR) {
@@ -533,7 +699,7 @@ SDL_SavePNG_RW(SDL_Surface * src, SDL_RWops * dst, int freedst)
         case SDL_PIXELFORMAT_INDEX8:
             break;
         default:
-            return SDL_SavePNG32_RW(src, dst, freedst);
+            return SDL_SavePNG32_RW(src, dst, freedst, 0);
     }
     data = SDL_malloc(src->w * src->h);
     if (!data) {
@@ -647,6 +813,7 @@ SDL_SavePNG_RW(SDL_Surface * src, SDL_RWops * dst, int freedst)
 
     /* write out and be done */
     pnglite_init(&png, dst, 0, rwops_write_wrapper, SDL_malloc, SDL_free, 0, 0);
+    png.threads = SDL_GetCPUCount();
 
     rv = pnglite_write_image(&png, src->w, src->h, 8, PNG_INDEXED, transparency_present, data);
     if (rv != PNG_NO_ERROR) {
@@ -671,3 +838,13 @@ SDL_SavePNG_RW(SDL_Surface * src, SDL_RWops * dst, int freedst)
 
     return rv;
 }
+
+int
+SDL_SavePNG_RW_Premultiplied(SDL_Surface * src, SDL_RWops * dst, int freedst)
+{
+    /* palettes are saved as they are */
+    if (!src || !dst || SDL_ISPIXELFORMAT_INDEXED(src->format->format))
+        return SDL_SavePNG_RW(src, dst, freedst);
+
+    return SDL_SavePNG32_RW(src, dst, freedst, 1);
+}
@@ -49,13 +49,57 @@ extern "C" {
 extern DECLSPEC SDL_Surface *SDLCALL SDL_LoadPNG_RW(SDL_RWops * src,
                                                     int freesrc);
 
+/**
+ *  Load a surface from a seekable SDL data stream, in the given pixel format.
+ *
+ *  For SDL_PIXELFORMAT_RGBA8888, ARGB8888, ABGR8888, BGRA8888 and their
+ *  RGBX8888, RGB888 (XRGB8888), BGR888 (XBGR8888) and BGRX8888 counterparts
+ *  the image is expanded to 32 bits and put in that byte order as it is
+ *  decoded, with tRNS made into alpha and the unused byte of the X formats
+ *  set to 255; other formats are converted with
+ *  SDL_ConvertSurfaceFormat() after loading. SDL_PIXELFORMAT_UNKNOWN gets
+ *  the same surface SDL_LoadPNG_RW() would return.
+ *
+ *  If \c freesrc is non-zero, the stream will be closed after being read.
+ *
+ *  The new surface should be freed with SDL_FreeSurface().
+ *
+ *  \return the new surface, or NULL if there was an error.
+ */
+extern DECLSPEC SDL_Surface *SDLCALL SDL_LoadPNG_RW_Format(SDL_RWops * src,
+                                                           int freesrc,
+                                                           Uint32 format);
+
+/**
+ *  Same as SDL_LoadPNG_RW_Format(), but with colors multiplied by alpha.
+ *
+ *  That is done as the image is decoded, for RGBA and greyscale+alpha
+ *  images and the palette of indexed ones; colorkeyed surfaces are left
+ *  as they are.
+ */
+extern DECLSPEC SDL_Surface *SDLCALL SDL_LoadPNG_RW_Premultiplied(SDL_RWops * src,
+                                                                  int freesrc,
+                                                                  Uint32 format);
+
+/**
+ *  Load a surface from a file.
+ *
+ *  Where mmap() is available the file is mapped and decoded in place,
+ *  otherwise this is the same as SDL_LoadPNG_RW(SDL_RWFromFile(file, "rb"), 1).
+ *  The file must not be truncated while it is being loaded.
+ *
+ *  The new surface should be freed with SDL_FreeSurface().
+ *
+ *  \return the new surface, or NULL if there was an error.
+ */
+extern DECLSPEC SDL_Surface *SDLCALL SDL_LoadPNG_File(const char *file);
+
 /**
  *  Load a surface from a file.
  *
  *  Convenience macro.
  */
-#define SDL_LoadPNG(file) \
-                SDL_LoadPNG_RW(SDL_RWFromFile(file, "rb"), 1)
+#define SDL_LoadPNG(file) SDL_LoadPNG_File(file)
 
 /**
  *  Save a surface to a seekable SDL data stream (memory or file).
@@ -67,6 +111,15 @@ extern DECLSPEC SDL_Surface *SDLCALL SDL_LoadPNG_RW(SDL_RWops * src,
 extern DECLSPEC int SDLCALL SDL_SavePNG_RW
     (SDL_Surface * surface, SDL_RWops * dst, int freedst);
 
+/**
+ *  Same as SDL_SavePNG_RW(), for surfaces with colors multiplied by alpha,
+ *  as SDL_LoadPNG_RW_Premultiplied() returns. Those with alpha are saved
+ *  with that undone, since PNG has straight alpha; fully transparent
+ *  pixels end up black.
+ */
+extern DECLSPEC int SDLCALL SDL_SavePNG_RW_Premultiplied
+    (SDL_Surface * surface, SDL_RWops * dst, int freedst);
+
 /**
  *  Save a surface to a file.
  *
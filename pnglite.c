@@ -5,15 +5,210 @@
 #include <stdlib.h>
 #include <string.h>
 
+/*  Inflate/deflate backend, picked at build time. zlib-ng's native API
+    is zlib's with zng_ in front, so it's renamed onto the zlib calls used
+    throughout. libdeflate only does whole buffers: zlib still streams, checkpoints
+    and deflates, libdeflate takes whole images read from memory,
+    see png_inflate_all(). */
+#ifdef PNG_ZLIB_NG
+#include <zlib-ng.h>
+#define z_stream                zng_stream
+#define inflateInit             zng_inflateInit
+#define inflateReset2           zng_inflateReset2
+#define inflatePrime            zng_inflatePrime
+#define inflateSetDictionary    zng_inflateSetDictionary
+#define inflateGetDictionary    zng_inflateGetDictionary
+#define inflate                 zng_inflate
+#define inflateEnd              zng_inflateEnd
+#define deflateInit             zng_deflateInit
+#define deflateInit2            zng_deflateInit2
+#define deflateSetDictionary    zng_deflateSetDictionary
+#define deflateBound            zng_deflateBound
+#define deflate                 zng_deflate
+#define deflateEnd              zng_deflateEnd
+#define adler32                 zng_adler32
+#define adler32_combine         zng_adler32_combine
+#define crc32                   zng_crc32
+#define uInt                    unsigned int
+#define uLong                   unsigned long
+#define Bytef                   unsigned char
+#else
 #include "zlib.h"
+#endif
+#ifdef PNG_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
 #include "pnglite.h"
 
+#ifdef PNG_THREADS
+#include <pthread.h>
+
+/* most deflate threads pnglite_write_image() will start */
+#define PNG_MAX_THREADS 64
+#endif
+
+/*  SIMD unfiltering. SSE2 is there on any x86-64 and NEON on any AArch64,
+    so those are picked at compile time; SSSE3 is checked for at run time. */
+#ifndef PNG_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PNG_SSE2
+#include <emmintrin.h>
+#include <stdint.h>
+#if defined(__SSSE3__)
+#define PNG_SSSE3
+#define PNG_TARGET_SSSE3
+#include <tmmintrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PNG_SSSE3
+#define PNG_SSSE3_RUNTIME
+#define PNG_TARGET_SSSE3 __attribute__((target("ssse3")))
+#include <tmmintrin.h>
+#endif
+/* chunk CRCs with carry-less multiplication, checked for the same way */
+#if defined(__PCLMUL__)
+#define PNG_PCLMUL
+#define PNG_TARGET_PCLMUL
+#include <wmmintrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PNG_PCLMUL
+#define PNG_PCLMUL_RUNTIME
+#define PNG_TARGET_PCLMUL __attribute__((target("pclmul")))
+#include <wmmintrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PNG_NEON
+#include <arm_neon.h>
+/* and with the ARMv8 CRC32 instructions, optional before ARMv8.1 */
+#if defined(__ARM_FEATURE_CRC32)
+#define PNG_ARM_CRC
+#define PNG_TARGET_CRC
+#include <arm_acle.h>
+#elif defined(__aarch64__) && defined(__linux__) && defined(__GNUC__) && !defined(__clang__) \
+        && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define PNG_ARM_CRC
+#define PNG_ARM_CRC_RUNTIME
+#define PNG_TARGET_CRC __attribute__((target("+crc")))
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+#endif
+#endif /* PNG_NO_SIMD */
+
+/* bits of pnglite_t::simd */
+#define PNG_SIMD_SSSE3 1
+#define PNG_SIMD_CRC   2    /* PCLMULQDQ or ARMv8 CRC32 */
+
+/* most image data in an IDAT chunk the writer puts out */
+#define PNG_IDAT_SIZE (64*1024)
+
+/* internal status: png_parse_chunk() handed an IDAT payload over to inflate */
+#define PNG_IDAT_FOUND 100
+
+/* parser states */
+enum {
+    PNG_STATE_SIGNATURE,
+    PNG_STATE_IHDR,
+    PNG_STATE_CHUNK,
+    PNG_STATE_SKIP,
+    PNG_STATE_IDAT,
+    PNG_STATE_END
+};
+
+/*  Checkpoints are stored one after the other, serialized: a header of
+    PNG_CHECKPOINT_SIZE bytes, then the inflate window, the reconstructed
+    scanline above and the filtered bytes of the current one inflated so far.
+    PLTE and tRNS are kept too, as they come before the checkpoints in the file. */
+struct pnglite_index {
+    pnglite_free_t  free;
+    pnglite_allocator_t allocator;  /* of the png_t it was made with */
+    unsigned        width;
+    unsigned        height;
+    unsigned char   depth;
+    unsigned char   color_type;
+    unsigned char   transparency_present;
+    unsigned char   colorkey[6];
+    unsigned char   palette[4*256];
+    unsigned        palette_size;
+    unsigned        strip_rows;
+    unsigned        next_row;       /* first scanline the next checkpoint may be at */
+    unsigned        count;
+    unsigned char*  data;
+    size_t          data_len;
+    size_t          data_size;
+};
+
+#define PNG_CHECKPOINT_SIZE 26
+
+/* kinds of scratch buffers a decoder keeps */
+enum {
+    PNG_SCRATCH_IN,         /* input */
+    PNG_SCRATCH_WINDOW,     /* unfilter window and tables */
+    PNG_SCRATCH_IMAGE,      /* interlaced image handed out by rows */
+#ifdef PNG_LIBDEFLATE
+    PNG_SCRATCH_IDAT,       /* IDAT payloads put together */
+    PNG_SCRATCH_FILTERED,   /* whole image inflated at once */
+#endif
+    PNG_SCRATCH_KINDS
+};
+
+/*  Inflate state and scratch buffers kept from one image to the next.
+    The buffers belong to it and only ever grow; images borrow them. */
+struct pnglite_decoder {
+    pnglite_alloc_t alloc;
+    pnglite_free_t  free;
+    z_stream*       zs;             /* idle, inflateReset2() for the next image */
+#ifdef PNG_LIBDEFLATE
+    struct libdeflate_decompressor* ld;
+#endif
+    unsigned char*  buf[PNG_SCRATCH_KINDS];
+    size_t          size[PNG_SCRATCH_KINDS];
+};
+
+/* arena allocations are aligned for any type SIMD code reads */
+#define PNG_ARENA_ALIGN 16
+#define PNG_ARENA_ROUND(n) (((n) + PNG_ARENA_ALIGN - 1) & ~(size_t)(PNG_ARENA_ALIGN - 1))
+
+typedef struct png_arena_block {
+    struct png_arena_block* prev;
+    size_t                  size;   /* bytes after the header */
+} png_arena_block_t;
+
+#define PNG_ARENA_HEADER PNG_ARENA_ROUND(sizeof(png_arena_block_t))
+
+struct pnglite_arena {
+    png_arena_block_t*  block;      /* being allocated from, earlier ones before it */
+    size_t              used;       /* bytes of it handed out */
+    size_t              before;     /* bytes handed out from the earlier ones */
+    size_t              peak;       /* most bytes out at once since the last reset */
+    size_t              block_size;
+};
+
+/* zlib doesn't tell the size when freeing, so it's kept in front */
+#define PNG_ZALLOC_HEADER PNG_ARENA_ALIGN
+
+/* a checkpoint, deserialized */
+typedef struct {
+    size_t                  offset;     /* of the next compressed byte, from the signature on */
+    unsigned                idat_left;  /* bytes of its IDAT payload from there on */
+    unsigned                row;        /* scanline being inflated */
+    unsigned                fill;       /* bytes of it inflated */
+    unsigned                window_len;
+    unsigned char           bits;       /* bits of the byte before offset inflate has yet to use */
+    unsigned char           byte;       /* that byte */
+    const unsigned char*    data;       /* window, scanline above, part of the current one */
+} png_checkpoint_t;
+
 static size_t
 file_read(pnglite_t* png, void* out, size_t size, size_t numel)
 {
     size_t result = 0;
     if(png->read) {
         result = png->read(out, size, numel, png->user_pointer);
+        png->read_pos += result * size;
     }
     return result;
 }
@@ -29,60 +224,224 @@ file_write(pnglite_t* png, void* p, size_t size, size_t numel)
     return result;
 }
 
-static int
-file_read_ul(pnglite_t* png, unsigned *out)
+
+static unsigned
+get_ul(const unsigned char* buf)
 {
-    unsigned char buf[4];
+    unsigned result;
+    unsigned char foo[4];
 
-    if(file_read(png, buf, 1, 4) != 4)
-        return PNG_FILE_ERROR;
+    memcpy(foo, buf, 4);
 
-    *out = (buf[0]<<24) | (buf[1]<<16) | (buf[2]<<8) | buf[3];
+    result = ((unsigned)foo[0]<<24) | (foo[1]<<16) | (foo[2]<<8) | foo[3];
 
-    return PNG_NO_ERROR;
+    return result;
 }
 
-static int
-file_write_ul(pnglite_t* png, unsigned in)
+static unsigned
+set_ul(unsigned char* buf, unsigned in)
 {
-    unsigned char buf[4];
-
     buf[0] = (in>>24) & 0xff;
     buf[1] = (in>>16) & 0xff;
     buf[2] = (in>>8) & 0xff;
     buf[3] = (in) & 0xff;
 
-    if(file_write(png, buf, 1, 4) != 4)
-        return PNG_FILE_ERROR;
-
     return PNG_NO_ERROR;
 }
 
+/* Allocates with png_t::allocator if it's set, else png_t::alloc. */
+static void*
+png_alloc(pnglite_t* png, size_t size)
+{
+    if (png->allocator.alloc)
+        return png->allocator.alloc(png->allocator.ctx, size);
+    return png->alloc(size);
+}
 
-static unsigned
-get_ul(unsigned char* buf)
+/* Frees what was allocated with the given allocator or plain routine. */
+static void
+png_free_with(const pnglite_allocator_t* allocator, pnglite_free_t plain, void* p, size_t size)
 {
-    unsigned result;
-    unsigned char foo[4];
+    if (!allocator->alloc)
+        plain(p);
+    else if (p && allocator->free)
+        allocator->free(allocator->ctx, p, size);
+}
 
-    memcpy(foo, buf, 4);
+/* Frees what png_alloc() gave, size being what was asked for. */
+static void
+png_free(pnglite_t* png, void* p, size_t size)
+{
+    png_free_with(&png->allocator, png->free, p, size);
+}
 
-    result = (foo[0]<<24) | (foo[1]<<16) | (foo[2]<<8) | foo[3];
+/*  Gets a scratch buffer of the given kind. With a decoder it's the
+    decoder's, enlarged if need be, and nothing is allocated once it has
+    seen the biggest image. */
+static unsigned char*
+png_scratch(pnglite_t* png, unsigned kind, size_t size)
+{
+    pnglite_decoder_t *dec = png->decoder;
 
-    return result;
+    if (!dec)
+        return png_alloc(png, size);
+
+    if (dec->size[kind] < size) {
+        dec->free(dec->buf[kind]);
+        dec->buf[kind] = dec->alloc(size);
+        dec->size[kind] = dec->buf[kind] ? size : 0;
+    }
+    return dec->buf[kind];
 }
 
-static unsigned
-set_ul(unsigned char* buf, unsigned in)
+/* Done with a scratch buffer of size bytes; a decoder's stay with it. */
+static void
+png_scratch_free(pnglite_t* png, void* buf, size_t size)
 {
-    buf[0] = (in>>24) & 0xff;
-    buf[1] = (in>>16) & 0xff;
-    buf[2] = (in>>8) & 0xff;
-    buf[3] = (in) & 0xff;
+    if (!png->decoder)
+        png_free(png, buf, size);
+}
+
+/*  Makes room for at least extra more bytes of input,
+    dropping what has been parsed already. */
+static int
+png_in_reserve(pnglite_t* png, size_t extra)
+{
+    pnglite_decoder_t *dec = png->decoder;
+    z_stream *stream = png->zs;
+    const size_t keep = png->in_len - png->in_pos;
+    unsigned char *in;
+    size_t size;
+
+    /* input left by the last image is all parsed */
+    if (!png->in && dec) {
+        png->in = dec->buf[PNG_SCRATCH_IN];
+        png->in_size = dec->size[PNG_SCRATCH_IN];
+    }
+    in = png->in;
+    size = png->in_size;
+
+    if (png->in_size - png->in_len >= extra)
+        return PNG_NO_ERROR;
+
+    if (keep + extra > size) {
+        size = keep + extra;
+        /* pushed data comes in small pieces */
+        if (png->push && size < 2 * png->in_size)
+            size = 2 * png->in_size;
+        in = dec ? dec->alloc(size) : png_alloc(png, size);
+        if (!in)
+            return PNG_MEMORY_ERROR;
+    }
+
+    if (keep > 0)
+        memmove(in, png->in + png->in_pos, keep);
+
+    /* inflate may be in the middle of an IDAT payload */
+    if (stream && (png->state == PNG_STATE_IDAT))
+        stream->next_in = in + (stream->next_in - (png->in + png->in_pos));
+
+    if (in != png->in) {
+        if (dec) {
+            dec->free(png->in);
+            dec->buf[PNG_SCRATCH_IN] = in;
+            dec->size[PNG_SCRATCH_IN] = size;
+        } else {
+            png_free(png, png->in, png->in_size);
+        }
+        png->in = in;
+        png->in_size = size;
+    }
+    png->in_len = keep;
+    png->in_pos = 0;
+
+    return PNG_NO_ERROR;
+}
+
+/*  Makes sure there are at least n unparsed bytes of input buffered.
+    In push mode it's up to the caller to supply them. */
+static int
+png_need(pnglite_t* png, size_t n)
+{
+    const size_t avail = png->in_len - png->in_pos;
+    size_t want, got;
+    int result;
+
+    if (avail >= n)
+        return PNG_NO_ERROR;
+
+    if (png->mem)
+        return PNG_EOF_ERROR;
+
+    if (png->push)
+        return PNG_NEED_MORE;
+
+    /* chunk headers and CRCs come out of the read-ahead, big payloads are read in one go */
+    want = n - avail > png->read_ahead ? n - avail : png->read_ahead;
+
+    if ((result = png_in_reserve(png, want)) != PNG_NO_ERROR)
+        return result;
+
+    got = file_read(png, png->in + png->in_len, 1, want);
+    png->in_len += got;
+
+    if (got < n - avail)
+        return PNG_EOF_ERROR;
+
+    return PNG_NO_ERROR;
+}
+
+/* Skips over what's left of an ignored chunk. */
+static int
+png_skip(pnglite_t* png)
+{
+    const size_t avail = png->in_len - png->in_pos;
+    const size_t n = avail < png->skip ? avail : png->skip;
+
+    png->in_pos += n;
+    png->skip -= n;
+
+    if (png->skip == 0)
+        return PNG_NO_ERROR;
+
+    if (png->mem)
+        return PNG_EOF_ERROR;
+
+    if (png->push)
+        return PNG_NEED_MORE;
+
+    if (file_read(png, 0, png->skip, 1) != 1)
+        return PNG_EOF_ERROR;
+
+    png->skip = 0;
 
     return PNG_NO_ERROR;
 }
 
+/* Which of the run-time selected kernels this CPU can do. */
+static unsigned char
+png_simd_features(void)
+{
+    unsigned char features = 0;
+
+#if defined(PNG_SSSE3_RUNTIME)
+    if (__builtin_cpu_supports("ssse3"))
+        features |= PNG_SIMD_SSSE3;
+#elif defined(PNG_SSSE3)
+    features |= PNG_SIMD_SSSE3;
+#endif
+#if defined(PNG_PCLMUL_RUNTIME)
+    if (__builtin_cpu_supports("pclmul"))
+        features |= PNG_SIMD_CRC;
+#elif defined(PNG_ARM_CRC_RUNTIME)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+        features |= PNG_SIMD_CRC;
+#elif defined(PNG_PCLMUL) || defined(PNG_ARM_CRC)
+    features |= PNG_SIMD_CRC;
+#endif
+    return features;
+}
+
 int
 pnglite_init(pnglite_t *png, void* user_pointer,
          pnglite_read_callback_t read_fun, pnglite_read_callback_t write_fun,
@@ -98,6 +457,10 @@ pnglite_init(pnglite_t *png, void* user_pointer,
     else
         png->free = free;
 
+    png->allocator.alloc = NULL;
+    png->allocator.free = NULL;
+    png->allocator.ctx = NULL;
+
     png->read = read_fun;
     png->write = write_fun;
     const size_t chunk_size_max = (1L<<31) - 1;
@@ -105,43 +468,70 @@ pnglite_init(pnglite_t *png, void* user_pointer,
     png->image_data_limit = (idl != 0 && idl < chunk_size_max) ? idl: chunk_size_max;
     png->user_pointer = user_pointer;
 
+    png->zs = NULL;
+    png->in = NULL;
+    png->in_size = 0;
+    png->in_len = 0;
+    png->in_pos = 0;
+    png->read_pos = 0;
+    png->read_ahead = 0;
+    png->push = 0;
+    png->mem = 0;
+    png->state = PNG_STATE_SIGNATURE;
+    png->idat_seen = 0;
+    png->decoded = 0;
+    png->idat_unchecked = 0;
+    png->window = NULL;
+    png->lut = NULL;
+    png->unpack_lut = NULL;
+    png->image = NULL;
+    png->index = NULL;
+    png->decoder = NULL;
+    png->out_format = PNG_FORMAT_AS_IS;
+    png->premultiply = 0;
+    png->scale_grey = 0;
+    png->next_row = 0;
+    png->height = 0;
+    png->write_filter = PNG_FILTER_ADAPTIVE;
+    png->threads = 0;
+    png->simd = png_simd_features();
+
     return PNG_NO_ERROR;
 }
 
-static int
-png_init_copy(const pnglite_t *src, pnglite_t *dst)
+int
+pnglite_init_push(pnglite_t *png, pnglite_alloc_t pngalloc, pnglite_free_t pngfree,
+                  size_t csl, size_t idl)
 {
-    return pnglite_init(dst, src->user_pointer, src->read, src->write, src->alloc, src->free, src->chunk_size_limit, src->image_data_limit);
+    pnglite_init(png, 0, 0, 0, pngalloc, pngfree, csl, idl);
+    png->push = 1;
+
+    return PNG_NO_ERROR;
 }
 
-static int
-pot_align(int value, int pot)
+int
+pnglite_init_mem(pnglite_t *png, const void* buf, size_t len, pnglite_alloc_t pngalloc,
+                 pnglite_free_t pngfree, size_t csl, size_t idl)
 {
-    return (value + (1<<pot) - 1) & ~((1<<pot) -1);
-}
+    pnglite_init(png, 0, 0, 0, pngalloc, pngfree, csl, idl);
 
-const int channels[] = { 1, 0, 3, 1, 2, 0, 4 };
-#ifdef TRACE
-const char *ctnames[] = { "Y", "(undefined)", "RGB", "INDEXED", "YA", "(undefined)", "RGBA" };
-#endif
+    /* parsed and inflated in place, never written to */
+    png->in = (unsigned char*)buf;
+    png->in_size = png->in_len = len;
+    png->read_pos = len;
+    png->mem = 1;
 
-static int
-bytes_per_pixel(int depth, int color_type) {
-    return pot_align(depth * channels[color_type], 3) >> 3;
-}
-static int
-bytes_per_scanline(int width, int depth, int color_type)
-{
-    return pot_align(width * depth * channels[color_type], 3) >> 3;
+    return PNG_NO_ERROR;
 }
 
 static int
-get_decompressed_data_size(pnglite_t *png)
+pot_align(int value, int pot)
 {
-/*
-   zlib output buffer size for interlaced pngs:
-   we have more scanlines than h would indicate:
+    return (value + (1<<pot) - 1) & ~((1<<pot) -1);
+}
 
+const int channels[] = { 1, 0, 3, 1, 2, 0, 4 };
+/* Adam7
    1 6 4 6 2 6 4 6
    7 7 7 7 7 7 7 7
    5 6 5 6 5 6 5 6
@@ -150,54 +540,25 @@ get_decompressed_data_size(pnglite_t *png)
    7 7 7 7 7 7 7 7
    5 6 5 6 5 6 5 6
    7 7 7 7 7 7 7 7
-
-   h/2 7th pass w   scanlines  : at least one for h>=2 images.
-   h/2 6th pass w/2 scanlines  : at least one for w>=2 images
-   h/4 5th pass w/2 scanlines  : at least one for h>=3 images.
-   h/4 4th pass w/4 scanlines  : at least one for w>=3 images.
-   h/8 3rd pass w/4 scanlines  : at least one for h>=5 images.
-   h/8 2nd pass w/8 scanlines  : at least one for w>=5 images.
-   h/8 1st pass w/8 scanlines  : at least one at all times.
-
-   this function overestimates needed buffer size
-   but hopefully not by much
-*/
-/* 1bpp 4x4.
-   1 6 4 6
-   7 7 7 7
-   5 6 5 6
-   7 7 7 7
-
-
-   1 = 1sl 1px = 2 bytes
-   4 = 1sl 1px = 2 bytes
-   5 = 1sl 2px = 2 bytes
-   6 = 2sl 2px ea = 4 bytes
-   7 = 2sl 4px ea = 4 bytes
-   total: 14 bytes.
  */
-    int rv;
-    if (png->interlace_method == 0) {
-        rv = png->height * (png->pitch + 1);
-    } else {
-        int width = png->width;
-        int height = png->height;
-        int depth = png->depth;
-        int ct = png->color_type;
-
-        rv =
-            (bytes_per_scanline( width,      depth, ct) + 1) * (1 + height/2) +
-            (bytes_per_scanline((width+1)/2, depth, ct) + 1) * (1 + height/2) +
-            (bytes_per_scanline((width+1)/2, depth, ct) + 1) * (1 + height/4) +
-            (bytes_per_scanline((width+1)/4, depth, ct) + 1) * (1 + height/4) +
-            (bytes_per_scanline((width+1)/4, depth, ct) + 1) * (1 + height/8) +
-            (bytes_per_scanline((width+1)/8, depth, ct) + 1) * (1 + height/8) +
-            (bytes_per_scanline((width+1)/8, depth, ct) + 1) * (1 + height/8);
-    }
+/* pass no                                    1  2  3  4  5  6  7 */
+static const unsigned int adam7_hstride[] = { 8, 8, 4, 4, 2, 2, 1 };
+static const unsigned int adam7_vstride[] = { 8, 8, 8, 4, 4, 2, 2 };
+static const unsigned int adam7_hshift[]  = { 0, 4, 0, 2, 0, 1, 0 };
+static const unsigned int adam7_vshift[]  = { 0, 0, 4, 0, 2, 0, 1 };
+
 #ifdef TRACE
-    fprintf(stderr, "png_decompressed_data_size(): decompressed_data_size estimated at %d\n", rv);
+const char *ctnames[] = { "Y", "(undefined)", "RGB", "INDEXED", "YA", "(undefined)", "RGBA" };
 #endif
-    return rv;
+
+static int
+bytes_per_pixel(int depth, int color_type) {
+    return pot_align(depth * channels[color_type], 3) >> 3;
+}
+static int
+bytes_per_scanline(int width, int depth, int color_type)
+{
+    return pot_align(width * depth * channels[color_type], 3) >> 3;
 }
 
 static int
@@ -272,71 +633,176 @@ png_check_png(pnglite_t* png)
     return PNG_NO_ERROR;
 }
 
-static unsigned
-png_calc_crc(char *name, unsigned char *chunk, unsigned length)
+#ifdef PNG_PCLMUL
+/*  Folds 64 bytes at a time into four 128-bit lanes with carry-less
+    multiplies, then those into one and Barrett-reduces it, as in Intel's
+    "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ".
+    len is at least 64 and a multiple of 16; crc in and out is the raw,
+    inverted register. */
+static PNG_TARGET_PCLMUL unsigned
+png_crc32_pclmul(unsigned crc, const unsigned char* buf, size_t len)
+{
+    /* x^(4*128+32) mod P, x^(4*128-32) mod P, then the same for 128 */
+    const __m128i k1k2 = _mm_set_epi32(0x00000001, 0xc6e41596, 0x00000001, 0x54442bd4);
+    const __m128i k3k4 = _mm_set_epi32(0x00000000, 0xccaa009e, 0x00000001, 0x751997d0);
+    const __m128i k5 = _mm_set_epi32(0, 0, 0x00000001, 0x63cd6124);
+    /* P and its Barrett constant, bit-reflected */
+    const __m128i poly = _mm_set_epi32(0x00000001, 0xf7011641, 0x00000001, 0xdb710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i*)buf);
+    x2 = _mm_loadu_si128((const __m128i*)(buf + 16));
+    x3 = _mm_loadu_si128((const __m128i*)(buf + 32));
+    x4 = _mm_loadu_si128((const __m128i*)(buf + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    buf += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)buf));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(buf + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(buf + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(buf + 48)));
+        buf += 64;
+        len -= 64;
+    }
+
+    /* four lanes into one */
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)buf)), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 bits to 64 */
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5, 0x00), x2);
+
+    /* Barrett reduction to 32 */
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_srli_si128(x1, 4);
+    return (unsigned)_mm_cvtsi128_si32(x0);
+}
+#endif /* PNG_PCLMUL */
+
+#ifdef PNG_ARM_CRC
+/* Same register convention as png_crc32_pclmul(), any length. */
+static PNG_TARGET_CRC unsigned
+png_crc32_arm(unsigned crc, const unsigned char* buf, size_t len)
 {
-    unsigned crc;
+    while (len >= 8) {
+        uint64_t v;
 
-    crc = crc32(0L, Z_NULL, 0);
-    crc = crc32(crc, (unsigned char *)name, 4);
-    crc = crc32(crc, chunk, length);
+        memcpy(&v, buf, 8);
+        crc = __crc32d(crc, v);
+        buf += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = __crc32b(crc, *buf++);
 
     return crc;
 }
+#endif /* PNG_ARM_CRC */
 
-static int
-png_read_check_crc(pnglite_t *png, char *name, unsigned char *chunk, unsigned length)
+/*  Continues the CRC-32 crc of earlier bytes over len more, 0 being that
+    of none. What the CPU cannot speed up goes to the inflate backend. */
+static unsigned
+png_crc32(pnglite_t* png, unsigned crc, const unsigned char* buf, size_t len)
 {
-    unsigned crc;
+#if defined(PNG_PCLMUL)
+    if ((png->simd & PNG_SIMD_CRC) && len >= 64) {
+        const size_t folded = len & ~(size_t)15;
 
-    if (file_read_ul(png, &crc) != PNG_NO_ERROR)
-        return PNG_EOF_ERROR;
+        crc = ~png_crc32_pclmul(~crc, buf, folded);
+        buf += folded;
+        len -= folded;
+    }
+#elif defined(PNG_ARM_CRC)
+    if (png->simd & PNG_SIMD_CRC)
+        return ~png_crc32_arm(~crc, buf, len);
+#else
+    (void)png;
+#endif
+    return crc32(crc, buf, (uInt)len);
+}
+
+/* Checks CRC of a whole chunk, starting with its length, as it sits in the input buffer. */
+static int
+png_check_crc(pnglite_t* png, const unsigned char *chunk, unsigned length)
+{
+    const unsigned crc = png_crc32(png, 0, chunk + 4, (size_t)length + 4);
 
-    if(crc != png_calc_crc(name, chunk, length))
+    if(crc != get_ul(chunk + 8 + length))
         return PNG_CRC_ERROR;
 
     return PNG_NO_ERROR;
 }
 
-static int
-png_calc_write_crc(pnglite_t *png, char *name, unsigned char *chunk, unsigned length)
+/* Fills in length and CRC of a chunk laid out as it is written, with room left for the CRC. */
+static void
+png_seal_chunk(pnglite_t* png, unsigned char *chunk, unsigned length)
 {
-    unsigned crc;
+    set_ul(chunk, length);
+    set_ul(chunk + 8 + length, png_crc32(png, 0, chunk + 4, (size_t)length + 4));
+}
 
-    crc = png_calc_crc(name, chunk, length);
+/* Writes a whole chunk out with one call. */
+static int
+png_write_chunk(pnglite_t *png, unsigned char *chunk, unsigned length)
+{
+    png_seal_chunk(png, chunk, length);
 
-    if (file_write_ul(png, crc) != PNG_NO_ERROR)
+    if (file_write(png, chunk, length + 12, 1) != 1)
         return PNG_IO_ERROR;
 
     return PNG_NO_ERROR;
 }
 
 static int
-png_read_ihdr(pnglite_t* png)
+png_handle_ihdr(pnglite_t* png, const unsigned char* ihdr)
 {
-    int rv;
-    unsigned length;
-    unsigned char ihdr[13 + 4]; /* length should be 13, make room for type (IHDR) */
-
-    if ((rv = file_read_ul(png, &length)) != PNG_NO_ERROR)
-        return rv;
-
-    if(length != 13)
-        return PNG_CRC_ERROR;
-
-    if(file_read(png, ihdr, 1, 13 + 4) != 13 + 4)
-        return PNG_EOF_ERROR;
-
-    if (png_read_check_crc(png, "IHDR", ihdr + 4, 13) != PNG_NO_ERROR)
-        return PNG_CRC_ERROR;
+    png->width = get_ul(ihdr);
+    png->height = get_ul(ihdr+4);
+    png->depth = ihdr[8];
+    png->color_type = ihdr[9];
+    png->compression_method = ihdr[10];
+    png->filter_method = ihdr[11];
+    png->interlace_method = ihdr[12];
 
-    png->width = get_ul(ihdr+4);
-    png->height = get_ul(ihdr+8);
-    png->depth = ihdr[12];
-    png->color_type = ihdr[13];
-    png->compression_method = ihdr[14];
-    png->filter_method = ihdr[15];
-    png->interlace_method = ihdr[16];
+    png->transparency_present = 0;
+    png->palette_size = 0;
+    png->idat_seen = 0;
+    png->next_row = 0;
 
     return png_check_png(png);
 }
@@ -344,12 +810,11 @@ png_read_ihdr(pnglite_t* png)
 static int
 png_write_ihdr(pnglite_t* png)
 {
-    unsigned char ihdr[13 + 4];
-    unsigned char *p = ihdr;
-
-    file_write(png, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 1, 8);
+    unsigned char ihdr[8 + 12 + 13];
+    unsigned char *p = ihdr + 8 + 4;
 
-    file_write_ul(png, 13);
+    /* signature and IHDR go out together */
+    memcpy(ihdr, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 8);
 
     *p++ = 'I';
     *p++ = 'H';
@@ -365,48 +830,77 @@ png_write_ihdr(pnglite_t* png)
     *p++ = 0;
     *p++ = 0;
 
-    file_write(png, ihdr, 1, 13 + 4);
+    png_seal_chunk(png, ihdr + 8, 13);
+
+    if (file_write(png, ihdr, sizeof(ihdr), 1) != 1)
+        return PNG_IO_ERROR;
 
-    return png_calc_write_crc(png, "IHDR", ihdr + 4, 13);
+    return PNG_NO_ERROR;
 }
 
-int
-pnglite_read_header(pnglite_t* png)
+static void *
+z_alloc_func(void *opaque, uInt items, uInt size)
 {
-    char header[8];
-    int result;
-
-    if (!png->read)
-        return PNG_WRONG_ARGUMENTS;
-
-    if (file_read(png, header, 1, 8) != 8)
-        return PNG_EOF_ERROR;
+    pnglite_t *png = opaque;
+    size_t n = (size_t)items * size;
+    unsigned char *p;
+
+    if (!png->allocator.alloc)
+        return png->alloc(n);
+
+    p = png->allocator.alloc(png->allocator.ctx, PNG_ZALLOC_HEADER + n);
+    if (!p)
+        return NULL;
+    memcpy(p, &n, sizeof(n));
+    return p + PNG_ZALLOC_HEADER;
+}
 
-    if (memcmp(header, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 8) != 0)
-        return PNG_HEADER_ERROR;
+static void
+z_free_func(void *opaque, void *ptr)
+{
+    pnglite_t *png = opaque;
+    unsigned char *p = ptr;
+    size_t n;
 
-    result = png_read_ihdr(png);
+    if (!png->allocator.alloc) {
+        png->free(ptr);
+        return;
+    }
 
-    return result;
+    p -= PNG_ZALLOC_HEADER;
+    memcpy(&n, p, sizeof(n));
+    png_free(png, p, PNG_ZALLOC_HEADER + n);
 }
 
+/* zlib allocations of a decoder's stream, which outlives the images */
 static void *
-z_alloc_func(void *png, uInt items, uInt size)
+z_decoder_alloc_func(void *dec, uInt items, uInt size)
 {
-    return ((pnglite_t *)png)->alloc(items*size);
+    return ((pnglite_decoder_t *)dec)->alloc(items*size);
 }
 
 static void
-z_free_func(void *png, void *ptr)
+z_decoder_free_func(void *dec, void *ptr)
 {
-    ((pnglite_t *)png)->free(ptr);
+    ((pnglite_decoder_t *)dec)->free(ptr);
 }
 
 static int
 png_init_inflate(pnglite_t* png)
 {
+    pnglite_decoder_t *dec = png->decoder;
     z_stream *stream;
-    png->zs = png->alloc(sizeof(z_stream));
+
+    if (dec && dec->zs) {
+        /* window bits may have been changed for an indexed read */
+        png->zs = dec->zs;
+        dec->zs = NULL;
+        if ((png->zerr = inflateReset2(png->zs, 15)) != Z_OK)
+            return PNG_ZLIB_ERROR;
+        return PNG_NO_ERROR;
+    }
+
+    png->zs = dec ? dec->alloc(sizeof(z_stream)) : png_alloc(png, sizeof(z_stream));
 
     stream = png->zs;
 
@@ -414,17 +908,25 @@ png_init_inflate(pnglite_t* png)
         return PNG_MEMORY_ERROR;
 
     memset(stream, 0, sizeof(z_stream));
-    stream->opaque = png;
-    stream->zalloc = z_alloc_func;
-    stream->zfree = z_free_func;
+    if (dec) {
+        stream->opaque = dec;
+        stream->zalloc = z_decoder_alloc_func;
+        stream->zfree = z_decoder_free_func;
+    } else {
+        stream->opaque = png;
+        stream->zalloc = z_alloc_func;
+        stream->zfree = z_free_func;
+    }
 
     if( (png->zerr= inflateInit(stream)) != Z_OK) {
+        if (dec)
+            dec->free(png->zs);
+        else
+            png_free(png, png->zs, sizeof(z_stream));
+        png->zs = NULL;
         return PNG_ZLIB_ERROR;
     }
 
-    stream->next_out = png->png_data;
-    stream->avail_out = png->png_datalen;
-
     return PNG_NO_ERROR;
 }
 
@@ -439,266 +941,528 @@ png_end_inflate(pnglite_t* png)
 #ifdef TRACE
     fprintf(stderr, "png_end_inflate(): decompressed total_out: %lu\n", stream->total_out);
 #endif
+    if (png->decoder && !png->decoder->zs) {
+        /* keep it for the next image */
+        png->decoder->zs = stream;
+        png->zs = NULL;
+        return result;
+    }
+
     if((png->zerr = inflateEnd(stream)) != Z_OK) {
         png->zmsg = stream->msg;
         result = PNG_ZLIB_ERROR;
     }
 
-    png->free(png->zs);
+    png_free(png, png->zs, sizeof(z_stream));
+    png->zs = NULL;
 
     return result;
 }
 
 static int
-png_inflate(pnglite_t* png, unsigned char* data, int len)
+png_write_iend(pnglite_t* png)
 {
-    z_stream *stream = png->zs;
-
-    if(!stream)
-        return PNG_MEMORY_ERROR;
-
-    stream->next_in = (unsigned char*)data;
-    stream->avail_in = len;
+    unsigned char iend[12];
 
-    png->zerr = inflate(stream, Z_SYNC_FLUSH);
-
-    if(png->zerr != Z_STREAM_END && png->zerr != Z_OK) {
-#ifdef TRACE
-        fprintf(stderr, "png_inflate(): zlib error: %s\n", stream->msg);
-#endif
-        png->zmsg = stream->msg;
-        return PNG_ZLIB_ERROR;
-    }
-
-    if(stream->avail_in != 0) { /* FIXME: not an error exactly. a warning ? */
-#ifdef TRACE
-        fprintf(stderr, "png_inflate(): zlib error: stream->avail_in != 0 : %d\n", stream->avail_in);
-        fprintf(stderr, "png_inflate(): len was %d; total_out = %lu\n", len, stream->total_out);
-        unsigned char buf[4096];
-        stream->next_out = buf;
-        stream->avail_out = 4096;
-        int res = inflate(stream, Z_SYNC_FLUSH);
-        fprintf(stderr, "png_inflate(): another pass; res=%d (%s), total_out=%lu\n", res,stream->msg, stream->total_out);
-#endif
-        return PNG_ZLIB_ERROR;
-    }
+    memcpy(iend + 4, "IEND", 4);
 
-    return PNG_NO_ERROR;
+    return png_write_chunk(png, iend, 0);
 }
 
+#ifdef PNG_THREADS
+/*  Parallel deflate, pigz style: the filtered image is cut into strips
+    of whole rows, each compressed by a worker into a raw deflate stream
+    that is primed with the 32K of data before it and ends on a sync flush,
+    so their concatenation is a single valid deflate stream. The zlib header
+    goes in front of the first one, the combined Adler-32 after the last,
+    and each strip is written out as an IDAT of its own. */
+
+/* least filtered bytes in a strip */
+#define PNG_STRIP_SIZE (256*1024)
+
+typedef struct {
+    pnglite_t*              png;
+    const unsigned char*    data;
+    size_t                  size;
+    size_t                  strip_size;
+    unsigned                nstrips;
+    unsigned char**         idat;       /* IDAT chunk of each strip, CRC not yet there */
+    size_t*                 idat_size;  /* allocated for it */
+    size_t*                 idat_len;   /* without the CRC */
+    unsigned long*          adler;      /* Adler-32 of each strip */
+} png_strips_t;
+
+/* bytes of the arrays above per strip */
+#define PNG_STRIP_BOOKKEEPING (sizeof(unsigned char*) + 2 * sizeof(size_t) + sizeof(unsigned long))
+
+typedef struct {
+    png_strips_t*           strips;
+    unsigned                first;      /* does every step-th strip starting with this */
+    unsigned                step;
+    int                     err;
+} png_deflate_worker_t;
 
 static int
-png_write_idats(pnglite_t* png, unsigned char* data)
+png_deflate_strip(png_strips_t* s, unsigned i)
 {
-    unsigned char *idat;
-    unsigned long  written;
-    unsigned crc;
-    unsigned size;
-    int err;
+    const size_t start = (size_t)i * s->strip_size;
+    const size_t len = s->size - start < s->strip_size ? s->size - start : s->strip_size;
+    const size_t dict = start < 32768 ? start : 32768;
+    const int last = (i == s->nstrips - 1);
+    const size_t head = 8 + (i == 0 ? 2 : 0);
+    unsigned char* idat;
+    size_t bound;
+    z_stream zs;
+    int rv;
+
+    memset(&zs, 0, sizeof(z_stream));
+    zs.opaque = s->png;
+    zs.zalloc = z_alloc_func;
+    zs.zfree = z_free_func;
+
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return PNG_ZLIB_ERROR;
 
-    size = 8 + compressBound(png->height * png->pitch) + 4;
-    idat = png->alloc(size);
+    if (dict && deflateSetDictionary(&zs, s->data + start - dict, dict) != Z_OK) {
+        deflateEnd(&zs);
+        return PNG_ZLIB_ERROR;
+    }
 
+    /* room for the sync flush marker and the Adler-32, then the CRC */
+    bound = deflateBound(&zs, len) + 16;
+    idat = png_alloc(s->png, head + bound + 4);
     if (!idat) {
-        err = PNG_MEMORY_ERROR;
-        goto done;
+        deflateEnd(&zs);
+        return PNG_MEMORY_ERROR;
     }
 
-    memcpy(idat + 4, "IDAT", 4);
+    zs.next_in = (Bytef*)(s->data + start);
+    zs.avail_in = len;
+    zs.next_out = idat + head;
+    zs.avail_out = bound - 4;
 
-    written = size - 12;
+    rv = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+    deflateEnd(&zs);
+    if (rv != (last ? Z_STREAM_END : Z_OK) || zs.avail_in || zs.avail_out == 0) {
+        png_free(s->png, idat, head + bound + 4);
+        return PNG_ZLIB_ERROR;
+    }
 
-    png->zerr = compress(idat + 8, &written, data, png->height * ( png->pitch + 1));
-    if (png->zerr != Z_OK) {
-        err = PNG_ZLIB_ERROR;
-        goto done;
+    memcpy(idat + 4, "IDAT", 4);
+    if (i == 0) {
+        /* deflate, 32K window, default compression */
+        idat[8] = 0x78;
+        idat[9] = 0x9c;
     }
 
-    set_ul(idat, written);
-    crc = png_calc_crc("IDAT", idat + 8, written);
+    s->idat[i] = idat;
+    s->idat_size[i] = head + bound + 4;
+    s->idat_len[i] = head + bound - 4 - zs.avail_out;
+    s->adler[i] = adler32(adler32(0L, Z_NULL, 0), s->data + start, len);
 
-    if (file_write(png, idat, written + 8, 1) != 1) {
-        err = PNG_IO_ERROR;
-        goto done;
-    }
-    if (PNG_NO_ERROR != file_write_ul(png, crc)) {
-        err = PNG_IO_ERROR;
-        goto done;
-    }
+    return PNG_NO_ERROR;
+}
 
-    /* write IEND chunk */
-    file_write_ul(png, 0);
-    file_write(png, "IEND", 1, 4);
-    crc = crc32(0L, (const unsigned char *)"IEND", 4);
-    file_write_ul(png, crc);
+static void*
+png_deflate_worker(void* arg)
+{
+    png_deflate_worker_t* w = arg;
+    unsigned i;
 
-    err =  PNG_NO_ERROR;
+    for (i = w->first; i < w->strips->nstrips && !w->err; i += w->step)
+        w->err = png_deflate_strip(w->strips, i);
 
-  done:
-    png->free(idat);
-    return err;
+    return NULL;
 }
 
 static int
-png_read_idat(pnglite_t* png, unsigned firstlen)
+png_write_idats_parallel(pnglite_t* png, const unsigned char* data)
 {
-    unsigned type = 0;
-    unsigned char *chunk;
-    int result;
-    unsigned length = firstlen;
-    unsigned old_len = length;
-
-    chunk = png->alloc(firstlen);
-
-    if (!chunk)
+    png_strips_t s;
+    png_deflate_worker_t workers[PNG_MAX_THREADS];
+    pthread_t threads[PNG_MAX_THREADS];
+    unsigned char started[PNG_MAX_THREADS];
+    const size_t rowbytes = png->pitch + 1;
+    unsigned nthreads = png->threads > PNG_MAX_THREADS ? PNG_MAX_THREADS : png->threads;
+    unsigned long adler;
+    unsigned t, i;
+    int err = PNG_NO_ERROR;
+
+    s.png = png;
+    s.data = data;
+    s.size = rowbytes * png->height;
+    s.strip_size = (PNG_STRIP_SIZE + rowbytes - 1) / rowbytes * rowbytes;
+    s.nstrips = (s.size + s.strip_size - 1) / s.strip_size;
+    if (nthreads > s.nstrips)
+        nthreads = s.nstrips;
+
+    s.idat = png_alloc(png, s.nstrips * PNG_STRIP_BOOKKEEPING);
+    if (!s.idat)
         return PNG_MEMORY_ERROR;
+    s.idat_size = (size_t*)(s.idat + s.nstrips);
+    s.idat_len = s.idat_size + s.nstrips;
+    s.adler = (unsigned long*)(s.idat_len + s.nstrips);
+    memset(s.idat, 0, s.nstrips * sizeof(unsigned char*));
+
+    /* the calling thread is worker 0 */
+    for (t = 0; t < nthreads; t++) {
+        workers[t].strips = &s;
+        workers[t].first = t;
+        workers[t].step = nthreads;
+        workers[t].err = PNG_NO_ERROR;
+        started[t] = t > 0 && pthread_create(&threads[t], NULL, png_deflate_worker, &workers[t]) == 0;
+    }
+    png_deflate_worker(&workers[0]);
+    for (t = 1; t < nthreads; t++) {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+        else
+            png_deflate_worker(&workers[t]);
+    }
+    for (t = 0; t < nthreads; t++)
+        if (workers[t].err && !err)
+            err = workers[t].err;
+
+    if (err == PNG_NO_ERROR) {
+        adler = s.adler[0];
+        for (i = 1; i < s.nstrips; i++) {
+            const size_t len = s.size - (size_t)i * s.strip_size < s.strip_size
+                                ? s.size - (size_t)i * s.strip_size : s.strip_size;
+            adler = adler32_combine(adler, s.adler[i], len);
+        }
+        set_ul(s.idat[s.nstrips - 1] + s.idat_len[s.nstrips - 1], adler);
+        s.idat_len[s.nstrips - 1] += 4;
 
-    result = png_init_inflate(png);
-
-    if(result != PNG_NO_ERROR) {
-        png_end_inflate(png);
-        png->free(chunk);
-        return result;
+        for (i = 0; i < s.nstrips && err == PNG_NO_ERROR; i++)
+            err = png_write_chunk(png, s.idat[i], (unsigned)(s.idat_len[i] - 8));
     }
 
-    do {
-        if(file_read(png, chunk, 1, length) != length) {
-            png_end_inflate(png);
-            png->free(chunk);
-            return PNG_FILE_ERROR;
-        }
+    for (i = 0; i < s.nstrips; i++)
+        if (s.idat[i])
+            png_free(png, s.idat[i], s.idat_size[i]);
+    png_free(png, s.idat, s.nstrips * PNG_STRIP_BOOKKEEPING);
 
-        if (png_read_check_crc(png, "IDAT", chunk, length)) {
-            result = PNG_CRC_ERROR;
-            break;
-        }
+    if (err == PNG_NO_ERROR)
+        err = png_write_iend(png);
 
-        result = png_inflate(png, chunk, length);
+    return err;
+}
+#endif /* PNG_THREADS */
 
-        if (result != PNG_NO_ERROR)
-            break;
+static int
+png_init_deflate(pnglite_t* png)
+{
+    z_stream *stream;
+    png->zs = png_alloc(png, sizeof(z_stream));
 
-        if ((result = file_read_ul(png, &length)) != PNG_NO_ERROR)
-            break;
+    stream = png->zs;
 
-        if (length > png->chunk_size_limit) {
-#ifdef TRACE
-            fprintf(stderr, "png_read_idat(): aborting on chunk size %d (over user limit of %d)\n", length, chunk_size_limit);
-#endif
-            png->free(chunk);
-            return PNG_OVERSIZE_CHUNK;
+    if(!stream)
+        return PNG_MEMORY_ERROR;
 
-        }
+    memset(stream, 0, sizeof(z_stream));
+    stream->opaque = png;
+    stream->zalloc = z_alloc_func;
+    stream->zfree = z_free_func;
 
-        if(length > old_len) {
-            png->free(chunk);
-            chunk = png->alloc(length);
-            if (!chunk) {
-                result = PNG_MEMORY_ERROR;
-                break;
-            }
-            old_len = length;
-        }
+    if( (png->zerr = deflateInit(stream, Z_DEFAULT_COMPRESSION)) != Z_OK) {
+        png_free(png, png->zs, sizeof(z_stream));
+        png->zs = NULL;
+        return PNG_ZLIB_ERROR;
+    }
 
-        if(file_read(png, &type, 1, 4) != 4) {
-            result = PNG_IO_ERROR;
-            break;
+    return PNG_NO_ERROR;
+}
+
+/* Writes out whatever deflate has put into the IDAT buffer, if anything. */
+static int
+png_write_idat(pnglite_t* png)
+{
+    z_stream *stream = png->zs;
+    unsigned char *idat = png->window;
+    const unsigned length = PNG_IDAT_SIZE - stream->avail_out;
+
+    if (length == 0)
+        return PNG_NO_ERROR;
+
+    if (png_write_chunk(png, idat, length) != PNG_NO_ERROR)
+        return PNG_IO_ERROR;
+
+    stream->next_out = idat + 8;
+    stream->avail_out = PNG_IDAT_SIZE;
+
+    return PNG_NO_ERROR;
+}
+
+/* Deflates data into the IDAT buffer, writing it out each time it fills up. */
+static int
+png_deflate_data(pnglite_t* png, const unsigned char* data, unsigned length, int flush)
+{
+    z_stream *stream = png->zs;
+    int result;
+
+    stream->next_in = (Bytef *)data;
+    stream->avail_in = length;
+
+    for (;;) {
+        png->zerr = deflate(stream, flush);
+        if (png->zerr != Z_OK && png->zerr != Z_STREAM_END) {
+            png->zmsg = stream->msg;
+            return PNG_ZLIB_ERROR;
         }
+        if (stream->avail_out == 0 || png->zerr == Z_STREAM_END)
+            if ((result = png_write_idat(png)) != PNG_NO_ERROR)
+                return result;
+        if (png->zerr == Z_STREAM_END)
+            return PNG_NO_ERROR;
+        if (flush != Z_FINISH && stream->avail_in == 0 && stream->avail_out != 0)
+            return PNG_NO_ERROR;
+    }
+}
 
-    } while(type == *(unsigned int*)"IDAT");
+/*  Where R, G, B and A go in each 4-byte pixel of the PNG_FORMAT_* layouts. */
+static const unsigned char png_format_order[5][4] = {
+    {0, 0, 0, 0},
+    {0, 1, 2, 3},   /* PNG_FORMAT_RGBA */
+    {2, 1, 0, 3},   /* PNG_FORMAT_BGRA */
+    {1, 2, 3, 0},   /* PNG_FORMAT_ARGB */
+    {3, 2, 1, 0}    /* PNG_FORMAT_ABGR */
+};
 
-    if(type == *(unsigned int*)"IEND") {
-        result = PNG_DONE;
-    } else {
-#ifdef TRACE
-        char *chtype = (char *)(&type);
-        fprintf(stderr, "png_read_idat() unexpected chunk '%c%c%c%c' after an IDAT\n", chtype[0], chtype[1], chtype[2], chtype[3]);
-#endif
-        result = PNG_CORRUPTED;
+/* x / 255 rounded, exactly, for x up to 255 * 255. */
+static unsigned
+png_div255(unsigned x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+/*  Fills png->lut with the output pixel for each palette index or grey
+    level, grey scaled up to 8 bits, tRNS made into alpha and colors
+    premultiplied if asked for. */
+static void
+png_build_lut(pnglite_t* png)
+{
+    const unsigned char *order = png_format_order[png->out_format];
+    const unsigned levels = 1u << png->depth;
+    unsigned char *dst;
+    unsigned v, grey;
+
+    for (v = 0; v < 256; v++) {
+        dst = png->lut + 4 * v;
+        if (png->color_type == PNG_INDEXED) {
+            dst[order[0]] = png->palette[3 * v + 0];
+            dst[order[1]] = png->palette[3 * v + 1];
+            dst[order[2]] = png->palette[3 * v + 2];
+            dst[order[3]] = png->palette[768 + v];
+        } else {
+            grey = v < levels ? v * 255 / (levels - 1) : 0;
+            dst[order[0]] = dst[order[1]] = dst[order[2]] = (unsigned char)grey;
+            dst[order[3]] = (png->transparency_present && v == png->colorkey[1]) ? 0 : 255;
+        }
+        if (png->premultiply) {
+            dst[order[0]] = (unsigned char)png_div255(dst[order[0]] * dst[order[3]]);
+            dst[order[1]] = (unsigned char)png_div255(dst[order[1]] * dst[order[3]]);
+            dst[order[2]] = (unsigned char)png_div255(dst[order[2]] * dst[order[3]]);
+        }
     }
+}
+
+static int
+png_handle_plte(pnglite_t* png, const unsigned char* plte, unsigned length)
+{
+    if (length % 3)
+        return PNG_CORRUPTED;
 
-    png->free(chunk);
-    png_end_inflate(png);
+    png->palette_size = length / 3;
 
-    return result;
+    memset(png->palette, 255, 1024);
+    memcpy(png->palette, plte, length);
+
+    return PNG_NO_ERROR;
 }
 
 static int
-png_process_chunk(pnglite_t* png)
+png_handle_trns(pnglite_t* png, const unsigned char* trns, unsigned length)
 {
-    int result = PNG_NO_ERROR;
-    unsigned type;
-    unsigned length;
+    png->transparency_present = 1;
+    switch (png->color_type) {
+    case PNG_INDEXED:
+        /* no PLTE seen before tRNS */
+        if (png->palette_size == 0)
+            return PNG_CORRUPTED;
+
+        if (length > 256)
+            return PNG_CORRUPTED;
+
+        memcpy(png->palette + 768, trns, length);
+        return PNG_NO_ERROR;
+
+    case PNG_TRUECOLOR:
+        if (length != 6)
+            return PNG_CORRUPTED;
+
+        memcpy(png->colorkey, trns, length);
+        return PNG_NO_ERROR;
+
+    case PNG_GREYSCALE:
+        if (length != 2)
+            return PNG_CORRUPTED;
+
+        memcpy(png->colorkey, trns, length);
+        return PNG_NO_ERROR;
+
+    default:
+        return PNG_CORRUPTED;
+    }
+}
+
+/*  Bytes of an IDAT payload to CRC at a time just ahead of inflate,
+    small enough that they are still in L1 when inflate reads them. */
+#define PNG_CRC_BLOCK (8 * 1024)
+
+/*  Extends the CRC of the IDAT being inflated over up to n more of its
+    bytes, and checks it against the stored one once they are all in. */
+static int
+png_idat_crc(pnglite_t* png, size_t n)
+{
+    z_stream *stream = png->zs;
+    const unsigned char *end = stream->next_in + stream->avail_in;
 
-    if (file_read_ul(png, &length) != PNG_NO_ERROR) { return PNG_EOF_ERROR; }
+    if (n > png->idat_unchecked)
+        n = png->idat_unchecked;
 
-    if (file_read(png, &type, 4, 1) != 1) { return PNG_EOF_ERROR; }
+    png->idat_crc = png_crc32(png, png->idat_crc, end - png->idat_unchecked, n);
+    png->idat_unchecked -= (unsigned)n;
 
-    if (length > png->chunk_size_limit) {
+    if (png->idat_unchecked == 0 && png->idat_crc != get_ul(end)) {
 #ifdef TRACE
-        char *chtype = (char *)(&type);
-        fprintf(stderr, "png_process_chunk() aborting on chunk '%c%c%c%c' length %u : over chunk size limit %u\n",
-               chtype[0], chtype[1], chtype[2], chtype[3], length, chunk_size_limit);
+        fprintf(stderr, "png_idat_crc(): CRC mismatch in IDAT\n");
 #endif
-        return PNG_OVERSIZE_CHUNK;
+        return PNG_CRC_ERROR;
     }
-    if (type == *(unsigned int *) "PLTE") {
-        if (length % 3)
-            return PNG_CORRUPTED;
 
-        png->palette_size = length / 3;
+    return PNG_NO_ERROR;
+}
 
-        memset(png->palette, 255, 1024);
+/*  Finishes the CRC of the IDAT being inflated. Called before rows are
+    handed out, so none decoded from a corrupt chunk ever are. */
+static int
+png_idat_verify(pnglite_t* png)
+{
+    if (png->state != PNG_STATE_IDAT || png->idat_unchecked == 0)
+        return PNG_NO_ERROR;
 
-        if (file_read(png, png->palette, length, 1) != 1)
-            return PNG_EOF_ERROR;
+    return png_idat_crc(png, png->idat_unchecked);
+}
 
-        if (png_read_check_crc(png, "PLTE", png->palette, length) != PNG_NO_ERROR)
-            return PNG_CRC_ERROR;
+/*  Parses the next piece of input: the signature or a whole chunk.
+
+    Returns PNG_IDAT_FOUND once an IDAT payload is handed over to inflate;
+    the chunk stays in the input buffer until the next call. Returns
+    PNG_DONE on IEND and PNG_NEED_MORE if pushed input ran out. */
+static int
+png_parse_chunk(pnglite_t* png)
+{
+    z_stream *stream = png->zs;
+    unsigned char *chunk;
+    unsigned length, type;
+    int result;
 
-    } else if (type == *(unsigned int*)"tRNS") {
-        png->transparency_present = 1;
-        switch (png->color_type) {
-        case PNG_INDEXED:
-            /* no PLTE seen before tRNS */
-            if (png->palette_size == 0)
-                return PNG_CORRUPTED;
+    switch (png->state) {
+    case PNG_STATE_SIGNATURE:
+        if ((result = png_need(png, 8)) != PNG_NO_ERROR)
+            return result;
 
-            if (length > 256)
-                return PNG_CORRUPTED;
+        if (memcmp(png->in + png->in_pos, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 8) != 0)
+            return PNG_HEADER_ERROR;
 
-            if (file_read(png, png->palette + 768, length, 1) != 1)
-                return PNG_EOF_ERROR;
+        png->in_pos += 8;
+        png->state = PNG_STATE_IHDR;
+        return PNG_NO_ERROR;
 
-            return png_read_check_crc(png, "tRNS", png->palette + 768, length);
+    case PNG_STATE_SKIP:
+        if ((result = png_skip(png)) != PNG_NO_ERROR)
+            return result;
 
-        case PNG_TRUECOLOR:
-            if (length != 6)
-                return PNG_CORRUPTED;
+        png->state = PNG_STATE_CHUNK;
+        return PNG_NO_ERROR;
 
-            if (file_read(png, png->colorkey, length, 1) != 1)
-                return PNG_EOF_ERROR;
+    case PNG_STATE_IDAT:
+        /* done with the payload, whether inflate used all of it or not */
+        if ((result = png_idat_verify(png)) != PNG_NO_ERROR)
+            return result;
+        png->in_pos = (size_t)(stream->next_in + stream->avail_in - png->in) + 4;
+        stream->avail_in = 0;
+        png->state = PNG_STATE_CHUNK;
+        return PNG_NO_ERROR;
 
-            if (png_read_check_crc(png, "tRNS", png->colorkey, length) != PNG_NO_ERROR)
-                return PNG_CRC_ERROR;
+    case PNG_STATE_END:
+        return PNG_DONE;
 
-            return PNG_NO_ERROR;
+    default:
+        break;
+    }
 
-        case PNG_GREYSCALE:
-            if (length != 2)
-                return PNG_CORRUPTED;
+    if ((result = png_need(png, 8)) != PNG_NO_ERROR)
+        return result;
 
-            file_read(png, png->colorkey, length, 1);
+    chunk = png->in + png->in_pos;
+    length = get_ul(chunk);
+    memcpy(&type, chunk + 4, 4);
 
-            if (png_read_check_crc(png, "tRNS", png->colorkey, length) != PNG_NO_ERROR)
-                return PNG_CRC_ERROR;
+    if (png->state == PNG_STATE_IHDR) {
+        if ((length != 13) || (type != *(unsigned int*)"IHDR"))
+            return PNG_CRC_ERROR;
+    } else if (length > png->chunk_size_limit) {
+#ifdef TRACE
+        char *chtype = (char *)(&type);
+        fprintf(stderr, "png_parse_chunk() aborting on chunk '%c%c%c%c' length %u : over chunk size limit %u\n",
+               chtype[0], chtype[1], chtype[2], chtype[3], length, png->chunk_size_limit);
+#endif
+        return PNG_OVERSIZE_CHUNK;
+    }
 
-            return PNG_NO_ERROR;
+    /*  if we found an idat, all other idats should follow
+        with no other chunks in between */
+    if (png->idat_seen && (type != *(unsigned int*)"IDAT") && (type != *(unsigned int*)"IEND")) {
+#ifdef TRACE
+        char *chtype = (char *)(&type);
+        fprintf(stderr, "png_parse_chunk() unexpected chunk '%c%c%c%c' after an IDAT\n", chtype[0], chtype[1], chtype[2], chtype[3]);
+#endif
+        return PNG_CORRUPTED;
+    }
 
-        default:
-            return PNG_CORRUPTED;
-        }
-    } else if (type == *(unsigned int*)"IDAT") {
+    if ((png->state == PNG_STATE_CHUNK) &&
+        (type != *(unsigned int*)"IDAT") && (type != *(unsigned int*)"IEND") &&
+        (type != *(unsigned int*)"PLTE") && (type != *(unsigned int*)"tRNS")) {
+#ifdef TRACE
+        char *chtype = (char*)(&type);
+        fprintf(stderr, "png_parse_chunk(): skipping '%c%c%c%c' of %d bytes\n", chtype[0],  chtype[1], chtype[2], chtype[3], length);
+#endif
+        png->in_pos += 8;
+        png->skip = (size_t)length + 4;
+        png->state = PNG_STATE_SKIP;
+        return PNG_NO_ERROR;
+    }
+
+    if ((result = png_need(png, (size_t)length + 12)) != PNG_NO_ERROR)
+        return result;
+
+    chunk = png->in + png->in_pos;
+
+    /* image data yet to be inflated is checked as inflate gets to it */
+    if ((type != *(unsigned int*)"IDAT" || png->decoded || length == 0) &&
+            png_check_crc(png, chunk, length) != PNG_NO_ERROR)
+        return PNG_CRC_ERROR;
+
+    if (png->state == PNG_STATE_IHDR) {
+        png->in_pos += 12 + length;
+        png->state = PNG_STATE_CHUNK;
+        return png_handle_ihdr(png, chunk + 8);
+    }
+
+    if (type == *(unsigned int*)"IDAT") {
         /* PNG_INDEXED has to have PLTE before IDAT */
         if ((png->color_type == PNG_INDEXED) && (png->palette_size == 0)) {
 #ifdef TRACE
@@ -706,465 +1470,3059 @@ png_process_chunk(pnglite_t* png)
 #endif
             return PNG_CORRUPTED;
         }
+        if (!png->idat_seen && png->lut)
+            png_build_lut(png);
+        png->idat_seen = 1;
+
+        /* image data past the last scanline is ignored */
+        if (png->decoded) {
+            png->in_pos += 12 + length;
+            return PNG_NO_ERROR;
+        }
 
-        /*  if we found an idat, all other idats should follow
-            with no other chunks in between */
-        png->png_datalen = get_decompressed_data_size(png);
-        png->png_data = png->alloc(png->png_datalen);
+        png->chunk_length = length;
+        png->idat_crc = png_crc32(png, 0, chunk + 4, 4);
+        png->idat_unchecked = length;
+        stream->next_in = chunk + 8;
+        stream->avail_in = length;
+        png->state = PNG_STATE_IDAT;
 
-        if(!png->png_data)
-            return PNG_MEMORY_ERROR;
+        return PNG_IDAT_FOUND;
+    }
 
-        return png_read_idat(png, length);
-    } else if (type == *(unsigned int*)"IEND") {
+    png->in_pos += 12 + length;
+
+    if (type == *(unsigned int*)"IEND") {
+        png->state = PNG_STATE_END;
         return PNG_DONE;
-    } else {
-#ifdef TRACE
-        char *chunk = (char*)(&type);
-        fprintf(stderr, "png_process_chunk(): skipping '%c%c%c%c' of %d bytes\n", chunk[0],  chunk[1], chunk[2], chunk[3], length);
-#endif
-        if (file_read(png, 0, length + 4, 1) != 1) /* unknown chunk */
-            return PNG_EOF_ERROR;
     }
 
-    return result;
+    if (type == *(unsigned int*)"PLTE")
+        return png_handle_plte(png, chunk + 8, length);
+
+    return png_handle_trns(png, chunk + 8, length);
 }
 
-static int
-png_write_plte(pnglite_t *png)
+int
+pnglite_read_header(pnglite_t* png)
 {
-    unsigned char plte[4 + 4 + 768 + 4];
-    unsigned i;
-    const unsigned length = png->palette_size * 3;
+    int result;
 
-    if ((png->palette_size > 256) || (png->palette_size == 0))
-        return PNG_CORRUPTED;
+    if (!png->read && !png->mem)
+        return PNG_WRONG_ARGUMENTS;
 
-    memcpy(plte + 4, "PLTE", 4);
-    for(i = 0 ; i < png->palette_size; i++) {
-        plte[8 + 3*i + 0] = png->palette[4*i + 0];
-        plte[8 + 3*i + 1] = png->palette[4*i + 1];
-        plte[8 + 3*i + 2] = png->palette[4*i + 2];
+    png->state = PNG_STATE_SIGNATURE;
+    png->idat_seen = 0;
+
+    do {
+        result = png_parse_chunk(png);
+    } while ((result == PNG_NO_ERROR) && (png->state != PNG_STATE_CHUNK));
+
+    /* unless reading ahead, reads are exact and nothing is left over */
+    if (!png->mem && ((png->in_pos == png->in_len) || (result != PNG_NO_ERROR))) {
+        png_scratch_free(png, png->in, png->in_size);
+        png->in = NULL;
+        png->in_size = png->in_len = png->in_pos = 0;
     }
 
-    set_ul(plte, length);
+    return result;
+}
 
-    if (file_write(png, plte, length + 8, 1) != 1)
-        return PNG_IO_ERROR;
+/* Parses chunks up to the next IDAT payload. */
+static int
+png_next_idat(pnglite_t* png)
+{
+    int result;
+
+    do {
+        result = png_parse_chunk(png);
+    } while (result == PNG_NO_ERROR);
+
+    if (result == PNG_DONE) {
+#ifdef TRACE
+        fprintf(stderr, "png_next_idat(): IEND before the image data is complete\n");
+#endif
+        return PNG_CORRUPTED;
+    }
 
-    return png_calc_write_crc(png, "PLTE", plte + 8, length);
+    return result == PNG_IDAT_FOUND ? PNG_NO_ERROR : result;
 }
 
+/* makes room for extra more bytes of checkpoints in index->data */
 static int
-png_write_trns(pnglite_t *png)
+png_index_reserve(pnglite_t* png, pnglite_index_t* index, size_t extra)
 {
-    unsigned char trns[4 + 4 + 256 + 4];
-    unsigned i;
-    unsigned length;
+    size_t size = index->data_size ? index->data_size : 64 * 1024;
+    unsigned char *data;
 
-    switch (png->color_type) {
-    case PNG_INDEXED:
-        length = png->palette_size;
-        for(i = 0 ; i < png->palette_size; i++)
-            trns[8 + i] = png->palette[4*i + 3];
-        break;
+    if (index->data_size - index->data_len >= extra)
+        return PNG_NO_ERROR;
 
-    case PNG_GREYSCALE:
-        length = 2;
-        trns[8 + 0] = 0;
-        trns[8 + 1] = png->colorkey[1];
-        break;
+    while (size - index->data_len < extra)
+        size *= 2;
 
-    case PNG_TRUECOLOR:
-        length = 6;
-        trns[8 + 0] = 0;
-        trns[8 + 1] = png->colorkey[1];
-        trns[8 + 2] = 0;
-        trns[8 + 3] = png->colorkey[3];
-        trns[8 + 4] = 0;
-        trns[8 + 5] = png->colorkey[5];
-        break;
+    data = png_alloc(png, size);
+    if (!data)
+        return PNG_MEMORY_ERROR;
 
-    default:
-        return PNG_TRNS_WRONG_COLORTYPE;
-    }
-    memmove(trns + 4, "tRNS", 4);
-    set_ul(trns, length);
+    if (index->data_len > 0)
+        memcpy(data, index->data, index->data_len);
 
-    if (file_write(png, trns, length + 8, 1) != 1)
-        return PNG_IO_ERROR;
+    png_free(png, index->data, index->data_size);
+    index->data = data;
+    index->data_size = size;
 
-    return png_calc_write_crc(png, "tRNS", trns + 8, length);
+    return PNG_NO_ERROR;
 }
 
-static unsigned char
-png_paeth_predictor(unsigned char a, unsigned char b, unsigned char c)
+/* called whenever inflate returns while an index is built */
+static int
+png_index_checkpoint(pnglite_t* png)
 {
-    int p = (int)a + b - c;
-    int pa = abs(p - a);
-    int pb = abs(p - b);
-    int pc = abs(p - c);
-    int pr;
+    pnglite_index_t *index = png->index;
+    z_stream *stream = png->zs;
+    const unsigned fill = (unsigned)(stream->next_out - png->prev_scanline);
+    const unsigned bits = stream->data_type & 7;
+    unsigned char *p;
+    uInt window_len;
+    size_t offset;
+    int result;
 
-    if(pa <= pb && pa <= pc)
-        pr = a;
-    else if(pb <= pc)
-        pr = b;
-    else
-        pr = c;
+    /* only between two deflate blocks, a strip past the last checkpoint */
+    if (!(stream->data_type & 128) || (stream->data_type & 64) || (png->pass_row < index->next_row))
+        return PNG_NO_ERROR;
 
-    return (char)pr;
-}
+    /* the byte those bits are from is in the previous IDAT, wait for the next block */
+    if (bits && (stream->avail_in == png->chunk_length))
+        return PNG_NO_ERROR;
 
-static int
-png_filter(pnglite_t* png, unsigned char* data)
-{
-    (void)(png); (void)(data);
-    return PNG_NO_ERROR;
-}
+    result = png_index_reserve(png, index, PNG_CHECKPOINT_SIZE + 32768 + (size_t)png->pitch + fill);
+    if (result != PNG_NO_ERROR)
+        return result;
 
-static int
-png_unfilter(pnglite_t* png, unsigned char* data)
-{
-    unsigned i, p, t;
-    unsigned char a, b, c;
-    unsigned char *filtered;
-    unsigned char *reconstructed;
-    unsigned char *up_reconstructed;
-    unsigned char filter_type;
-    for(i = 0; i < png->height ; i++) {
-        filtered = png->png_data + (png->pitch + 1) * i;
-        reconstructed = data + png->pitch * i;
-        up_reconstructed = i > 0 ? data + png->pitch * (i - 1) : 0;
-        filter_type = *filtered++;
-        switch(filter_type) {
-        case PNG_FILTER_NONE:
-            memcpy(reconstructed, filtered, png->pitch);
-            break;
+    p = index->data + index->data_len;
+    if ((png->zerr = inflateGetDictionary(stream, p + PNG_CHECKPOINT_SIZE, &window_len)) != Z_OK)
+        return PNG_ZLIB_ERROR;
 
-        case PNG_FILTER_SUB:
-            memcpy(reconstructed, filtered, png->stride);
-            for (p = png->stride; p < png->pitch ; p++)
-                reconstructed[p] = filtered[p]
-                                        + reconstructed[p - png->stride];
-            break;
+    memcpy(p + PNG_CHECKPOINT_SIZE + window_len, png->scanline + 1, png->pitch);
+    memcpy(p + PNG_CHECKPOINT_SIZE + window_len + png->pitch, png->prev_scanline, fill);
 
-        case PNG_FILTER_UP:
-            if (up_reconstructed)
-                for (p = 0; p < png->pitch ; p++)
-                    reconstructed[p] = filtered[p] + up_reconstructed[p];
-            else
-                memcpy(reconstructed, filtered, png->pitch);
-            break;
+    /* reads are exact, the buffer ends where the stream is at */
+    offset = png->read_pos - (size_t)(png->in + png->in_len - stream->next_in);
 
-        case PNG_FILTER_AVERAGE:
-            for (p = 0; p < png->pitch ; p++) {
-                b = up_reconstructed ? up_reconstructed[p] : 0;
-                a = p >= png->stride ? reconstructed[p - png->stride] : 0;
-                t = a + b;
-                reconstructed[p] = filtered[p] + t/2;
-            }
-            break;
+    set_ul(p, (unsigned)(offset >> 16 >> 16));
+    set_ul(p + 4, (unsigned)offset);
+    set_ul(p + 8, stream->avail_in);
+    set_ul(p + 12, png->pass_row);
+    set_ul(p + 16, fill);
+    set_ul(p + 20, window_len);
+    p[24] = (unsigned char)bits;
+    p[25] = bits ? stream->next_in[-1] : 0;
 
-        case PNG_FILTER_PAETH:
-            for (p = 0; p < png->pitch ; p++) {
-                c = (up_reconstructed && (p >= png->stride)) ?
-                                    up_reconstructed[p - png->stride] : 0;
-                b = up_reconstructed ? up_reconstructed[p] : 0;
-                a = p >= png->stride ? reconstructed[p - png->stride] : 0;
-                reconstructed[p] = filtered[p] + png_paeth_predictor(a, b, c);
-            }
-            break;
+    index->data_len += PNG_CHECKPOINT_SIZE + window_len + png->pitch + fill;
+    index->count += 1;
+    index->next_row = png->pass_row + index->strip_rows;
 
-        default:
+    return PNG_NO_ERROR;
+}
+
+/*  Inflates len bytes of filtered image data into out, moving on to
+    the following IDAT chunks as the current one runs dry. On PNG_NEED_MORE
+    stream->avail_out tells how much is still missing. */
+static int
+png_inflate(pnglite_t* png, unsigned char* out, unsigned len)
+{
+    z_stream *stream = png->zs;
+    uInt unchecked;
+    int result;
+
+    if(!stream)
+        return PNG_MEMORY_ERROR;
+
+    stream->next_out = out;
+    stream->avail_out = len;
+
+    while (stream->avail_out > 0) {
+        while (stream->avail_in == 0) {
+            if ((result = png_next_idat(png)) != PNG_NO_ERROR)
+                return result;
+        }
+
+        /*  inflate only gets the input the CRC has been run over, a block
+            at a time, so it's fetched from memory once for both */
+        if (stream->avail_in == png->idat_unchecked)
+            if ((result = png_idat_crc(png, PNG_CRC_BLOCK)) != PNG_NO_ERROR)
+                return result;
+        unchecked = png->idat_unchecked;
+        stream->avail_in -= unchecked;
+
+        /* stop at block boundaries to record checkpoints there */
+        png->zerr = inflate(stream, png->index ? Z_BLOCK : Z_SYNC_FLUSH);
+        stream->avail_in += unchecked;
+
+        if(png->zerr != Z_STREAM_END && png->zerr != Z_OK) {
+#ifdef TRACE
+            fprintf(stderr, "png_inflate(): zlib error: %s\n", stream->msg);
+#endif
+            png->zmsg = stream->msg;
+            /* a chunk damaged on the way is reported as such */
+            if ((result = png_idat_verify(png)) != PNG_NO_ERROR)
+                return result;
+            return PNG_ZLIB_ERROR;
+        }
+
+        if (png->zerr == Z_STREAM_END && stream->avail_out > 0) {
 #ifdef TRACE
-            fprintf(stderr, "png_unfilter sl=%d unknown filter type %d\n", i, (int)filter_type);
+            fprintf(stderr, "png_inflate(): zlib stream ended %u bytes short; total_out = %lu\n", stream->avail_out, stream->total_out);
+#endif
+            if ((result = png_idat_verify(png)) != PNG_NO_ERROR)
+                return result;
+            return PNG_CORRUPTED;
+        }
+
+        if (png->index && (result = png_index_checkpoint(png)) != PNG_NO_ERROR)
+            return result;
+    }
+
+    return PNG_NO_ERROR;
+}
+
+/*  Skips over whatever image data follows the last scanline
+    and checks that the IDAT run is terminated by an IEND. */
+static int
+png_finish_idat(pnglite_t* png)
+{
+    int result;
+
+    do {
+        result = png_parse_chunk(png);
+    } while (result == PNG_NO_ERROR);
+
+    return result;
+}
+
+#ifdef PNG_LIBDEFLATE
+/*  Whole-buffer inflate pays off when all of the image data is at hand,
+    that is when it's read from memory, and no checkpoints are wanted. */
+static int
+png_inflate_whole(pnglite_t* png)
+{
+    return png->mem && !png->index;
+}
+
+/*  Inflates all of the image data into out with libdeflate, parsing
+    the rest of the IDAT run up to IEND first. A single IDAT is inflated
+    right where it is, several are put together. If libdeflate fails,
+    zlib goes over the same bytes so errors are reported just the same. */
+static int
+png_inflate_all(pnglite_t* png, unsigned char* out, size_t len)
+{
+    z_stream *stream = png->zs;
+    pnglite_decoder_t *dec = png->decoder;
+    struct libdeflate_decompressor *ld;
+    const unsigned char *idat = stream->next_in;
+    unsigned char *joined = NULL;
+    size_t idat_len = stream->avail_in, size = 0;
+    enum libdeflate_result lr;
+    int result;
+
+    if (!png_inflate_whole(png))
+        return png_inflate(png, out, (unsigned)len);
+
+    while ((result = png_parse_chunk(png)) == PNG_NO_ERROR || result == PNG_IDAT_FOUND) {
+        if (result != PNG_IDAT_FOUND)
+            continue;
+        if (!joined) {
+            /* the rest of the file is room enough */
+            size = png->in_len - (size_t)(idat - png->in);
+            joined = png_scratch(png, PNG_SCRATCH_IDAT, size);
+            if (!joined)
+                return PNG_MEMORY_ERROR;
+            memcpy(joined, idat, idat_len);
+            idat = joined;
+        }
+        memcpy(joined + idat_len, stream->next_in, stream->avail_in);
+        idat_len += stream->avail_in;
+    }
+    if (result != PNG_DONE)
+        goto done;
+
+    ld = dec ? dec->ld : NULL;
+    if (!ld)
+        ld = libdeflate_alloc_decompressor();
+    if (!ld) {
+        result = PNG_MEMORY_ERROR;
+        goto done;
+    }
+    lr = libdeflate_zlib_decompress(ld, idat, idat_len, out, len, NULL);
+    if (dec)
+        dec->ld = ld;
+    else
+        libdeflate_free_decompressor(ld);
+
+    if (lr == LIBDEFLATE_SUCCESS) {
+        result = PNG_NO_ERROR;
+    } else {
+        stream->next_in = (Bytef*)idat;
+        stream->avail_in = (uInt)idat_len;
+        result = png_inflate(png, out, (unsigned)len);
+    }
+
+done:
+    png_scratch_free(png, joined, size);
+    return result;
+}
+#elif defined(PNG_THREADS)
+static int
+png_inflate_all(pnglite_t* png, unsigned char* out, size_t len)
+{
+    return png_inflate(png, out, (unsigned)len);
+}
+#endif /* PNG_LIBDEFLATE */
+
+static int
+png_write_plte(pnglite_t *png)
+{
+    unsigned char plte[4 + 4 + 768 + 4];
+    unsigned i;
+    const unsigned length = png->palette_size * 3;
+
+    if ((png->palette_size > 256) || (png->palette_size == 0))
+        return PNG_CORRUPTED;
+
+    memcpy(plte + 4, "PLTE", 4);
+    for(i = 0 ; i < png->palette_size; i++) {
+        plte[8 + 3*i + 0] = png->palette[4*i + 0];
+        plte[8 + 3*i + 1] = png->palette[4*i + 1];
+        plte[8 + 3*i + 2] = png->palette[4*i + 2];
+    }
+
+    return png_write_chunk(png, plte, length);
+}
+
+static int
+png_write_trns(pnglite_t *png)
+{
+    unsigned char trns[4 + 4 + 256 + 4];
+    unsigned i;
+    unsigned length;
+
+    switch (png->color_type) {
+    case PNG_INDEXED:
+        length = png->palette_size;
+        for(i = 0 ; i < png->palette_size; i++)
+            trns[8 + i] = png->palette[4*i + 3];
+        break;
+
+    case PNG_GREYSCALE:
+        length = 2;
+        trns[8 + 0] = 0;
+        trns[8 + 1] = png->colorkey[1];
+        break;
+
+    case PNG_TRUECOLOR:
+        length = 6;
+        trns[8 + 0] = 0;
+        trns[8 + 1] = png->colorkey[1];
+        trns[8 + 2] = 0;
+        trns[8 + 3] = png->colorkey[3];
+        trns[8 + 4] = 0;
+        trns[8 + 5] = png->colorkey[5];
+        break;
+
+    default:
+        return PNG_TRNS_WRONG_COLORTYPE;
+    }
+    memmove(trns + 4, "tRNS", 4);
+
+    return png_write_chunk(png, trns, length);
+}
+
+/*  Branch-free form: the two conditional assignments compile to cmovs.
+    Ties are resolved a, b, c in that order, as the spec demands. */
+static unsigned char
+png_paeth_predictor(unsigned char a, unsigned char b, unsigned char c)
+{
+    int pa = b - c;     /* p - a */
+    int pb = a - c;     /* p - b */
+    int pc = pa + pb;   /* p - c */
+    unsigned char pr = a;
+
+    pa = abs(pa);
+    pb = abs(pb);
+    pc = abs(pc);
+
+    if (pb < pa) {
+        pa = pb;
+        pr = b;
+    }
+    if (pc < pa)
+        pr = c;
+
+    return pr;
+}
+
+/*  Sub, Average and Paeth depend on the pixel to the left, so they are
+    vectorized within a pixel only: one 3 or 4 byte pixel per step.
+    Up has no such dependency and is done 16 bytes at a time. Wider
+    vectors (AVX2) would not help any of it.
+
+    Kernels reconstruct in place; row is the filtered scanline without
+    the filter type byte, up is the reconstructed one above it. */
+#ifdef PNG_SSE2
+static __m128i
+png_load4(const unsigned char* p)
+{
+    int v;
+    memcpy(&v, p, 4);
+    return _mm_cvtsi32_si128(v);
+}
+
+static __m128i
+png_load3(const unsigned char* p)
+{
+    int v = 0;
+    memcpy(&v, p, 3);
+    return _mm_cvtsi32_si128(v);
+}
+
+/* Loads a whole 4 bytes for a 3 byte pixel as long as that stays within the row. */
+static __m128i
+png_load_pixel(const unsigned char* p, unsigned left)
+{
+    return left >= 4 ? png_load4(p) : png_load3(p);
+}
+
+static void
+png_store_pixel(unsigned char* p, __m128i v, unsigned bpp)
+{
+    int t = _mm_cvtsi128_si32(v);
+    memcpy(p, &t, bpp);
+}
+
+static void
+png_unfilter_up_sse2(unsigned char* row, const unsigned char* up, unsigned pitch)
+{
+    unsigned p;
+
+    for (p = 0; p + 16 <= pitch; p += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(row + p));
+        __m128i b = _mm_loadu_si128((const __m128i*)(up + p));
+        _mm_storeu_si128((__m128i*)(row + p), _mm_add_epi8(x, b));
+    }
+    for (; p < pitch; p++)
+        row[p] += up[p];
+}
+
+static void
+png_unfilter_sub_sse2(unsigned char* row, unsigned pitch, unsigned bpp)
+{
+    __m128i d = _mm_setzero_si128();
+    unsigned p;
+
+    for (p = 0; p < pitch; p += bpp) {
+        d = _mm_add_epi8(png_load_pixel(row + p, pitch - p), d);
+        png_store_pixel(row + p, d, bpp);
+    }
+}
+
+static void
+png_unfilter_avg_sse2(unsigned char* row, const unsigned char* up, unsigned pitch, unsigned bpp)
+{
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a, b, avg, d = _mm_setzero_si128();
+    unsigned p;
+
+    for (p = 0; p < pitch; p += bpp) {
+        a = d;
+        b = png_load_pixel(up + p, pitch - p);
+        /* pavgb rounds up, (a + b)/2 must round down */
+        avg = _mm_avg_epu8(a, b);
+        avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), one));
+        d = _mm_add_epi8(png_load_pixel(row + p, pitch - p), avg);
+        png_store_pixel(row + p, d, bpp);
+    }
+}
+
+static __m128i
+png_if_then_else(__m128i c, __m128i t, __m128i e)
+{
+    return _mm_or_si128(_mm_and_si128(c, t), _mm_andnot_si128(c, e));
+}
+
+/* Picks the Paeth predictor out of 16-bit a, b and c given their distances from a + b - c. */
+static __m128i
+png_paeth_select(__m128i a, __m128i b, __m128i c, __m128i pa, __m128i pb, __m128i pc)
+{
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+    return png_if_then_else(_mm_cmpeq_epi16(smallest, pa), a,
+               png_if_then_else(_mm_cmpeq_epi16(smallest, pb), b, c));
+}
+
+static __m128i
+png_abs_epi16_sse2(__m128i x)
+{
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static void
+png_unfilter_paeth_sse2(unsigned char* row, const unsigned char* up, unsigned pitch, unsigned bpp)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a, b = zero, c, d = zero, pa, pb, pc;
+    unsigned p;
+
+    for (p = 0; p < pitch; p += bpp) {
+        c = b;
+        b = _mm_unpacklo_epi8(png_load_pixel(up + p, pitch - p), zero);
+        a = d;
+        d = _mm_unpacklo_epi8(png_load_pixel(row + p, pitch - p), zero);
+
+        pa = _mm_sub_epi16(b, c);
+        pb = _mm_sub_epi16(a, c);
+        pc = _mm_add_epi16(pa, pb);
+        pa = png_abs_epi16_sse2(pa);
+        pb = png_abs_epi16_sse2(pb);
+        pc = png_abs_epi16_sse2(pc);
+
+        /* bytes add modulo 256 without spilling into the zero high bytes */
+        d = _mm_add_epi8(d, png_paeth_select(a, b, c, pa, pb, pc));
+        png_store_pixel(row + p, _mm_packus_epi16(d, d), bpp);
+    }
+}
+#endif /* PNG_SSE2 */
+
+#ifdef PNG_SSSE3
+/* Same as above but for pabsw. */
+static PNG_TARGET_SSSE3 void
+png_unfilter_paeth_ssse3(unsigned char* row, const unsigned char* up, unsigned pitch, unsigned bpp)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a, b = zero, c, d = zero, pa, pb, pc;
+    unsigned p;
+
+    for (p = 0; p < pitch; p += bpp) {
+        c = b;
+        b = _mm_unpacklo_epi8(png_load_pixel(up + p, pitch - p), zero);
+        a = d;
+        d = _mm_unpacklo_epi8(png_load_pixel(row + p, pitch - p), zero);
+
+        pa = _mm_sub_epi16(b, c);
+        pb = _mm_sub_epi16(a, c);
+        pc = _mm_add_epi16(pa, pb);
+        pa = _mm_abs_epi16(pa);
+        pb = _mm_abs_epi16(pb);
+        pc = _mm_abs_epi16(pc);
+
+        d = _mm_add_epi8(d, png_paeth_select(a, b, c, pa, pb, pc));
+        png_store_pixel(row + p, _mm_packus_epi16(d, d), bpp);
+    }
+}
+#endif /* PNG_SSSE3 */
+
+#ifdef PNG_NEON
+static uint8x8_t
+png_load_pixel(const unsigned char* p, unsigned left)
+{
+    uint32_t v = 0;
+    memcpy(&v, p, left >= 4 ? 4 : 3);
+    return vreinterpret_u8_u32(vdup_n_u32(v));
+}
+
+static void
+png_store_pixel(unsigned char* p, uint8x8_t v, unsigned bpp)
+{
+    uint32_t t = vget_lane_u32(vreinterpret_u32_u8(v), 0);
+    memcpy(p, &t, bpp);
+}
+
+static void
+png_unfilter_up_neon(unsigned char* row, const unsigned char* up, unsigned pitch)
+{
+    unsigned p;
+
+    for (p = 0; p + 16 <= pitch; p += 16)
+        vst1q_u8(row + p, vaddq_u8(vld1q_u8(row + p), vld1q_u8(up + p)));
+    for (; p < pitch; p++)
+        row[p] += up[p];
+}
+
+static void
+png_unfilter_sub_neon(unsigned char* row, unsigned pitch, unsigned bpp)
+{
+    uint8x8_t d = vdup_n_u8(0);
+    unsigned p;
+
+    for (p = 0; p < pitch; p += bpp) {
+        d = vadd_u8(png_load_pixel(row + p, pitch - p), d);
+        png_store_pixel(row + p, d, bpp);
+    }
+}
+
+static void
+png_unfilter_avg_neon(unsigned char* row, const unsigned char* up, unsigned pitch, unsigned bpp)
+{
+    uint8x8_t d = vdup_n_u8(0);
+    unsigned p;
+
+    for (p = 0; p < pitch; p += bpp) {
+        d = vadd_u8(png_load_pixel(row + p, pitch - p),
+                    vhadd_u8(d, png_load_pixel(up + p, pitch - p)));
+        png_store_pixel(row + p, d, bpp);
+    }
+}
+
+static uint8x8_t
+png_paeth_neon(uint8x8_t a, uint8x8_t b, uint8x8_t c)
+{
+    uint16x8_t pa, pb, pc, a_best;
+    uint8x8_t b_or_c;
+
+    pa = vabdl_u8(b, c);
+    pb = vabdl_u8(a, c);
+    pc = vabdq_u16(vaddl_u8(a, b), vaddl_u8(c, c));
+
+    a_best = vandq_u16(vcleq_u16(pa, pb), vcleq_u16(pa, pc));
+    b_or_c = vbsl_u8(vmovn_u16(vcleq_u16(pb, pc)), b, c);
+
+    return vbsl_u8(vmovn_u16(a_best), a, b_or_c);
+}
+
+static void
+png_unfilter_paeth_neon(unsigned char* row, const unsigned char* up, unsigned pitch, unsigned bpp)
+{
+    uint8x8_t a, b = vdup_n_u8(0), c, d = vdup_n_u8(0);
+    unsigned p;
+
+    for (p = 0; p < pitch; p += bpp) {
+        c = b;
+        b = png_load_pixel(up + p, pitch - p);
+        a = d;
+        d = vadd_u8(png_load_pixel(row + p, pitch - p), png_paeth_neon(a, b, c));
+        png_store_pixel(row + p, d, bpp);
+    }
+}
+#endif /* PNG_NEON */
+
+static int
+png_unfilter(pnglite_t* png, unsigned char* reconstructed, const unsigned char* up_reconstructed,
+             unsigned pitch)
+{
+    unsigned p;
+    const unsigned char filter_type = reconstructed[-1];
+    const unsigned stride = png->stride;
+#if defined(PNG_SSE2) || defined(PNG_NEON)
+    const int vector = stride >= 3;
+#endif
+
+    /*  reconstruction is done in place; the scanline above is all zeroes
+        for the first scanline of a pass, so there's no need to special-case it.
+        The first pixel has nothing to the left of it, so it is done
+        before the main loops, which then need no checks. */
+    switch(filter_type) {
+    case PNG_FILTER_NONE:
+        break;
+
+    case PNG_FILTER_SUB:
+#if defined(PNG_SSE2)
+        if (vector) {
+            png_unfilter_sub_sse2(reconstructed, pitch, stride);
+            break;
+        }
+#elif defined(PNG_NEON)
+        if (vector) {
+            png_unfilter_sub_neon(reconstructed, pitch, stride);
+            break;
+        }
+#endif
+        for (p = stride; p < pitch ; p++)
+            reconstructed[p] += reconstructed[p - stride];
+        break;
+
+    case PNG_FILTER_UP:
+#if defined(PNG_SSE2)
+        png_unfilter_up_sse2(reconstructed, up_reconstructed, pitch);
+#elif defined(PNG_NEON)
+        png_unfilter_up_neon(reconstructed, up_reconstructed, pitch);
+#else
+        for (p = 0; p < pitch ; p++)
+            reconstructed[p] += up_reconstructed[p];
+#endif
+        break;
+
+    case PNG_FILTER_AVERAGE:
+#if defined(PNG_SSE2)
+        if (vector) {
+            png_unfilter_avg_sse2(reconstructed, up_reconstructed, pitch, stride);
+            break;
+        }
+#elif defined(PNG_NEON)
+        if (vector) {
+            png_unfilter_avg_neon(reconstructed, up_reconstructed, pitch, stride);
+            break;
+        }
 #endif
-            return PNG_UNKNOWN_FILTER;
+        for (p = 0; p < stride; p++)
+            reconstructed[p] += up_reconstructed[p] >> 1;
+        for (; p < pitch ; p++)
+            reconstructed[p] += (reconstructed[p - stride] + up_reconstructed[p]) >> 1;
+        break;
+
+    case PNG_FILTER_PAETH:
+#if defined(PNG_SSE2)
+        if (vector) {
+#ifdef PNG_SSSE3
+            if (png->simd & PNG_SIMD_SSSE3)
+                png_unfilter_paeth_ssse3(reconstructed, up_reconstructed, pitch, stride);
+            else
+#endif
+                png_unfilter_paeth_sse2(reconstructed, up_reconstructed, pitch, stride);
+            break;
+        }
+#elif defined(PNG_NEON)
+        if (vector) {
+            png_unfilter_paeth_neon(reconstructed, up_reconstructed, pitch, stride);
+            break;
         }
+#endif
+        /* with a and c being zero the predictor is b */
+        for (p = 0; p < stride; p++)
+            reconstructed[p] += up_reconstructed[p];
+        for (; p < pitch ; p++)
+            reconstructed[p] += png_paeth_predictor(reconstructed[p - stride],
+                                    up_reconstructed[p], up_reconstructed[p - stride]);
+        break;
+
+    default:
+#ifdef TRACE
+        fprintf(stderr, "png_unfilter pass=%d sl=%d unknown filter type %d\n", png->pass + 1, png->pass_row, (int)filter_type);
+#endif
+        return PNG_UNKNOWN_FILTER;
+    }
+    return PNG_NO_ERROR;
+}
+
+/*  Filters a scanline for writing; out[-1] gets the filter type.
+    Each byte is predicted from the unfiltered data only, so unlike
+    reconstruction this vectorizes fully, 16 bytes at a time. */
+static void
+png_filter_row(unsigned char filter_type, unsigned char* out, const unsigned char* row,
+               const unsigned char* up, unsigned pitch, unsigned bpp)
+{
+    unsigned p;
+
+    out[-1] = filter_type;
+
+    /* the first pixel has a = c = 0 */
+    for (p = 0; p < bpp && p < pitch; p++) {
+        switch (filter_type) {
+        case PNG_FILTER_AVERAGE:
+            out[p] = row[p] - (up[p] >> 1);
+            break;
+        case PNG_FILTER_UP:
+        case PNG_FILTER_PAETH:
+            out[p] = row[p] - up[p];
+            break;
+        default:
+            out[p] = row[p];
+            break;
+        }
+    }
+
+    switch (filter_type) {
+    case PNG_FILTER_NONE:
+        memcpy(out, row, pitch);
+        break;
+
+    case PNG_FILTER_SUB:
+#if defined(PNG_SSE2)
+        for (; p + 16 <= pitch; p += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(row + p));
+            __m128i a = _mm_loadu_si128((const __m128i*)(row + p - bpp));
+            _mm_storeu_si128((__m128i*)(out + p), _mm_sub_epi8(x, a));
+        }
+#elif defined(PNG_NEON)
+        for (; p + 16 <= pitch; p += 16)
+            vst1q_u8(out + p, vsubq_u8(vld1q_u8(row + p), vld1q_u8(row + p - bpp)));
+#endif
+        for (; p < pitch; p++)
+            out[p] = row[p] - row[p - bpp];
+        break;
+
+    case PNG_FILTER_UP:
+#if defined(PNG_SSE2)
+        for (; p + 16 <= pitch; p += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(row + p));
+            __m128i b = _mm_loadu_si128((const __m128i*)(up + p));
+            _mm_storeu_si128((__m128i*)(out + p), _mm_sub_epi8(x, b));
+        }
+#elif defined(PNG_NEON)
+        for (; p + 16 <= pitch; p += 16)
+            vst1q_u8(out + p, vsubq_u8(vld1q_u8(row + p), vld1q_u8(up + p)));
+#endif
+        for (; p < pitch; p++)
+            out[p] = row[p] - up[p];
+        break;
+
+    case PNG_FILTER_AVERAGE:
+#if defined(PNG_SSE2)
+        for (; p + 16 <= pitch; p += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(row + p));
+            __m128i a = _mm_loadu_si128((const __m128i*)(row + p - bpp));
+            __m128i b = _mm_loadu_si128((const __m128i*)(up + p));
+            __m128i avg = _mm_avg_epu8(a, b);
+            avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+            _mm_storeu_si128((__m128i*)(out + p), _mm_sub_epi8(x, avg));
+        }
+#elif defined(PNG_NEON)
+        for (; p + 16 <= pitch; p += 16)
+            vst1q_u8(out + p, vsubq_u8(vld1q_u8(row + p),
+                                       vhaddq_u8(vld1q_u8(row + p - bpp), vld1q_u8(up + p))));
+#endif
+        for (; p < pitch; p++)
+            out[p] = row[p] - ((row[p - bpp] + up[p]) >> 1);
+        break;
+
+    case PNG_FILTER_PAETH:
+#if defined(PNG_SSE2)
+        for (; p + 16 <= pitch; p += 16) {
+            const __m128i zero = _mm_setzero_si128();
+            __m128i x = _mm_loadu_si128((const __m128i*)(row + p));
+            __m128i a8 = _mm_loadu_si128((const __m128i*)(row + p - bpp));
+            __m128i b8 = _mm_loadu_si128((const __m128i*)(up + p));
+            __m128i c8 = _mm_loadu_si128((const __m128i*)(up + p - bpp));
+            __m128i a, b, c, pa, pb, pc, lo, hi;
+
+            a = _mm_unpacklo_epi8(a8, zero);
+            b = _mm_unpacklo_epi8(b8, zero);
+            c = _mm_unpacklo_epi8(c8, zero);
+            pa = _mm_sub_epi16(b, c);
+            pb = _mm_sub_epi16(a, c);
+            pc = _mm_add_epi16(pa, pb);
+            lo = png_paeth_select(a, b, c, png_abs_epi16_sse2(pa),
+                                  png_abs_epi16_sse2(pb), png_abs_epi16_sse2(pc));
+
+            a = _mm_unpackhi_epi8(a8, zero);
+            b = _mm_unpackhi_epi8(b8, zero);
+            c = _mm_unpackhi_epi8(c8, zero);
+            pa = _mm_sub_epi16(b, c);
+            pb = _mm_sub_epi16(a, c);
+            pc = _mm_add_epi16(pa, pb);
+            hi = png_paeth_select(a, b, c, png_abs_epi16_sse2(pa),
+                                  png_abs_epi16_sse2(pb), png_abs_epi16_sse2(pc));
+
+            _mm_storeu_si128((__m128i*)(out + p), _mm_sub_epi8(x, _mm_packus_epi16(lo, hi)));
+        }
+#elif defined(PNG_NEON)
+        for (; p + 8 <= pitch; p += 8)
+            vst1_u8(out + p, vsub_u8(vld1_u8(row + p),
+                                     png_paeth_neon(vld1_u8(row + p - bpp), vld1_u8(up + p),
+                                                    vld1_u8(up + p - bpp))));
+#endif
+        for (; p < pitch; p++)
+            out[p] = row[p] - png_paeth_predictor(row[p - bpp], up[p], up[p - bpp]);
+        break;
+    }
+}
+
+/*  Sum of absolute differences: filtered bytes taken as signed,
+    the smaller the sum the better the row is likely to compress. */
+static unsigned long
+png_filter_cost(const unsigned char* out, unsigned pitch)
+{
+    unsigned long sum = 0;
+    unsigned p = 0;
+
+#if defined(PNG_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    uint64_t lanes[2];
+
+    for (; p + 16 <= pitch; p += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(out + p));
+        /* |x| of a signed byte is min(x, -x) taken as unsigned */
+        x = _mm_min_epu8(x, _mm_sub_epi8(zero, x));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(x, zero));
+    }
+    /* lane sums pass 2^31 for rows over 32M, take them whole */
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    sum = (unsigned long)(lanes[0] + lanes[1]);
+#elif defined(PNG_NEON)
+    uint32x4_t acc = vdupq_n_u32(0);
+
+    for (; p + 16 <= pitch; p += 16) {
+        uint8x16_t x = vreinterpretq_u8_s8(vabsq_s8(vreinterpretq_s8_u8(vld1q_u8(out + p))));
+        acc = vpadalq_u16(acc, vpaddlq_u8(x));
+    }
+    sum = (unsigned long)vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1)
+        + vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#endif
+    for (; p < pitch; p++)
+        sum += out[p] < 128 ? out[p] : 256 - out[p];
+
+    return sum;
+}
+
+/*  What png->write_filter comes to for the image at hand. Indexed and
+    sub-byte images don't benefit from filtering and are left unfiltered
+    when adaptive filtering is asked for, as the spec recommends. */
+static int
+png_write_filter_type(pnglite_t* png)
+{
+    if (png->write_filter > PNG_FILTER_ADAPTIVE)
+        return PNG_WRONG_ARGUMENTS;
+
+    if (png->write_filter == PNG_FILTER_ADAPTIVE && (png->color_type == PNG_INDEXED || png->depth < 8))
+        return PNG_FILTER_NONE;
+
+    return png->write_filter;
+}
+
+/*  Filters a row against the one above it. PNG_FILTER_ADAPTIVE tries
+    every filter and keeps the one with the smallest sum of absolute
+    differences. trial is room for two filtered rows, pitch + 1 bytes each;
+    returns the filtered row in it, filter type byte first. */
+static unsigned char*
+png_filter_scanline(pnglite_t* png, int filter_type, const unsigned char* row,
+                    const unsigned char* up, unsigned char* trial)
+{
+    const unsigned pitch = png->pitch;
+    unsigned char *out[2];
+    unsigned long cost, best_cost = (unsigned long)-1;
+    unsigned best = 0, cur = 0;
+    unsigned char f;
+
+    out[0] = trial + 1;
+    out[1] = trial + pitch + 2;
+
+    if (filter_type != PNG_FILTER_ADAPTIVE) {
+        png_filter_row(filter_type, out[0], row, up, pitch, png->stride);
+        return trial;
+    }
+
+    for (f = PNG_FILTER_NONE; f <= PNG_FILTER_PAETH; f++) {
+        png_filter_row(f, out[cur], row, up, pitch, png->stride);
+        cost = png_filter_cost(out[cur], pitch);
+        if (cost < best_cost) {
+            best_cost = cost;
+            best = cur;
+            cur ^= 1;
+        }
+    }
+
+    return out[best] - 1;
+}
+
+#ifdef PNG_THREADS
+/* Filters all of image data into filtered, pitch + 1 bytes per row. */
+static int
+png_filter(pnglite_t* png, unsigned char* filtered, const unsigned char* data)
+{
+    const unsigned pitch = png->pitch;
+    const int filter_type = png_write_filter_type(png);
+    unsigned char *zeroes, *trial;
+    unsigned y;
+
+    if (filter_type < 0)
+        return filter_type;
+
+    /* the row above the first is all zeroes */
+    zeroes = png_alloc(png, pitch + 2 * (pitch + 1));
+    if (!zeroes)
+        return PNG_MEMORY_ERROR;
+    memset(zeroes, 0, pitch);
+    trial = zeroes + pitch;
+
+    for (y = 0; y < png->height; y++) {
+        const unsigned char *row = data + (size_t)y * pitch;
+        const unsigned char *up = y ? row - pitch : zeroes;
+
+        memcpy(filtered + (size_t)y * (pitch + 1),
+               png_filter_scanline(png, filter_type, row, up, trial), pitch + 1);
+    }
+
+    png_free(png, zeroes, pitch + 2 * (pitch + 1));
+    return PNG_NO_ERROR;
+}
+#endif
+
+static void
+png_unpack_byte(unsigned char *dst, const unsigned char *src, int depth)
+{
+    switch (depth) {
+    case 1:
+        *dst++ = (*src & 0x80) ? 1 : 0;
+        *dst++ = (*src & 0x40) ? 1 : 0;
+        *dst++ = (*src & 0x20) ? 1 : 0;
+        *dst++ = (*src & 0x10) ? 1 : 0;
+        *dst++ = (*src & 0x08) ? 1 : 0;
+        *dst++ = (*src & 0x04) ? 1 : 0;
+        *dst++ = (*src & 0x02) ? 1 : 0;
+        *dst++ = (*src & 0x01) ? 1 : 0;
+        break;
+    case 2:
+        *dst++ = (*src & 0xC0) >> 6;
+        *dst++ = (*src & 0x30) >> 4;
+        *dst++ = (*src & 0x0C) >> 2;
+        *dst++ = (*src & 0x03);
+        break;
+    case 4:
+        *dst++ = (*src & 0xF0) >> 4;
+        *dst++ = (*src & 0x0F);
+        break;
+    default:
+        /* can't be, we caught this in read_ihdr */
+        break;
+    }
+}
+
+/* Sub-byte grey levels are scaled up to 8 bits. */
+static int
+png_scaled_grey(const pnglite_t* png)
+{
+    return png->scale_grey && png->color_type == PNG_GREYSCALE;
+}
+
+/*  Fills png->unpack_lut with the pixels in each byte value, 8 bytes an
+    entry whatever the depth, grey levels scaled up to 8 bits if asked. */
+static void
+png_build_unpack_lut(pnglite_t* png)
+{
+    const unsigned max = (1u << png->depth) - 1;
+    unsigned char *dst;
+    unsigned char b;
+    unsigned v, i;
+
+    for (v = 0; v < 256; v++) {
+        dst = png->unpack_lut + 8 * v;
+        b = (unsigned char)v;
+        memset(dst, 0, 8);
+        png_unpack_byte(dst, &b, png->depth);
+        if (png_scaled_grey(png))
+            for (i = 0; i < 8; i++)
+                dst[i] = (unsigned char)(dst[i] * 255 / max);
+    }
+}
+
+#ifdef PNG_SSE2
+/*  Unpacks 16 bytes of 1, 2 or 4-bit pixels at a time: shifts and masks
+    pull out each pixel of the bytes, and unpacks put them in order. 1-bit
+    pixels are picked out by comparing against their bit. Scaling to 8 bits
+    is or-ing in shifted copies. Returns the pixels done. */
+static unsigned
+png_unpack_sse2(unsigned char* dst, const unsigned char* src, unsigned width, unsigned depth, int scale)
+{
+    const unsigned ppb = 8 / depth;
+    const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i one = _mm_set1_epi8(scale ? -1 : 1);
+    __m128i v, a, b, c, d, ab, cd, t[4];
+    unsigned x, k, i;
+
+    for (x = 0; x + 16 * ppb <= width; x += 16 * ppb, src += 16) {
+        v = _mm_loadu_si128((const __m128i*)src);
+        switch (depth) {
+        case 4:
+            a = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f));
+            b = _mm_and_si128(v, _mm_set1_epi8(0x0f));
+            if (scale) {
+                a = _mm_or_si128(a, _mm_slli_epi16(a, 4));
+                b = _mm_or_si128(b, _mm_slli_epi16(b, 4));
+            }
+            _mm_storeu_si128((__m128i*)(dst + x), _mm_unpacklo_epi8(a, b));
+            _mm_storeu_si128((__m128i*)(dst + x + 16), _mm_unpackhi_epi8(a, b));
+            break;
+        case 2:
+            a = _mm_and_si128(_mm_srli_epi16(v, 6), _mm_set1_epi8(3));
+            b = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(3));
+            c = _mm_and_si128(_mm_srli_epi16(v, 2), _mm_set1_epi8(3));
+            d = _mm_and_si128(v, _mm_set1_epi8(3));
+            if (scale) {
+                /* none of these get past bit 7 of their byte */
+                a = _mm_or_si128(a, _mm_slli_epi16(a, 2));
+                a = _mm_or_si128(a, _mm_slli_epi16(a, 4));
+                b = _mm_or_si128(b, _mm_slli_epi16(b, 2));
+                b = _mm_or_si128(b, _mm_slli_epi16(b, 4));
+                c = _mm_or_si128(c, _mm_slli_epi16(c, 2));
+                c = _mm_or_si128(c, _mm_slli_epi16(c, 4));
+                d = _mm_or_si128(d, _mm_slli_epi16(d, 2));
+                d = _mm_or_si128(d, _mm_slli_epi16(d, 4));
+            }
+            ab = _mm_unpacklo_epi8(a, b);
+            cd = _mm_unpacklo_epi8(c, d);
+            _mm_storeu_si128((__m128i*)(dst + x), _mm_unpacklo_epi16(ab, cd));
+            _mm_storeu_si128((__m128i*)(dst + x + 16), _mm_unpackhi_epi16(ab, cd));
+            ab = _mm_unpackhi_epi8(a, b);
+            cd = _mm_unpackhi_epi8(c, d);
+            _mm_storeu_si128((__m128i*)(dst + x + 32), _mm_unpacklo_epi16(ab, cd));
+            _mm_storeu_si128((__m128i*)(dst + x + 48), _mm_unpackhi_epi16(ab, cd));
+            break;
+        default:
+            /* each byte spread over 8 lanes, two bytes a vector */
+            for (k = 0; k < 2; k++) {
+                a = k ? _mm_unpackhi_epi8(v, v) : _mm_unpacklo_epi8(v, v);
+                b = _mm_unpacklo_epi16(a, a);
+                c = _mm_unpackhi_epi16(a, a);
+                t[0] = _mm_unpacklo_epi32(b, b);
+                t[1] = _mm_unpackhi_epi32(b, b);
+                t[2] = _mm_unpacklo_epi32(c, c);
+                t[3] = _mm_unpackhi_epi32(c, c);
+                for (i = 0; i < 4; i++) {
+                    d = _mm_cmpeq_epi8(_mm_and_si128(t[i], bits), bits);
+                    _mm_storeu_si128((__m128i*)(dst + x + 64 * k + 16 * i), _mm_and_si128(d, one));
+                }
+            }
+            break;
+        }
+    }
+    return x;
+}
+#endif /* PNG_SSE2 */
+
+#ifdef PNG_NEON
+/*  Same with interleaving stores for 2 and 4-bit pixels and a bit test
+    for 1-bit ones. */
+static unsigned
+png_unpack_neon(unsigned char* dst, const unsigned char* src, unsigned width, unsigned depth, int scale)
+{
+    const unsigned ppb = 8 / depth;
+    const uint8x8_t bits = vcreate_u8(0x0102040810204080ULL);
+    const uint8x8_t one = vdup_n_u8(scale ? 255 : 1);
+    unsigned x, k;
+
+    for (x = 0; x + 16 * ppb <= width; x += 16 * ppb, src += 16) {
+        uint8x16_t v = vld1q_u8(src);
+        if (depth == 4) {
+            uint8x16x2_t o;
+            o.val[0] = vshrq_n_u8(v, 4);
+            o.val[1] = vandq_u8(v, vdupq_n_u8(0x0f));
+            if (scale) {
+                o.val[0] = vmulq_u8(o.val[0], vdupq_n_u8(17));
+                o.val[1] = vmulq_u8(o.val[1], vdupq_n_u8(17));
+            }
+            vst2q_u8(dst + x, o);
+        } else if (depth == 2) {
+            uint8x16x4_t o;
+            o.val[0] = vshrq_n_u8(v, 6);
+            o.val[1] = vandq_u8(vshrq_n_u8(v, 4), vdupq_n_u8(3));
+            o.val[2] = vandq_u8(vshrq_n_u8(v, 2), vdupq_n_u8(3));
+            o.val[3] = vandq_u8(v, vdupq_n_u8(3));
+            if (scale)
+                for (k = 0; k < 4; k++)
+                    o.val[k] = vmulq_u8(o.val[k], vdupq_n_u8(85));
+            vst4q_u8(dst + x, o);
+        } else {
+            for (k = 0; k < 16; k++)
+                vst1_u8(dst + x + 8 * k, vand_u8(vtst_u8(vdup_n_u8(src[k]), bits), one));
+        }
+    }
+    return x;
+}
+#endif /* PNG_NEON */
+
+/*  Expands a scanline of width sub-byte pixels into one byte per pixel,
+    16 bytes of them at a time with SIMD and then one table lookup
+    per byte. */
+static void
+png_unpack_scanline(pnglite_t* png, unsigned char *dst, const unsigned char *src, unsigned width)
+{
+    const unsigned depth = png->depth;
+    const unsigned char *lut = png->unpack_lut;
+    unsigned x = 0;
+
+#if defined(PNG_SSE2)
+    x = png_unpack_sse2(dst, src, width, depth, png_scaled_grey(png));
+#elif defined(PNG_NEON)
+    x = png_unpack_neon(dst, src, width, depth, png_scaled_grey(png));
+#endif
+    src += x / (8 / depth);
+
+    /* fixed size copies, each a single move */
+    switch (depth) {
+    case 1:
+        for (; x + 8 <= width; x += 8)
+            memcpy(dst + x, lut + 8 * *src++, 8);
+        break;
+    case 2:
+        for (; x + 4 <= width; x += 4)
+            memcpy(dst + x, lut + 8 * *src++, 4);
+        break;
+    default:
+        for (; x + 2 <= width; x += 2)
+            memcpy(dst + x, lut + 8 * *src++, 2);
+        break;
+    }
+
+    /* the last byte may be only partly used */
+    if (x < width)
+        memcpy(dst + x, lut + 8 * *src, width - x);
+}
+
+/* Bytes per pixel put out. */
+static unsigned
+png_out_stride(const pnglite_t* png)
+{
+    return png->out_format ? 4 : png->stride;
+}
+
+/* Bytes of pnglite_t::unpacked, a scanline worth of pixels as put out. */
+static unsigned
+png_unpacked_size(const pnglite_t* png)
+{
+    if (png->out_format || png->premultiply)
+        return 4 * png->width;
+    return png->depth < 8 ? png->width : 0;
+}
+
+/*  Moves the channels of n 8-bit RGBA, RGB or grey+alpha pixels to
+    offsets r, g, b and a of 4-byte ones. It's only ever called with
+    constants for those, so each layout gets a loop of its own with
+    fixed offsets. */
+static void
+png_convert_pixels(unsigned char* dst, const unsigned char* src, unsigned n, unsigned bpp,
+                   unsigned r, unsigned g, unsigned b, unsigned a)
+{
+    unsigned x;
+
+    switch (bpp) {
+    case 4:
+        for (x = 0; x < n; x++, dst += 4, src += 4) {
+            dst[r] = src[0];
+            dst[g] = src[1];
+            dst[b] = src[2];
+            dst[a] = src[3];
+        }
+        break;
+    case 3:
+        for (x = 0; x < n; x++, dst += 4, src += 3) {
+            dst[r] = src[0];
+            dst[g] = src[1];
+            dst[b] = src[2];
+            dst[a] = 255;
+        }
+        break;
+    case 2:
+        for (x = 0; x < n; x++, dst += 4, src += 2) {
+            dst[r] = dst[g] = dst[b] = src[0];
+            dst[a] = src[1];
+        }
+        break;
+    }
+}
+
+#ifdef PNG_SSE2
+/*  Grey+alpha to 4-byte pixels, 8 at a time and no shuffles needed: as
+    16-bit lanes a pixel is g | a << 8, and the output is that next to
+    g | g << 8, or both byte-swapped for alpha first. Grey is the same in
+    every color, so where alpha goes is all that tells layouts apart.
+    Returns the pixels done. */
+static unsigned
+png_convert_ga_sse2(unsigned char* dst, const unsigned char* src, unsigned n, int alpha_first)
+{
+    const __m128i low = _mm_set1_epi16(0x00ff);
+    __m128i v, g, gg;
+    unsigned x;
+
+    for (x = 0; x + 8 <= n; x += 8) {
+        v = _mm_loadu_si128((const __m128i*)(src + 2 * x));
+        g = _mm_and_si128(v, low);
+        gg = _mm_or_si128(g, _mm_slli_epi16(g, 8));
+        if (alpha_first) {
+            v = _mm_or_si128(_mm_srli_epi16(v, 8), _mm_slli_epi16(v, 8));
+            _mm_storeu_si128((__m128i*)(dst + 4 * x), _mm_unpacklo_epi16(v, gg));
+            _mm_storeu_si128((__m128i*)(dst + 4 * x + 16), _mm_unpackhi_epi16(v, gg));
+        } else {
+            _mm_storeu_si128((__m128i*)(dst + 4 * x), _mm_unpacklo_epi16(gg, v));
+            _mm_storeu_si128((__m128i*)(dst + 4 * x + 16), _mm_unpackhi_epi16(gg, v));
+        }
+    }
+    return x;
+}
+#endif /* PNG_SSE2 */
+
+#ifdef PNG_SSSE3
+/*  Converts four pixels per pshufb, or-ing in alpha for RGB. Loads are
+    16 bytes whatever the pixel size, so the last few pixels are left
+    for the scalar loop; returns how many were done. */
+static PNG_TARGET_SSSE3 unsigned
+png_convert_ssse3(unsigned char* dst, const unsigned char* src, unsigned n, unsigned bpp,
+                  const unsigned char* order)
+{
+    unsigned char shuffle[16], fill[16];
+    __m128i mask, alpha;
+    unsigned x, c;
+
+    memset(fill, 0, sizeof(fill));
+    for (x = 0; x < 4; x++) {
+        for (c = 0; c < 3; c++)
+            shuffle[4 * x + order[c]] = (unsigned char)(x * bpp + (bpp == 2 ? 0 : c));
+        shuffle[4 * x + order[3]] = bpp == 3 ? 0x80 : (unsigned char)(x * bpp + bpp - 1);
+        if (bpp == 3)
+            fill[4 * x + order[3]] = 255;
+    }
+    mask = _mm_loadu_si128((const __m128i*)shuffle);
+    alpha = _mm_loadu_si128((const __m128i*)fill);
+
+    for (x = 0; x * bpp + 16 <= n * bpp; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + x * bpp));
+        _mm_storeu_si128((__m128i*)(dst + 4 * x), _mm_or_si128(_mm_shuffle_epi8(v, mask), alpha));
+    }
+    return x;
+}
+#endif /* PNG_SSSE3 */
+
+#ifdef PNG_NEON
+/* Same with de- and re-interleaving loads and stores, 16 pixels at a time. */
+static unsigned
+png_convert_neon(unsigned char* dst, const unsigned char* src, unsigned n, unsigned bpp,
+                 const unsigned char* order)
+{
+    uint8x16x4_t out;
+    unsigned x;
+
+    out.val[order[3]] = vdupq_n_u8(255);
+    for (x = 0; x + 16 <= n; x += 16) {
+        if (bpp == 4) {
+            uint8x16x4_t v = vld4q_u8(src + 4 * x);
+            out.val[order[0]] = v.val[0];
+            out.val[order[1]] = v.val[1];
+            out.val[order[2]] = v.val[2];
+            out.val[order[3]] = v.val[3];
+        } else if (bpp == 3) {
+            uint8x16x3_t v = vld3q_u8(src + 3 * x);
+            out.val[order[0]] = v.val[0];
+            out.val[order[1]] = v.val[1];
+            out.val[order[2]] = v.val[2];
+        } else {
+            uint8x16x2_t v = vld2q_u8(src + 2 * x);
+            out.val[order[0]] = out.val[order[1]] = out.val[order[2]] = v.val[0];
+            out.val[order[3]] = v.val[1];
+        }
+        vst4q_u8(dst + 4 * x, out);
+    }
+    return x;
+}
+#endif /* PNG_NEON */
+
+/*  Converts n pixels of a reconstructed scanline to png->out_format.
+    Indexed and greyscale pixels of any depth are looked up in png->lut;
+    the rest have their channels moved around, with alpha added to RGB. */
+static void
+png_convert_row(pnglite_t* png, unsigned char* dst, const unsigned char* src, unsigned n)
+{
+    const unsigned char *order = png_format_order[png->out_format];
+    const unsigned bpp = png->stride;
+    const unsigned depth = png->depth;
+    const unsigned max = (1u << depth) - 1;
+    unsigned x = 0, v;
+
+    if (png->color_type == PNG_INDEXED || png->color_type == PNG_GREYSCALE) {
+        if (depth == 8) {
+            for (x = 0; x < n; x++)
+                memcpy(dst + 4 * x, png->lut + 4 * src[x], 4);
+        } else {
+            for (x = 0; x < n; x++) {
+                v = (src[(x * depth) >> 3] >> (8 - depth - ((x * depth) & 7))) & max;
+                memcpy(dst + 4 * x, png->lut + 4 * v, 4);
+            }
+        }
+        return;
+    }
+
+    if (png->color_type == PNG_TRUECOLOR && png->transparency_present) {
+        for (x = 0; x < n; x++, dst += 4, src += 3) {
+            if (src[0] == png->colorkey[1] && src[1] == png->colorkey[3]
+                    && src[2] == png->colorkey[5]) {
+                /* premultiplied, that's all zeroes */
+                dst[order[0]] = png->premultiply ? 0 : src[0];
+                dst[order[1]] = png->premultiply ? 0 : src[1];
+                dst[order[2]] = png->premultiply ? 0 : src[2];
+                dst[order[3]] = 0;
+            } else {
+                dst[order[0]] = src[0];
+                dst[order[1]] = src[1];
+                dst[order[2]] = src[2];
+                dst[order[3]] = 255;
+            }
+        }
+        return;
+    }
+
+#if defined(PNG_SSE2)
+    if (bpp == 2)
+        x = png_convert_ga_sse2(dst, src, n, order[3] == 0);
+#ifdef PNG_SSSE3
+    else if (png->simd & PNG_SIMD_SSSE3)
+        x = png_convert_ssse3(dst, src, n, bpp, order);
+#endif
+#elif defined(PNG_NEON)
+    x = png_convert_neon(dst, src, n, bpp, order);
+#endif
+    dst += 4 * x;
+    src += bpp * x;
+    n -= x;
+
+    switch (png->out_format) {
+    case PNG_FORMAT_RGBA:
+        png_convert_pixels(dst, src, n, bpp, 0, 1, 2, 3);
+        break;
+    case PNG_FORMAT_BGRA:
+        png_convert_pixels(dst, src, n, bpp, 2, 1, 0, 3);
+        break;
+    case PNG_FORMAT_ARGB:
+        png_convert_pixels(dst, src, n, bpp, 1, 2, 3, 0);
+        break;
+    default:
+        png_convert_pixels(dst, src, n, bpp, 3, 2, 1, 0);
+        break;
+    }
+}
+
+/*  Dimensions of an Adam7 pass, or of the whole image if it's not interlaced.
+    Returns 0 if the image is too small to have the pass at all. */
+static int
+png_pass_size(pnglite_t* png, unsigned pass, unsigned* width, unsigned* height)
+{
+    if (png->interlace_method == 0) {
+        *width = png->width;
+        *height = png->height;
+        return 1;
+    }
+
+    if ((adam7_hshift[pass] >= png->width) || (adam7_vshift[pass] >= png->height)) {
+        *width = 0;
+        *height = 0;
+        return 0;
+    }
+
+    *width = (png->width - adam7_hshift[pass] + adam7_hstride[pass] - 1) / adam7_hstride[pass];
+    *height = (png->height - adam7_vshift[pass] + adam7_vstride[pass] - 1) / adam7_vstride[pass];
+    return 1;
+}
+
+/* How many pixels of an Adam7 pass (or a whole row) lie left of image column x. */
+static unsigned
+png_pass_columns(pnglite_t* png, unsigned pass, unsigned x)
+{
+    if (png->interlace_method == 0)
+        return x < png->width ? x : png->width;
+
+    if (x <= adam7_hshift[pass])
+        return 0;
+
+    x = (x - adam7_hshift[pass] + adam7_hstride[pass] - 1) / adam7_hstride[pass];
+    return x < png->pass_width ? x : png->pass_width;
+}
+
+/*  Sets up geometry for the given pass, or the whole image if not interlaced.
+    Returns 0 if the pass has no pixels and should be skipped. */
+static int
+png_start_pass(pnglite_t* png, unsigned pass)
+{
+    png->pass = pass;
+    png->pass_row = 0;
+
+    if (!png_pass_size(png, pass, &png->pass_width, &png->pass_height)) {
+        /* this way we don't get to have a scanline */
+        return 0;
+    }
+    png->pass_pitch = bytes_per_scanline(png->pass_width, png->depth, png->color_type);
+
+    /* what is to become the scanline above the first one */
+    memset(png->scanline, 0, png->pass_pitch + 1);
+#ifdef TRACE
+    fprintf(stderr, "png_start_pass() pass %d: subimage %dx%d pitch=%d\n",
+            pass + 1, png->pass_width, png->pass_height, png->pass_pitch);
+#endif
+    return 1;
+}
+
+/* Tells if all passes following the current one are empty. */
+static int
+png_last_pass(pnglite_t* png)
+{
+    unsigned pass;
+
+    if (png->interlace_method == 0)
+        return 1;
+
+    for (pass = png->pass + 1; pass < 7; pass++)
+        if ((adam7_hshift[pass] < png->width) && (adam7_vshift[pass] < png->height))
+            return 0;
+
+    return 1;
+}
+
+/*  Inflates and reconstructs the next scanline, moving on to the next pass
+    as needed. The result is left in png->scanline + 1, the filter type byte
+    being at png->scanline[0]. Returns PNG_DONE when all passes are done.
+
+    A scanline is inflated into the half of the window not holding
+    the one above it, and may take several calls if input is pushed.
+
+    Only pixels left of image column xend are reconstructed: none of the
+    filters looks right, so that's all the scanlines below need of it. */
+static int
+png_read_scanline(pnglite_t* png, unsigned xend)
+{
+    unsigned char *tmp;
+    unsigned pitch;
+    int result;
+
+    if (png->scanline_fill == 0) {
+        while (png->pass_row == png->pass_height) {
+            if ((png->interlace_method == 0) || (png->pass == 6))
+                return PNG_DONE;
+            png_start_pass(png, png->pass + 1);
+        }
+    }
+
+    result = png_inflate(png, png->prev_scanline + png->scanline_fill,
+                         png->pass_pitch + 1 - png->scanline_fill);
+
+    if (result == PNG_NEED_MORE) {
+        png->scanline_fill = png->pass_pitch + 1 - ((z_stream *)png->zs)->avail_out;
+        return result;
+    }
+    if (result != PNG_NO_ERROR)
+        return result;
+
+    png->scanline_fill = 0;
+
+    pitch = png->pass_pitch;
+    if (xend < png->width)
+        pitch = bytes_per_scanline(png_pass_columns(png, png->pass, xend), png->depth, png->color_type);
+
+    if (pitch && (result = png_unfilter(png, png->prev_scanline + 1, png->scanline + 1, pitch)) != PNG_NO_ERROR)
+        return png_idat_verify(png) != PNG_NO_ERROR ? PNG_CRC_ERROR : result;
+
+    tmp = png->prev_scanline;
+    png->prev_scanline = png->scanline;
+    png->scanline = tmp;
+
+    png->pass_row += 1;
+
+    if ((png->pass_row == png->pass_height) && png_last_pass(png))
+        png->decoded = 1;
+
+    return PNG_NO_ERROR;
+}
+
+/*  Colors of pixels with an alpha channel get multiplied by it; those
+    of palette entries, grey levels and tRNS keys are in png->lut already. */
+static int
+png_premultiplied(const pnglite_t* png)
+{
+    return png->premultiply && (png->color_type & 4);
+}
+
+/* Scalar premultiply of n pixels of bpp bytes, alpha at offset a. */
+static void
+png_premultiply_pixels(unsigned char* p, unsigned n, unsigned bpp, unsigned a)
+{
+    unsigned x, c;
+
+    for (x = 0; x < n; x++, p += bpp)
+        for (c = 0; c < bpp; c++)
+            if (c != a)
+                p[c] = png_div255(p[c] * p[a]);
+}
+
+#ifdef PNG_SSE2
+/*  c * a / 255 rounded, for 16-bit lanes of 8-bit values: that's
+    ((c * a + 128) * 257) >> 16, which is exact for all of them. */
+static __m128i
+png_mul255_sse2(__m128i c, __m128i a)
+{
+    const __m128i x = _mm_add_epi16(_mm_mullo_epi16(c, a), _mm_set1_epi16(128));
+    return _mm_mulhi_epu16(x, _mm_set1_epi16(257));
+}
+
+/*  Premultiplies 16 bytes of RGBA or grey+alpha pixels at a time, alpha
+    last or, for 4-byte pixels, first. The alpha lanes are multiplied by
+    255, which leaves them as they were. Returns the pixels done. */
+static unsigned
+png_premultiply_sse2(unsigned char* p, unsigned n, unsigned bpp, unsigned a)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const unsigned bytes = n * bpp;
+    __m128i keep, mask, v, lo, hi, alo, ahi;
+    unsigned i;
+
+    if (bpp == 2)
+        keep = _mm_set_epi16(255, 0, 255, 0, 255, 0, 255, 0);
+    else if (a == 3)
+        keep = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+    else
+        keep = _mm_set_epi16(0, 0, 0, 255, 0, 0, 0, 255);
+    mask = _mm_cmpgt_epi16(keep, zero);
+
+    for (i = 0; i + 16 <= bytes; i += 16) {
+        v = _mm_loadu_si128((const __m128i*)(p + i));
+        lo = _mm_unpacklo_epi8(v, zero);
+        hi = _mm_unpackhi_epi8(v, zero);
+        if (bpp == 2) {
+            alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1));
+            ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1));
+        } else if (a == 3) {
+            alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+            ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+        } else {
+            alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(0, 0, 0, 0)), _MM_SHUFFLE(0, 0, 0, 0));
+            ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(0, 0, 0, 0)), _MM_SHUFFLE(0, 0, 0, 0));
+        }
+        alo = _mm_or_si128(_mm_andnot_si128(mask, alo), keep);
+        ahi = _mm_or_si128(_mm_andnot_si128(mask, ahi), keep);
+        lo = png_mul255_sse2(lo, alo);
+        hi = png_mul255_sse2(hi, ahi);
+        _mm_storeu_si128((__m128i*)(p + i), _mm_packus_epi16(lo, hi));
+    }
+    return i / bpp;
+}
+#endif /* PNG_SSE2 */
+
+#ifdef PNG_NEON
+/*  c * a / 255 rounded: (x + ((x + 128) >> 8) + 128) >> 8 for x = c * a,
+    same as png_div255(). */
+static uint8x8_t
+png_mul255_neon(uint8x8_t c, uint8x8_t a)
+{
+    const uint16x8_t x = vmull_u8(c, a);
+    return vraddhn_u16(x, vrshrq_n_u16(x, 8));
+}
+
+/* Same as above, 8 pixels at a time with channels deinterleaved. */
+static unsigned
+png_premultiply_neon(unsigned char* p, unsigned n, unsigned bpp, unsigned a)
+{
+    unsigned x, c;
+
+    for (x = 0; x + 8 <= n; x += 8) {
+        if (bpp == 4) {
+            uint8x8x4_t v = vld4_u8(p + 4 * x);
+            for (c = 0; c < 4; c++)
+                if (c != a)
+                    v.val[c] = png_mul255_neon(v.val[c], v.val[a]);
+            vst4_u8(p + 4 * x, v);
+        } else {
+            uint8x8x2_t v = vld2_u8(p + 2 * x);
+            v.val[0] = png_mul255_neon(v.val[0], v.val[1]);
+            vst2_u8(p + 2 * x, v);
+        }
+    }
+    return x;
+}
+#endif /* PNG_NEON */
+
+/* Premultiplies n pixels as put out, in place. */
+static void
+png_premultiply_row(pnglite_t* png, unsigned char* p, unsigned n)
+{
+    const unsigned bpp = png_out_stride(png);
+    const unsigned a = png->out_format ? png_format_order[png->out_format][3] : bpp - 1;
+    unsigned x = 0;
+
+#if defined(PNG_SSE2)
+    x = png_premultiply_sse2(p, n, bpp, a);
+#elif defined(PNG_NEON)
+    x = png_premultiply_neon(p, n, bpp, a);
+#endif
+    png_premultiply_pixels(p + x * bpp, n - x, bpp, a);
+}
+
+/*  Puts n pixels of a reconstructed scanline into dst, unpacking,
+    converting or premultiplying them if needed. */
+static void
+png_put_row(pnglite_t* png, unsigned char* dst, const unsigned char* src, unsigned n)
+{
+    if (png->out_format)
+        png_convert_row(png, dst, src, n);
+    else if (png->depth < 8)
+        png_unpack_scanline(png, dst, src, n);
+    else
+        memcpy(dst, src, (size_t)n * png->stride);
+
+    if (png_premultiplied(png))
+        png_premultiply_row(png, dst, n);
+}
+
+/* Reconstructed scanlines are the pixels put out, no png_put_row() needed. */
+static int
+png_put_as_is(const pnglite_t* png)
+{
+    return !png->out_format && png->depth >= 8 && !png_premultiplied(png);
+}
+
+/*  Spreads n pixels of a pass out to every hstride-th byte of dst.
+    Each pixel size gets a loop of its own, so that the copies
+    compile down to a move or two. */
+static void
+png_scatter_pixels(unsigned char* dst, const unsigned char* src, unsigned n,
+                   unsigned hstride, unsigned stride)
+{
+    unsigned x;
+
+    switch (stride) {
+    case 1:
+        for (x = 0; x < n; x++, dst += hstride, src += 1)
+            dst[0] = src[0];
+        break;
+    case 2:
+        for (x = 0; x < n; x++, dst += hstride, src += 2)
+            memcpy(dst, src, 2);
+        break;
+    case 3:
+        for (x = 0; x < n; x++, dst += hstride, src += 3)
+            memcpy(dst, src, 3);
+        break;
+    case 4:
+        for (x = 0; x < n; x++, dst += hstride, src += 4)
+            memcpy(dst, src, 4);
+        break;
+    }
+}
+
+/*  Puts a reconstructed scanline of an Adam7 pass where it belongs in data,
+    going through png_put_row() into unpacked first if needed. data is the image scaled
+    down by 1 << shift, with rows pitch bytes apart; passes up to the
+    7 - 2*shift-th have pixels only at the top left corners of such blocks,
+    so they map to it exactly. */
+static void
+png_put_pass_row(pnglite_t* png, unsigned char* data, size_t pitch, unsigned pass, unsigned y,
+                 const unsigned char* src, unsigned width, unsigned char* unpacked,
+                 unsigned shift)
+{
+    const unsigned stride = png_out_stride(png);
+    unsigned char *dst;
+
+    if (!png_put_as_is(png)) {
+        png_put_row(png, unpacked, src, width);
+        src = unpacked;
+    }
+
+    dst = data + (size_t)((y * adam7_vstride[pass] + adam7_vshift[pass]) >> shift) * pitch
+               + (size_t)(adam7_hshift[pass] >> shift) * stride;
+
+    png_scatter_pixels(dst, src, width, (adam7_hstride[pass] >> shift) * stride, stride);
+}
+
+/* Scatters the just reconstructed scanline of an Adam7 pass over the output buffer. */
+static void
+png_put_pass_scanline(pnglite_t* png, unsigned char* data, size_t pitch)
+{
+    png_put_pass_row(png, data, pitch, png->pass, png->pass_row - 1, png->scanline + 1,
+                     png->pass_width, png->unpacked, 0);
+}
+
+/*  Bytes of the decoder's window: two scanlines, the unpacked one and
+    the tables. The pass pitch is never over that of the whole image. */
+static size_t
+png_read_window_size(pnglite_t* png)
+{
+    size_t window = 2 * (png->pitch + 1) + png_unpacked_size(png);
+
+    if (png->out_format)
+        window += 4 * 256;
+    if (png->depth < 8)
+        window += 8 * 256;
+    return window;
+}
+
+/*  Sets up the decoder. Image data is inflated and reconstructed one
+    scanline at a time, so the only buffers needed are the input and
+    a two-scanline window. */
+static int
+png_read_setup(pnglite_t* png)
+{
+    if (png->state != PNG_STATE_CHUNK || png->out_format > PNG_FORMAT_ABGR
+            || ((png->out_format || png->premultiply) && png->depth > 8))
+        return PNG_WRONG_ARGUMENTS;
+
+    png->next_row = 0;
+    png->decoded = 0;
+    png->scanline_fill = 0;
+
+    png->window = png_scratch(png, PNG_SCRATCH_WINDOW, png_read_window_size(png));
+    if (!png->window)
+        return PNG_MEMORY_ERROR;
+
+    png->scanline = png->window;
+    png->prev_scanline = png->window + png->pitch + 1;
+    png->unpacked = png->window + 2 * (png->pitch + 1);
+    /* filled in at the first IDAT, when PLTE and tRNS have been seen */
+    png->lut = png->out_format ? png->unpacked + png_unpacked_size(png) : NULL;
+    png->unpack_lut = NULL;
+    if (png->depth < 8) {
+        png->unpack_lut = png->unpacked + png_unpacked_size(png) + (png->out_format ? 4 * 256 : 0);
+        png_build_unpack_lut(png);
+    }
+
+    png_start_pass(png, 0);
+
+    return png_init_inflate(png);
+}
+
+/* Sets up the decoder and reads up to the first IDAT. */
+static int
+png_read_begin(pnglite_t* png)
+{
+    int result;
+
+    if ((result = png_read_setup(png)) != PNG_NO_ERROR)
+        return result;
+
+    return png_next_idat(png);
+}
+
+static void
+png_read_end(pnglite_t* png)
+{
+    if (png->zs)
+        png_end_inflate(png);
+
+    if (!png->mem)
+        png_scratch_free(png, png->in, png->in_size);
+    png->in = NULL;
+    png->in_size = png->in_len = png->in_pos = 0;
+
+    png_scratch_free(png, png->window, png_read_window_size(png));
+    png->window = NULL;
+    png->lut = NULL;
+    png->unpack_lut = NULL;
+
+    png_scratch_free(png, png->image, (size_t)png->width * png->height * png_out_stride(png));
+    png->image = NULL;
+}
+
+/*  Decodes all of an interlaced image into data. Rows of those
+    are only complete once the last pass is, so there's no point
+    in handing them out one by one. */
+#ifdef PNG_THREADS
+/*  Once inflated, the seven passes are independent filtered images,
+    so they are unfiltered and put in place concurrently, largest first.
+    The last pass is half of the image though, so at best this halves
+    the time spent past inflate. */
+static const unsigned char adam7_by_size[] = { 6, 5, 4, 3, 2, 1, 0 };
+
+typedef struct {
+    pnglite_t*              png;
+    unsigned char*          data;
+    size_t                  pitch;      /* of data */
+    unsigned char*          filtered;   /* all the passes, filter type bytes included */
+    size_t                  offset[7];  /* where each pass starts in the above */
+    const unsigned char*    zeroes;     /* the scanline above the first one */
+    unsigned                next;       /* passes handed out so far */
+    int                     err;
+    pthread_mutex_t         lock;
+} png_passes_t;
+
+typedef struct {
+    png_passes_t*           passes;
+    unsigned char*          unpacked;   /* a scanline's worth of unpacked pixels */
+} png_pass_worker_t;
+
+static void*
+png_pass_worker(void* arg)
+{
+    png_pass_worker_t* w = arg;
+    png_passes_t* ps = w->passes;
+    pnglite_t* png = ps->png;
+    unsigned pass, width, height, pitch, y;
+    unsigned char *row;
+    int err = PNG_NO_ERROR;
+
+    for (;;) {
+        pthread_mutex_lock(&ps->lock);
+        pass = (ps->next < 7 && !ps->err) ? adam7_by_size[ps->next++] : 7;
+        pthread_mutex_unlock(&ps->lock);
+
+        if (pass == 7)
+            break;
+        if (!png_pass_size(png, pass, &width, &height))
+            continue;
+
+        pitch = bytes_per_scanline(width, png->depth, png->color_type);
+        row = ps->filtered + ps->offset[pass];
+        for (y = 0; y < height; y++, row += pitch + 1) {
+            err = png_unfilter(png, row + 1, y ? row + 1 - (pitch + 1) : ps->zeroes, pitch);
+            if (err != PNG_NO_ERROR)
+                break;
+            png_put_pass_row(png, ps->data, ps->pitch, pass, y, row + 1, width, w->unpacked, 0);
+        }
+
+        if (err != PNG_NO_ERROR) {
+            pthread_mutex_lock(&ps->lock);
+            ps->err = err;
+            pthread_mutex_unlock(&ps->lock);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static int
+png_read_interlaced_parallel(pnglite_t* png, unsigned char* data, size_t pitch)
+{
+    png_passes_t ps;
+    png_pass_worker_t workers[7];
+    pthread_t threads[7];
+    unsigned char started[7];
+    unsigned char *zeroes;
+    unsigned nthreads = png->threads < 7 ? png->threads : 7;
+    unsigned pass, width, height, t;
+    size_t total = 0, size;
+    int result;
+
+    for (pass = 0; pass < 7; pass++) {
+        ps.offset[pass] = total;
+        if (png_pass_size(png, pass, &width, &height))
+            total += (size_t)(bytes_per_scanline(width, png->depth, png->color_type) + 1) * height;
+    }
+
+    size = total + png->pitch + nthreads * png_unpacked_size(png);
+    ps.filtered = png_alloc(png, size);
+    if (!ps.filtered)
+        return PNG_MEMORY_ERROR;
+
+    if ((result = png_inflate_all(png, ps.filtered, total)) != PNG_NO_ERROR) {
+        png_free(png, ps.filtered, size);
+        return result;
+    }
+    png->decoded = 1;
+
+    zeroes = ps.filtered + total;
+    memset(zeroes, 0, png->pitch);
+
+    ps.png = png;
+    ps.data = data;
+    ps.pitch = pitch;
+    ps.zeroes = zeroes;
+    ps.next = 0;
+    ps.err = PNG_NO_ERROR;
+    pthread_mutex_init(&ps.lock, NULL);
+
+    /* the calling thread is worker 0 */
+    for (t = 0; t < nthreads; t++) {
+        workers[t].passes = &ps;
+        workers[t].unpacked = zeroes + png->pitch + t * png_unpacked_size(png);
+        started[t] = t > 0 && pthread_create(&threads[t], NULL, png_pass_worker, &workers[t]) == 0;
+    }
+    png_pass_worker(&workers[0]);
+    for (t = 1; t < nthreads; t++)
+        if (started[t])
+            pthread_join(threads[t], NULL);
+
+    pthread_mutex_destroy(&ps.lock);
+    png_free(png, ps.filtered, size);
+
+    /* inflate stops short of the end of the last IDAT, finish its CRC */
+    if (ps.err != PNG_NO_ERROR)
+        return png_idat_verify(png) != PNG_NO_ERROR ? PNG_CRC_ERROR : ps.err;
+
+    result = png_finish_idat(png);
+
+    return result == PNG_DONE ? PNG_NO_ERROR : result;
+}
+#endif /* PNG_THREADS */
+
+/*  Fills each block x block square of the image with its top left pixel.
+    After Adam7 passes 1, 3 and 5 those are all there is for blocks
+    of 8, 4 and 2, and later passes write over the rest anyway. */
+static void
+png_replicate_blocks(pnglite_t* png, unsigned char* data, size_t pitch, unsigned block)
+{
+    const unsigned stride = png_out_stride(png);
+    const size_t rowbytes = (size_t)png->width * stride;
+    unsigned char *row;
+    unsigned x, y, k;
+
+    for (y = 0; y < png->height; y += block) {
+        row = data + y * pitch;
+        for (x = 0; x < png->width; x += block)
+            for (k = 1; k < block && x + k < png->width; k++)
+                memcpy(row + (size_t)(x + k) * stride, row + (size_t)x * stride, stride);
+        for (k = 1; k < block && y + k < png->height; k++)
+            memcpy(row + k * pitch, row, rowbytes);
+    }
+}
+
+/*  Reads all of an interlaced image into data. If there's a preview callback,
+    it's called with a block-replicated image after passes 1, 3 and 5;
+    if it returns non-zero reading stops right there. */
+static int
+png_read_interlaced(pnglite_t* png, unsigned char* data, size_t pitch,
+                    pnglite_preview_callback_t preview, void* user_pointer)
+{
+    int result;
+
+#ifdef PNG_THREADS
+    if (png->threads > 1 && !png->push && !preview)
+        return png_read_interlaced_parallel(png, data, pitch);
+#endif
+
+    while ((result = png_read_scanline(png, png->width)) == PNG_NO_ERROR) {
+        png_put_pass_scanline(png, data, pitch);
+
+        if (preview && png->pass_row == png->pass_height && (png->pass % 2) == 0 && png->pass < 6) {
+            if ((result = png_idat_verify(png)) != PNG_NO_ERROR)
+                return result;
+            png_replicate_blocks(png, data, pitch, 8 >> (png->pass / 2));
+            if ((result = preview(data, png->pass + 1, user_pointer)) != 0)
+                return result;
+        }
+    }
+
+    if (result != PNG_DONE)
+        return result;
+
+    if (png->push)
+        return PNG_NO_ERROR;
+
+    result = png_finish_idat(png);
+
+    return result == PNG_DONE ? PNG_NO_ERROR : result;
+}
+
+/*  Gets row-by-row decoding going. Interlaced images are decoded
+    whole into png->image first. */
+static int
+png_read_rows_prepare(pnglite_t* png)
+{
+    int result = PNG_NO_ERROR;
+
+    if (!png->window) {
+        /* nothing useful pushed yet */
+        if (png->push)
+            return PNG_NEED_MORE;
+
+        result = png_read_begin(png);
+    }
+
+    if ((result == PNG_NO_ERROR) && png->interlace_method && !png->decoded) {
+        if (!png->image) {
+            png->image = png_scratch(png, PNG_SCRATCH_IMAGE, (size_t)png->width * png->height * png_out_stride(png));
+            if (!png->image)
+                return PNG_MEMORY_ERROR;
+        }
+        result = png_read_interlaced(png, png->image, (size_t)png->width * png_out_stride(png), NULL, NULL);
+    }
+
+    return result;
+}
+
+/*  Produces the next image row. If dst is not NULL the row is put there,
+    otherwise *row is pointed at it in the decoder's own buffers. */
+static int
+png_read_row(pnglite_t* png, unsigned char* dst, const unsigned char** row)
+{
+    const size_t rowbytes = (size_t)png->width * png_out_stride(png);
+    const unsigned char *src;
+    int result;
+
+    if (png->interlace_method) {
+        src = png->image + png->next_row * rowbytes;
+        if (dst)
+            memcpy(dst, src, rowbytes);
+        else
+            *row = src;
+        png->next_row += 1;
+        return PNG_NO_ERROR;
+    }
+
+    if ((result = png_read_scanline(png, png->width)) != PNG_NO_ERROR)
+        return result;
+
+    src = png->scanline + 1;
+    if (dst) {
+        png_put_row(png, dst, src, png->width);
+    } else if (!png_put_as_is(png)) {
+        png_put_row(png, png->unpacked, src, png->width);
+        *row = png->unpacked;
+    } else {
+        *row = src;
+    }
+    png->next_row += 1;
+
+    if ((png->next_row == png->height) && !png->push) {
+        result = png_finish_idat(png);
+        return result == PNG_DONE ? PNG_NO_ERROR : result;
+    }
+    return PNG_NO_ERROR;
+}
+
+/*  Only the passes holding the top left pixels of the blocks are read;
+    the rest isn't even inflated. */
+static int
+png_read_interlaced_scaled(pnglite_t* png, unsigned char* data, unsigned shift)
+{
+    const size_t pitch = (size_t)((png->width + (1 << shift) - 1) >> shift) * png->stride;
+    const unsigned last = 6 - 2 * shift;
+    int result;
+
+    while ((result = png_read_scanline(png, png->width)) == PNG_NO_ERROR) {
+        if (png->pass > last)
+            break;
+
+        png_put_pass_row(png, data, pitch, png->pass, png->pass_row - 1, png->scanline + 1,
+                         png->pass_width, png->unpacked, shift);
+
+        if (png->pass == last && png->pass_row == png->pass_height)
+            break;
+    }
+
+    return result == PNG_DONE ? PNG_NO_ERROR : result;
+}
+
+/*  Averages each block of pixels as rows come out of the decoder. Palette
+    indices can't be averaged, so indexed images get the top left pixel
+    of each block instead. */
+static int
+png_read_box_filtered(pnglite_t* png, unsigned char* data, unsigned shift)
+{
+    const unsigned stride = png->stride;
+    const unsigned block = 1 << shift;
+    const unsigned data_width = (png->width + block - 1) >> shift;
+    const size_t data_rowbytes = (size_t)data_width * stride;
+    const unsigned char *row;
+    unsigned char *dst;
+    unsigned short *sums;
+    unsigned x, y, c, n, rows = 0;
+    int result = PNG_NO_ERROR;
+
+    /* 64 samples of 255 at most, that fits */
+    sums = png_alloc(png, data_rowbytes * sizeof(unsigned short));
+    if (!sums)
+        return PNG_MEMORY_ERROR;
+    memset(sums, 0, data_rowbytes * sizeof(unsigned short));
+
+    for (y = 0; y < png->height; y++) {
+        if ((result = png_read_row(png, NULL, &row)) != PNG_NO_ERROR)
+            break;
+
+        dst = data + (size_t)(y >> shift) * data_rowbytes;
+
+        if (png->color_type == PNG_INDEXED) {
+            if ((y & (block - 1)) == 0)
+                for (x = 0; x < data_width; x++)
+                    dst[x] = row[x << shift];
+            continue;
+        }
+
+        for (x = 0; x < png->width; x++)
+            for (c = 0; c < stride; c++)
+                sums[(x >> shift) * stride + c] += row[x * stride + c];
+
+        if (++rows < block && y < png->height - 1)
+            continue;
+
+        for (x = 0; x < data_width; x++) {
+            /* blocks at the right edge may be narrower */
+            n = (png->width - (x << shift) < block ? png->width - (x << shift) : block) * rows;
+            for (c = 0; c < stride; c++)
+                dst[x * stride + c] = (sums[x * stride + c] + n / 2) / n;
+        }
+        memset(sums, 0, data_rowbytes * sizeof(unsigned short));
+        rows = 0;
+    }
+
+    png_free(png, sums, data_rowbytes * sizeof(unsigned short));
+    return result;
+}
+
+static int
+png_read_region_rows(pnglite_t* png, unsigned x, unsigned y, unsigned w, unsigned h, unsigned char* out)
+{
+    const unsigned stride = png->stride;
+    const unsigned char *src;
+    unsigned row;
+    int result = PNG_NO_ERROR;
+
+    for (row = 0; row < y + h; row++) {
+        if ((result = png_read_scanline(png, x + w)) != PNG_NO_ERROR)
+            break;
+        if (row < y)
+            continue;
+
+        src = png->scanline + 1;
+        if (png->depth < 8) {
+            png_unpack_scanline(png, png->unpacked, src, x + w);
+            src = png->unpacked;
+        }
+        memcpy(out + (size_t)(row - y) * w * stride, src + (size_t)x * stride, (size_t)w * stride);
+    }
+
+    return result;
+}
+
+static int
+png_read_region_interlaced(pnglite_t* png, unsigned x, unsigned y, unsigned w, unsigned h, unsigned char* out)
+{
+    const unsigned stride = png->stride;
+    const unsigned char *src;
+    unsigned char *dst;
+    unsigned iy, first, last;
+    int result;
+
+    while ((result = png_read_scanline(png, x + w)) == PNG_NO_ERROR) {
+        iy = (png->pass_row - 1) * adam7_vstride[png->pass] + adam7_vshift[png->pass];
+        if (iy >= y + h) {
+            /* nothing below the region is needed once in the last pass */
+            if (png_last_pass(png))
+                break;
+            continue;
+        }
+        if (iy < y)
+            continue;
+
+        first = png_pass_columns(png, png->pass, x);
+        last = png_pass_columns(png, png->pass, x + w);
+        if (first == last)
+            continue;
+
+        src = png->scanline + 1;
+        if (png->depth < 8) {
+            png_unpack_scanline(png, png->unpacked, src, last);
+            src = png->unpacked;
+        }
+        dst = out + ((size_t)(iy - y) * w + first * adam7_hstride[png->pass] + adam7_hshift[png->pass] - x) * stride;
+        png_scatter_pixels(dst, src + (size_t)first * stride, last - first,
+                           adam7_hstride[png->pass] * stride, stride);
+    }
+
+    return result == PNG_DONE ? PNG_NO_ERROR : result;
+}
+
+int
+pnglite_read_region(pnglite_t* png, unsigned x, unsigned y, unsigned w, unsigned h, unsigned char* out)
+{
+    int result;
+
+    if (png->push || png->out_format || png->premultiply || w == 0 || h == 0 || x >= png->width || w > png->width - x
+            || y >= png->height || h > png->height - y)
+        return PNG_WRONG_ARGUMENTS;
+
+    result = png_read_begin(png);
+
+    if (result == PNG_NO_ERROR) {
+        if (png->interlace_method)
+            result = png_read_region_interlaced(png, x, y, w, h, out);
+        else
+            result = png_read_region_rows(png, x, y, w, h, out);
+    }
+    if (result == PNG_NO_ERROR)
+        result = png_idat_verify(png);
+
+    png_read_end(png);
+    png->next_row = png->height;
+
+    return result;
+}
+
+/* reads the checkpoint at pos in index->data, returns its serialized size */
+static size_t
+png_index_point(const pnglite_index_t* index, size_t pos, unsigned pitch, png_checkpoint_t* point)
+{
+    const unsigned char *p = index->data + pos;
+
+    point->offset = ((size_t)get_ul(p) << 16 << 16) | get_ul(p + 4);
+    point->idat_left = get_ul(p + 8);
+    point->row = get_ul(p + 12);
+    point->fill = get_ul(p + 16);
+    point->window_len = get_ul(p + 20);
+    point->bits = p[24];
+    point->byte = p[25];
+    point->data = p + PNG_CHECKPOINT_SIZE;
+
+    return PNG_CHECKPOINT_SIZE + (size_t)point->window_len + pitch + point->fill;
+}
+
+static int
+png_index_matches(pnglite_t* png, const pnglite_index_t* index)
+{
+    return (index->width == png->width) && (index->height == png->height) &&
+           (index->depth == png->depth) && (index->color_type == png->color_type) &&
+           !png->interlace_method;
+}
+
+/* sets the decoder up as it was at the checkpoint */
+static int
+png_index_resume(pnglite_t* png, const pnglite_index_t* index, const png_checkpoint_t* point)
+{
+    z_stream *stream;
+    int result;
+
+    /* stream offset of the first unparsed byte, past whatever was read ahead */
+    if (png->read_pos - (png->in_len - png->in_pos) > point->offset)
+        return PNG_WRONG_ARGUMENTS;
+
+    if ((result = png_read_setup(png)) != PNG_NO_ERROR)
+        return result;
+
+    stream = png->zs;
+    png->zerr = inflateReset2(stream, -15);
+    if ((png->zerr == Z_OK) && point->bits)
+        png->zerr = inflatePrime(stream, point->bits, point->byte >> (8 - point->bits));
+    if (png->zerr == Z_OK)
+        png->zerr = inflateSetDictionary(stream, point->data, point->window_len);
+    if (png->zerr != Z_OK)
+        return PNG_ZLIB_ERROR;
+
+    memcpy(png->scanline + 1, point->data + point->window_len, png->pitch);
+    memcpy(png->prev_scanline, point->data + point->window_len + png->pitch, point->fill);
+    png->pass_row = point->row;
+    png->scanline_fill = point->fill;
+
+    png->transparency_present = index->transparency_present;
+    png->palette_size = index->palette_size;
+    memcpy(png->colorkey, index->colorkey, 6);
+    memcpy(png->palette, index->palette, 1024);
+    if (png->lut)
+        png_build_lut(png);
+
+    if (point->offset > png->read_pos) {
+        if (file_read(png, 0, point->offset - png->read_pos, 1) != 1)
+            return PNG_EOF_ERROR;
+        png->in_pos = png->in_len;
+    } else {
+        png->in_pos = png->in_len - (png->read_pos - point->offset);
+    }
+
+    /* the rest of the IDAT payload and its CRC */
+    if ((result = png_need(png, (size_t)point->idat_left + 4)) != PNG_NO_ERROR)
+        return result;
+
+    /* the CRC covers the whole payload, there's no checking the rest of it */
+    png->chunk_length = point->idat_left;
+    png->idat_unchecked = 0;
+    stream->next_in = png->in + png->in_pos;
+    stream->avail_in = point->idat_left;
+    png->idat_seen = 1;
+    png->state = PNG_STATE_IDAT;
+
+    return PNG_NO_ERROR;
+}
+
+int
+pnglite_index_build(pnglite_t* png, unsigned char* data, unsigned strip_rows, pnglite_index_t** index)
+{
+    const size_t rowbytes = (size_t)png->width * png_out_stride(png);
+    const unsigned char *row;
+    pnglite_index_t *idx;
+    int result;
+
+    *index = NULL;
+
+    if (png->push || png->interlace_method || strip_rows == 0)
+        return PNG_WRONG_ARGUMENTS;
+
+    idx = png_alloc(png, sizeof(pnglite_index_t));
+    if (!idx)
+        return PNG_MEMORY_ERROR;
+
+    idx->free = png->free;
+    idx->allocator = png->allocator;
+    idx->width = png->width;
+    idx->height = png->height;
+    idx->depth = png->depth;
+    idx->color_type = png->color_type;
+    idx->strip_rows = strip_rows;
+    idx->next_row = strip_rows;
+    idx->count = 0;
+    idx->data = NULL;
+    idx->data_len = idx->data_size = 0;
+
+    png->index = idx;
+    result = png_read_begin(png);
+
+    while (result == PNG_NO_ERROR && png->next_row < png->height)
+        result = png_read_row(png, data ? data + png->next_row * rowbytes : NULL, &row);
+
+    png->index = NULL;
+    png_read_end(png);
+    png->next_row = png->height;
+
+    if (result != PNG_NO_ERROR) {
+        pnglite_index_free(idx);
+        return result;
+    }
+
+    idx->transparency_present = png->transparency_present;
+    idx->palette_size = png->palette_size;
+    memcpy(idx->colorkey, png->colorkey, 6);
+    memcpy(idx->palette, png->palette, 1024);
+
+    *index = idx;
+
+    return PNG_NO_ERROR;
+}
+
+int
+pnglite_read_rows_indexed(pnglite_t* png, const pnglite_index_t* index,
+                          unsigned first_row, unsigned nrows, unsigned char* out)
+{
+    const size_t rowbytes = (size_t)png->width * png_out_stride(png);
+    png_checkpoint_t point, start;
+    unsigned row, i;
+    size_t pos = 0;
+    int result;
+
+    if (png->push || !png_index_matches(png, index) || nrows == 0
+            || first_row >= png->height || nrows > png->height - first_row)
+        return PNG_WRONG_ARGUMENTS;
+
+    memset(&start, 0, sizeof(start));
+    for (i = 0; i < index->count; i++) {
+        pos += png_index_point(index, pos, png->pitch, &point);
+        if (point.row > first_row)
+            break;
+        start = point;
+    }
+
+    if (start.row == 0)
+        result = png_read_begin(png);
+    else
+        result = png_index_resume(png, index, &start);
+
+    for (row = start.row; result == PNG_NO_ERROR && row < first_row + nrows; row++) {
+        if ((result = png_read_scanline(png, png->width)) != PNG_NO_ERROR)
+            break;
+        if (row >= first_row)
+            png_put_row(png, out + (row - first_row) * rowbytes, png->scanline + 1, png->width);
+    }
+    if (result == PNG_NO_ERROR)
+        result = png_idat_verify(png);
+
+    png_read_end(png);
+    png->next_row = png->height;
+
+    return result;
+}
+
+/*  sidecar header: magic, width, height, depth, color type, 2 zero bytes,
+    strip rows, checkpoint count, their size and the size of what follows,
+    which is the palette, colorkey, palette size and transparency flag, then
+    the checkpoints, all deflated together */
+#define PNG_INDEX_HEADER_SIZE 36
+#define PNG_INDEX_PALETTE_SIZE (1024 + 6 + 2 + 1)
+static const unsigned char png_index_magic[8] = { 0x89, 'P', 'L', 'I', 0x0D, 0x0A, 0x1A, 0x0A };
+
+int
+pnglite_index_save(pnglite_t* png, const pnglite_index_t* index,
+                   pnglite_write_callback_t write_fun, void* user_pointer)
+{
+    unsigned char header[PNG_INDEX_HEADER_SIZE];
+    unsigned char palette[PNG_INDEX_PALETTE_SIZE];
+    unsigned char *compressed = NULL;
+    z_stream stream;
+    size_t length = 0, bound;
+    int result = PNG_NO_ERROR;
+
+    if (index->data_len > 0xFFFFFFFFu)
+        return PNG_IMAGE_TOO_BIG;
+
+    memset(&stream, 0, sizeof(z_stream));
+    stream.opaque = png;
+    stream.zalloc = z_alloc_func;
+    stream.zfree = z_free_func;
+
+    if ((png->zerr = deflateInit(&stream, Z_DEFAULT_COMPRESSION)) != Z_OK)
+        return PNG_ZLIB_ERROR;
+
+    bound = deflateBound(&stream, (uLong)(PNG_INDEX_PALETTE_SIZE + index->data_len));
+    compressed = png_alloc(png, bound);
+    if (!compressed) {
+        deflateEnd(&stream);
+        return PNG_MEMORY_ERROR;
+    }
+
+    memcpy(palette, index->palette, 1024);
+    memcpy(palette + 1024, index->colorkey, 6);
+    palette[1030] = (unsigned char)(index->palette_size >> 8);
+    palette[1031] = (unsigned char)index->palette_size;
+    palette[1032] = index->transparency_present;
+
+    stream.next_in = palette;
+    stream.avail_in = PNG_INDEX_PALETTE_SIZE;
+    stream.next_out = compressed;
+    stream.avail_out = (uInt)bound;
+
+    /* output room is enough for both, so all of the palette goes in */
+    png->zerr = deflate(&stream, Z_NO_FLUSH);
+    if (png->zerr == Z_OK) {
+        stream.next_in = index->data;
+        stream.avail_in = (uInt)index->data_len;
+        png->zerr = deflate(&stream, Z_FINISH);
+    }
+
+    if (png->zerr != Z_STREAM_END) {
+        png->zmsg = stream.msg;
+        result = PNG_ZLIB_ERROR;
+    }
+    length = stream.total_out;
+    deflateEnd(&stream);
+
+    if (result == PNG_NO_ERROR) {
+        memcpy(header, png_index_magic, 8);
+        set_ul(header + 8, index->width);
+        set_ul(header + 12, index->height);
+        header[16] = index->depth;
+        header[17] = index->color_type;
+        header[18] = header[19] = 0;
+        set_ul(header + 20, index->strip_rows);
+        set_ul(header + 24, index->count);
+        set_ul(header + 28, (unsigned)index->data_len);
+        set_ul(header + 32, (unsigned)length);
+
+        if ((write_fun(header, 1, PNG_INDEX_HEADER_SIZE, user_pointer) != PNG_INDEX_HEADER_SIZE) ||
+            (write_fun(compressed, 1, length, user_pointer) != length))
+            result = PNG_IO_ERROR;
+    }
+
+    png_free(png, compressed, bound);
+
+    return result;
+}
+
+/* checks the checkpoints read from a sidecar fit the image and each other */
+static int
+png_index_check(pnglite_t* png, const pnglite_index_t* index)
+{
+    png_checkpoint_t point;
+    unsigned i, row = 0;
+    size_t pos = 0, size;
+
+    for (i = 0; i < index->count; i++) {
+        if (index->data_len - pos < PNG_CHECKPOINT_SIZE)
+            return PNG_CORRUPTED;
+
+        size = png_index_point(index, pos, png->pitch, &point);
+
+        if ((point.window_len > 32768) || (point.fill > png->pitch + 1) || (point.bits > 7) ||
+            (point.row <= row) || (point.row >= png->height) ||
+            (index->data_len - pos < size))
+            return PNG_CORRUPTED;
+
+        pos += size;
+        row = point.row;
+    }
+
+    return pos == index->data_len ? PNG_NO_ERROR : PNG_CORRUPTED;
+}
+
+int
+pnglite_index_load(pnglite_t* png, pnglite_read_callback_t read_fun, void* user_pointer,
+                   pnglite_index_t** index)
+{
+    unsigned char header[PNG_INDEX_HEADER_SIZE];
+    unsigned char palette[PNG_INDEX_PALETTE_SIZE];
+    unsigned char *compressed;
+    pnglite_index_t *idx;
+    z_stream stream;
+    size_t length;
+    int result = PNG_NO_ERROR;
+
+    *index = NULL;
+
+    if (read_fun(header, 1, PNG_INDEX_HEADER_SIZE, user_pointer) != PNG_INDEX_HEADER_SIZE)
+        return PNG_EOF_ERROR;
+
+    if (memcmp(header, png_index_magic, 8) != 0)
+        return PNG_HEADER_ERROR;
+
+    idx = png_alloc(png, sizeof(pnglite_index_t));
+    if (!idx)
+        return PNG_MEMORY_ERROR;
+
+    idx->free = png->free;
+    idx->allocator = png->allocator;
+    idx->width = get_ul(header + 8);
+    idx->height = get_ul(header + 12);
+    idx->depth = header[16];
+    idx->color_type = header[17];
+    idx->strip_rows = get_ul(header + 20);
+    idx->next_row = 0;
+    idx->count = get_ul(header + 24);
+    idx->data_len = idx->data_size = get_ul(header + 28);
+    length = get_ul(header + 32);
+
+    if (!png_index_matches(png, idx)) {
+        png_free(png, idx, sizeof(pnglite_index_t));
+        return PNG_WRONG_ARGUMENTS;
+    }
+
+    idx->data = png_alloc(png, idx->data_size ? idx->data_size : 1);
+    compressed = png_alloc(png, length ? length : 1);
+    if (!idx->data || !compressed) {
+        png_free(png, compressed, length ? length : 1);
+        pnglite_index_free(idx);
+        return PNG_MEMORY_ERROR;
+    }
+
+    if (read_fun(compressed, 1, length, user_pointer) != length)
+        result = PNG_EOF_ERROR;
+
+    if (result == PNG_NO_ERROR) {
+        memset(&stream, 0, sizeof(z_stream));
+        stream.opaque = png;
+        stream.zalloc = z_alloc_func;
+        stream.zfree = z_free_func;
+
+        if ((png->zerr = inflateInit(&stream)) != Z_OK)
+            result = PNG_ZLIB_ERROR;
+    }
+
+    if (result == PNG_NO_ERROR) {
+        stream.next_in = compressed;
+        stream.avail_in = (uInt)length;
+        stream.next_out = palette;
+        stream.avail_out = PNG_INDEX_PALETTE_SIZE;
+
+        png->zerr = inflate(&stream, Z_NO_FLUSH);
+        if ((png->zerr == Z_OK) && (stream.avail_out == 0)) {
+            stream.next_out = idx->data;
+            stream.avail_out = (uInt)idx->data_len;
+            png->zerr = inflate(&stream, Z_FINISH);
+        }
+
+        if ((png->zerr != Z_STREAM_END) || (stream.total_out != PNG_INDEX_PALETTE_SIZE + idx->data_len)) {
+            png->zmsg = stream.msg;
+            result = PNG_CORRUPTED;
+        }
+        inflateEnd(&stream);
+    }
+
+    if (result == PNG_NO_ERROR) {
+        memcpy(idx->palette, palette, 1024);
+        memcpy(idx->colorkey, palette + 1024, 6);
+        idx->palette_size = (palette[1030] << 8) | palette[1031];
+        idx->transparency_present = palette[1032];
+
+        if (idx->palette_size > 256)
+            result = PNG_CORRUPTED;
+    }
+
+    png_free(png, compressed, length ? length : 1);
+
+    if (result == PNG_NO_ERROR)
+        result = png_index_check(png, idx);
+
+    if (result != PNG_NO_ERROR) {
+        pnglite_index_free(idx);
+        return result;
+    }
+
+    *index = idx;
+
+    return PNG_NO_ERROR;
+}
+
+void
+pnglite_index_free(pnglite_index_t* index)
+{
+    if (!index)
+        return;
+
+    png_free_with(&index->allocator, index->free, index->data, index->data_size ? index->data_size : 1);
+    png_free_with(&index->allocator, index->free, index, sizeof(pnglite_index_t));
+}
+
+int
+pnglite_read_image_scaled(pnglite_t* png, unsigned char* data, unsigned shift)
+{
+    int result;
+
+    if (shift == 0)
+        return pnglite_read_image(png, data);
+
+    if (shift > 3 || png->push || png->out_format || png->premultiply)
+        return PNG_WRONG_ARGUMENTS;
+
+    result = png_read_begin(png);
+
+    if (result == PNG_NO_ERROR) {
+        if (png->interlace_method)
+            result = png_read_interlaced_scaled(png, data, shift);
+        else
+            result = png_read_box_filtered(png, data, shift);
+    }
+    /* reading may stop short of the end of the image data */
+    if (result == PNG_NO_ERROR)
+        result = png_idat_verify(png);
+
+    png_read_end(png);
+    png->next_row = png->height;
+
+    return result;
+}
+
+/* Decodes the whole image into data, its rows pitch bytes apart. */
+#ifdef PNG_LIBDEFLATE
+/*  Reads a non-interlaced image whose data is all in memory: it's inflated
+    in one go, then unfiltered from there. That takes a buffer the size
+    of the filtered image, but libdeflate goes about twice as fast as
+    zlib taking a scanline at a time. */
+static int
+png_read_whole(pnglite_t* png, unsigned char* data, size_t pitch)
+{
+    const size_t rowbytes = (size_t)png->pitch + 1;
+    const size_t size = rowbytes * png->height;
+    unsigned char *filtered, *row;
+    unsigned y;
+    int result;
+
+    filtered = png_scratch(png, PNG_SCRATCH_FILTERED, size);
+    if (!filtered)
+        return PNG_MEMORY_ERROR;
+
+    result = png_inflate_all(png, filtered, size);
+    if (result == PNG_NO_ERROR) {
+        png->decoded = 1;
+
+        /* png_start_pass() zeroed the scanline for the one above the first */
+        for (y = 0, row = filtered; y < png->height; y++, row += rowbytes) {
+            result = png_unfilter(png, row + 1, y ? row + 1 - rowbytes : png->scanline + 1, png->pitch);
+            if (result != PNG_NO_ERROR)
+                break;
+            png_put_row(png, data + y * pitch, row + 1, png->width);
+        }
+    }
+    png_scratch_free(png, filtered, size);
+
+    if (result == PNG_NO_ERROR) {
+        png->next_row = png->height;
+        result = png_finish_idat(png);
+        if (result == PNG_DONE)
+            result = PNG_NO_ERROR;
+    }
+
+    return result;
+}
+#endif /* PNG_LIBDEFLATE */
+
+static int
+png_read_image(pnglite_t* png, unsigned char* data, size_t pitch,
+               pnglite_preview_callback_t preview, void* user_pointer)
+{
+    int result;
+
+    if (png->push || pitch < (size_t)png->width * png_out_stride(png))
+        return PNG_WRONG_ARGUMENTS;
+
+    result = png_read_begin(png);
+
+    if (result == PNG_NO_ERROR) {
+        if (png->interlace_method) {
+            result = png_read_interlaced(png, data, pitch, preview, user_pointer);
+#ifdef PNG_LIBDEFLATE
+        } else if (png_inflate_whole(png)) {
+            result = png_read_whole(png, data, pitch);
+#endif
+        } else {
+            while (result == PNG_NO_ERROR && png->next_row < png->height)
+                result = png_read_row(png, data + png->next_row * pitch, NULL);
+        }
+    }
+
+    png_read_end(png);
+    png->next_row = png->height;
+
+    return result;
+}
+
+int
+pnglite_read_image(pnglite_t* png, unsigned char* data)
+{
+    return png_read_image(png, data, (size_t)png->width * png_out_stride(png), NULL, NULL);
+}
+
+int
+pnglite_read_image_pitch(pnglite_t* png, unsigned char* data, size_t pitch)
+{
+    return png_read_image(png, data, pitch, NULL, NULL);
+}
+
+int
+pnglite_read_image_progressive(pnglite_t* png, unsigned char* data,
+                               pnglite_preview_callback_t preview, void* user_pointer)
+{
+    return png_read_image(png, data, (size_t)png->width * png_out_stride(png), preview, user_pointer);
+}
+
+int
+pnglite_read_next_rows(pnglite_t* png, unsigned char* buf, unsigned nrows)
+{
+    const size_t rowbytes = (size_t)png->width * png_out_stride(png);
+    unsigned n = 0;
+    int result;
+
+    if (png->next_row >= png->height)
+        return 0;
+
+    result = png_read_rows_prepare(png);
+
+    while (result == PNG_NO_ERROR && n < nrows && png->next_row < png->height) {
+        result = png_read_row(png, buf + n * rowbytes, NULL);
+        if (result == PNG_NO_ERROR)
+            n += 1;
     }
-    return PNG_NO_ERROR;
+    if ((result == PNG_NO_ERROR || result == PNG_NEED_MORE) && n > 0) {
+        const int crc = png_idat_verify(png);
+        if (crc != PNG_NO_ERROR)
+            result = crc;
+    }
+
+    if (result == PNG_NEED_MORE)
+        return n;
+
+    if ((result != PNG_NO_ERROR) || ((png->next_row == png->height) && !png->push)) {
+        png_read_end(png);
+        png->next_row = png->height;
+    }
+
+    return result == PNG_NO_ERROR ? (int)n : result;
 }
 
-static void
-png_unpack_byte(unsigned char *dst, unsigned char *src, int depth)
+int
+pnglite_read_rows(pnglite_t* png, pnglite_row_callback_t callback, void* user_pointer)
 {
-    switch (depth) {
-    case 1:
-        *dst++ = (*src & 0x80) ? 1 : 0;
-        *dst++ = (*src & 0x40) ? 1 : 0;
-        *dst++ = (*src & 0x20) ? 1 : 0;
-        *dst++ = (*src & 0x10) ? 1 : 0;
-        *dst++ = (*src & 0x08) ? 1 : 0;
-        *dst++ = (*src & 0x04) ? 1 : 0;
-        *dst++ = (*src & 0x02) ? 1 : 0;
-        *dst++ = (*src & 0x01) ? 1 : 0;
-        break;
-    case 2:
-        *dst++ = (*src & 0xC0) >> 6;
-        *dst++ = (*src & 0x30) >> 4;
-        *dst++ = (*src & 0x0C) >> 2;
-        *dst++ = (*src & 0x03);
-        break;
-    case 4:
-        *dst++ = (*src & 0xF0) >> 4;
-        *dst++ = (*src & 0x0F);
-        break;
-    default:
-        /* can't be, we caught this in read_ihdr */
-        break;
+    const unsigned char *row;
+    unsigned y;
+    int result;
+
+    if (png->next_row >= png->height)
+        return PNG_NO_ERROR;
+
+    result = png_read_rows_prepare(png);
+
+    while (result == PNG_NO_ERROR && png->next_row < png->height) {
+        y = png->next_row;
+        if ((result = png_read_row(png, NULL, &row)) != PNG_NO_ERROR)
+            break;
+        if ((result = png_idat_verify(png)) != PNG_NO_ERROR)
+            break;
+        result = callback(row, y, user_pointer);
+    }
+
+    if (result == PNG_NEED_MORE)
+        return PNG_NO_ERROR;
+
+    if ((result != PNG_NO_ERROR) || !png->push) {
+        png_read_end(png);
+        png->next_row = png->height;
     }
+
+    return result;
 }
 
-static int
-png_unfilter_unpack(pnglite_t *png, unsigned char *data)
+int
+pnglite_push(pnglite_t* png, const void* bytes, size_t len)
 {
+    z_stream *stream;
     int result;
-    unsigned char *packed_pixels;
-    unsigned char *packed_data;
-    unsigned char *unpacked_row;
-    unsigned row, offset;
-    unsigned char tail[8];
-    const unsigned pipeby = 8 / png->depth; /* pixels per byte */
-#ifdef TRACE
-    fprintf(stderr, "png_unfilter_unpack(): got data=%p\n", data);
-#endif
-    if (png->depth < 8) {
-        packed_data = png->alloc(png->height * png->pitch);
 
-        if (!packed_data)
-            return PNG_MEMORY_ERROR;
-
-        result = png_unfilter(png, packed_data);
+    if (!png->push)
+        return PNG_WRONG_ARGUMENTS;
 
-        if (result != PNG_NO_ERROR) {
-            png->free(packed_data);
+    if (len > 0) {
+        if ((result = png_in_reserve(png, len)) != PNG_NO_ERROR)
             return result;
-        }
+        memcpy(png->in + png->in_len, bytes, len);
+        png->in_len += len;
+    }
 
-        for (row = 0; row < png->height; row++) {
-            packed_pixels = packed_data + row * png->pitch;
-            unpacked_row = data + png->width*row;
+    for (;;) {
+        if (png->window) {
+            stream = png->zs;
+            /* inflate has something to chew on, or rows are waiting to be read */
+            if ((!png->decoded && (png->state == PNG_STATE_IDAT) && (stream->avail_in > 0)) ||
+                (png->decoded && (png->next_row < png->height)))
+                return PNG_ROWS_READY;
+        } else if (png->state == PNG_STATE_CHUNK) {
+            /* header is in */
+            if ((result = png_read_setup(png)) != PNG_NO_ERROR)
+                break;
+        }
 
-            if (png->width % pipeby) {
-                for (offset = 0; offset + pipeby < png->width; offset += pipeby)
-                    png_unpack_byte(unpacked_row + offset, packed_pixels++,
-                                    png->depth);
+        result = png_parse_chunk(png);
 
-                /*  here *packed_pixels is the last byte of data for the row,
-                    unpacked_row + offset points to the last unpacked pixels
-                    in the row. There are png->width % pipeby of them. */
-                png_unpack_byte(tail, packed_pixels, png->depth);
-#ifdef TRACE
-                fprintf(stderr, "png_unfilter_unpack(): copy unpacked tail at offs %d len %d unpacked_row %p: ",
-                        offset, png->width % pipeby, (void *)unpacked_row);
-#endif
-                memcpy(unpacked_row + offset, tail, png->width % pipeby);
-#ifdef TRACE
-                for (unsigned ii = 0; ii < png->width % pipeby; ii++) { fprintf(stderr, "%02x ", (int)(tail[ii])); }
-                fprintf(stderr, "\n");
-#endif
-            } else {
-                for (offset = 0; offset < png->width; offset += pipeby)
-                    png_unpack_byte(unpacked_row + offset, packed_pixels++,
-                                    png->depth);
-            }
+        if (result == PNG_DONE) {
+            /* IEND before the image data is complete */
+            if (!png->decoded)
+                result = PNG_CORRUPTED;
+            break;
         }
+        if ((result != PNG_NO_ERROR) && (result != PNG_IDAT_FOUND))
+            break;
+    }
 
-        png->free(packed_data);
-    } else {
-        result = png_unfilter(png, data);
+    if (result != PNG_NEED_MORE) {
+        png_read_end(png);
+        png->next_row = png->height;
     }
+
     return result;
 }
 
-/* Intentionally done the dumbest way possible. Who ever interlaces PNGs nowadays? Focus on correctness */
-static int
-png_deinterlace(pnglite_t* png, unsigned char *data)
+void
+pnglite_read_abort(pnglite_t* png)
 {
-    int result = PNG_NO_ERROR;
-    pnglite_t subpng;
-    /* set up invariants for subimages */
-    png_init_copy(png, &subpng);
-    subpng.color_type = png->color_type;
-    subpng.filter_method = png->filter_method;
-    subpng.compression_method = 0;
-    subpng.depth = png->depth;
-    subpng.interlace_method = 0;
-    subpng.stride = png->stride;
-    int stride = subpng.stride; /* bytes per unpacked pixel */
+    png_read_end(png);
+    png->next_row = png->height;
+}
 
-/* Adam7
-   1 6 4 6 2 6 4 6
-   7 7 7 7 7 7 7 7
-   5 6 5 6 5 6 5 6
-   7 7 7 7 7 7 7 7
-   3 6 4 6 3 6 4 6
-   7 7 7 7 7 7 7 7
-   5 6 5 6 5 6 5 6
-   7 7 7 7 7 7 7 7
- */
-    /* pass no                       1  2  3  4  5  6  7 */
-    const unsigned int hstride[] = { 8, 8, 4, 4, 2, 2, 1 };
-    const unsigned int vstride[] = { 8, 8, 8, 4, 4, 2, 2 };
-    const unsigned int hshift[]  = { 0, 4, 0, 2, 0, 1, 0 };
-    const unsigned int vshift[]  = { 0, 0, 4, 0, 2, 0, 1 };
-
-    unsigned int offset = 0, x, y;
-    unsigned char* subdata = NULL;
-    int pass = 0;
-#ifdef TRACE
-    int n = 0, maxoffs = 0;
-# ifndef TRACE_DEINTERLACE
-    memset(data, 0x23, png->width * png->height * png->stride);
-# endif
-#endif
-    /* allocate subdata for the last pass, that would be all the most we need for any of the passes */
-    int subdata_max = (png->width * bytes_per_pixel(png->depth, png->color_type)) * ( png->height/2 + 1);
-    subdata = png->alloc(subdata_max);
-    if (subdata == NULL) {
-        return PNG_MEMORY_ERROR;
-    }
-    do {
-#ifdef TRACE_DEINTERLACE_DESTRUCTIVE
-        /* make it so that deinterlace passes are not additive; breaks output */
-        memset(data, 0x23, png->width * png->height * png->stride);
-#endif
+pnglite_decoder_t*
+pnglite_decoder_new(pnglite_alloc_t pngalloc, pnglite_free_t pngfree)
+{
+    pnglite_decoder_t *dec;
 
-        /* see if we're to skip this pass if the image is too small */
-        if ((hshift[pass] >= png->width) || (vshift[pass] >= png->height)) {
-            /* this way we don't get to have a scanline */
-            pass += 1;
-            continue;
-        }
-        /* now, (png->width - hshift[pass] + hstride[pass] - 1) / hstride[pass]
-         *     would that be the number of expected columns? Yup.
-         *  same for scanlines.
-         *
-         * set up a temporary png_t for this subimage
-         */
-        subpng.width = (png->width - hshift[pass] + hstride[pass] - 1) / hstride[pass];
-        subpng.height = (png->height - vshift[pass] + vstride[pass] - 1) / vstride[pass];
-        /* make sure we get at least one scanline and column */
-        subpng.width = subpng.width > 0 ? subpng.width : 1;
-        subpng.height = subpng.height > 0 ? subpng.height : 1;
-        /* the rest is trivial */
-        subpng.pitch = bytes_per_scanline(subpng.width, subpng.depth, subpng.color_type);
-        subpng.png_datalen = subpng.height * (subpng.pitch + 1);
-        subpng.png_data = png->png_data + offset;
-#ifdef TRACE
-        fprintf(stderr, "png_deinterlace() pass %d: subimage %dx%d pitch=%d datalen=%d offset=%d from %p\n",
-                pass + 1, subpng.width, subpng.height, subpng.pitch , subpng.png_datalen,
-                offset, (void *)subpng.png_data);
-#endif
-        offset += subpng.png_datalen;
-        if (offset > png->png_datalen) {
-#ifdef TRACE
-            fprintf(stderr, "png_deinterlace() pass %d: not enough data (end-of-pass-data at %u > png_datalen %u)\n",
-                   pass + 1, offset, png->png_datalen);
-#endif
-            png->free(subdata);
-            return PNG_CORRUPTED;
-        }
-        result = png_unfilter_unpack(&subpng, subdata);
-        if (PNG_NO_ERROR != result) {
-#ifdef TRACE
-            fprintf(stderr, "png_deinterlace() pass %d: freeing subdata at %p\n", pass + 1, (void *)subdata);
-#endif
-            png->free(subdata);
-            return result;
-        }
-        /* not optimizing it - not worth the time */
-        for (y = 0; y < subpng.height; y++) {
-#ifdef TRACE_DEINTERLACE
-            fprintf(stderr, "pass %d unp %d:", pass + 1, y);
-#endif
-            for (x = 0; x < subpng.width; x++) {
-                for (int bi = 0; bi < png->stride; bi++) {
-                    int destx = x * hstride[pass] + hshift[pass];
-                    int desty = y * vstride[pass] + vshift[pass];
-                    int desti = desty*stride*png->width + destx*stride + bi;
-#ifdef TRACE_DEINTERLACE
-                    fprintf(stderr, "desti = %d * %d * %d + %d * %d + %d = %d\n",
-                            desty, stride, png->width, destx, stride,  bi, desti);
-#endif
-                    int srci = y*stride*subpng.width + x*stride + bi;
-                    data[desti] = subdata[srci];
-#ifdef TRACE_DEINTERLACE
-                    if (desti > maxoffs) { maxoffs = desti; }
-                    n += 1;
-                    fprintf(stderr, "    set (%d,%d) -> (%d,%d) to %d from %d at %d\n", x, y, destx, desty, (int)subdata[srci], srci, desti);
-#endif
-                }
-            }
-#ifdef TRACE_DEINTERLACE
-            fprintf(stderr, "\n");
-#endif
-        }
-#ifdef TRACE_DEINTERLACE_DESTRUCTIVE
-        /* without the memset above this causes tons of uninit value errors from valgrind */
-        for (y = 0; y < png->height ; y++) {
-            fprintf(stderr, "png_deinterlace() pass %d row %03d: ", pass + 1, y);
-            for (x= 0 ; x < png->width ; x++) {
-                if (data[x*stride + y*png->height*stride] != 0x23) {
-                    fprintf(stderr, "%02x ", data[x*stride + y*png->height*stride]);
-                } else {
-                    fprintf(stderr, "__ ");
-                }
-            }
-            fprintf(stderr, "\n");
-        }
-#endif
-        pass += 1;
-    } while (pass < 7);
-#ifdef TRACE
-    fprintf(stderr, "png_deinterlace(): %d pixels set of %dx%d =%d  at %p maxoffs=%d \n", n, png->width, png->height, png->width * png->height, data, maxoffs);
-#endif
-    png->free(subdata);
-    return result;
+    if (!pngalloc)
+        pngalloc = malloc;
+    if (!pngfree)
+        pngfree = free;
+
+    dec = pngalloc(sizeof(pnglite_decoder_t));
+    if (!dec)
+        return NULL;
+
+    memset(dec, 0, sizeof(pnglite_decoder_t));
+    dec->alloc = pngalloc;
+    dec->free = pngfree;
+
+    return dec;
 }
 
-int
-pnglite_read_image(pnglite_t* png, unsigned char* data)
+void
+pnglite_decoder_free(pnglite_decoder_t* decoder)
 {
-    int result = PNG_NO_ERROR;
+    unsigned i;
 
-    png->transparency_present = 0;
-    png->palette_size = 0;
-    png->png_data = NULL;
+    if (!decoder)
+        return;
 
-    while(result == PNG_NO_ERROR) {
-        result = png_process_chunk(png);
-    }
-    if(result != PNG_DONE) {
-        if (png->png_data) {
-            png->free(png->png_data);
-        }
-        return result;
+    if (decoder->zs) {
+        inflateEnd(decoder->zs);
+        decoder->free(decoder->zs);
     }
-    if (png->png_data == NULL) {
-#ifdef TRACE
-        fprintf(stderr, "png_get_data() : no IDAT chunk in file.\n");
+#ifdef PNG_LIBDEFLATE
+    if (decoder->ld)
+        libdeflate_free_decompressor(decoder->ld);
 #endif
-        /* no IDAT chunk in file */
-        return PNG_CORRUPTED;
+    for (i = 0; i < PNG_SCRATCH_KINDS; i++)
+        decoder->free(decoder->buf[i]);
+    decoder->free(decoder);
+}
+
+pnglite_arena_t*
+pnglite_arena_new(size_t block_size)
+{
+    pnglite_arena_t *arena = malloc(sizeof(pnglite_arena_t));
+
+    if (!arena)
+        return NULL;
+
+    arena->block = NULL;
+    arena->used = arena->before = arena->peak = 0;
+    arena->block_size = block_size ? block_size : 64 * 1024;
+
+    return arena;
+}
+
+static void*
+png_arena_alloc(void* ctx, size_t size)
+{
+    pnglite_arena_t *arena = ctx;
+    png_arena_block_t *block = arena->block;
+    unsigned char *p;
+
+    size = PNG_ARENA_ROUND(size ? size : 1);
+
+    if (!block || block->size - arena->used < size) {
+        size_t block_size = arena->block_size > size ? arena->block_size : size;
+
+        block = malloc(PNG_ARENA_HEADER + block_size);
+        if (!block)
+            return NULL;
+        block->prev = arena->block;
+        block->size = block_size;
+        arena->before += arena->used;
+        arena->block = block;
+        arena->used = 0;
     }
-    if (png->interlace_method) {
-        result = png_deinterlace(png, data);
-    } else {
-        result = png_unfilter_unpack(png, data);
+
+    p = (unsigned char*)block + PNG_ARENA_HEADER + arena->used;
+    arena->used += size;
+    if (arena->before + arena->used > arena->peak)
+        arena->peak = arena->before + arena->used;
+
+    return p;
+}
+
+/* Only the latest allocation can be taken back. */
+static void
+png_arena_free(void* ctx, void* p, size_t size)
+{
+    pnglite_arena_t *arena = ctx;
+
+    size = PNG_ARENA_ROUND(size ? size : 1);
+
+    if (arena->block && arena->used >= size &&
+        (unsigned char*)p == (unsigned char*)arena->block + PNG_ARENA_HEADER + arena->used - size)
+        arena->used -= size;
+}
+
+pnglite_allocator_t
+pnglite_arena_allocator(pnglite_arena_t* arena)
+{
+    pnglite_allocator_t allocator;
+
+    allocator.alloc = png_arena_alloc;
+    allocator.free = png_arena_free;
+    allocator.ctx = arena;
+
+    return allocator;
+}
+
+/* Frees all the blocks. */
+static void
+png_arena_drop(pnglite_arena_t* arena)
+{
+    while (arena->block) {
+        png_arena_block_t *prev = arena->block->prev;
+
+        free(arena->block);
+        arena->block = prev;
     }
-    png->free(png->png_data);
-    return result;
 }
 
-int
-pnglite_write_image(pnglite_t* png, unsigned width, unsigned height, char depth,
-                        int color, int transparency, unsigned char* data)
+void
+pnglite_arena_reset(pnglite_arena_t* arena)
+{
+    if (arena->block && arena->block->prev) {
+        /* one block for next time, as big as all of them were */
+        png_arena_drop(arena);
+        if (arena->block_size < arena->peak)
+            arena->block_size = arena->peak;
+    }
+    arena->used = arena->before = arena->peak = 0;
+}
+
+void
+pnglite_arena_free(pnglite_arena_t* arena)
+{
+    if (!arena)
+        return;
+
+    png_arena_drop(arena);
+    free(arena);
+}
+
+/* Sets up header fields for writing and writes out everything up to image data. */
+static int
+png_write_header(pnglite_t* png, unsigned width, unsigned height, char depth,
+                 int color, int transparency)
 {
-    unsigned i;
     int err;
-    unsigned char *filtered;
 
     if (!png->write) { return PNG_WRONG_ARGUMENTS; }
 
@@ -1176,42 +4534,169 @@ pnglite_write_image(pnglite_t* png, unsigned width, unsigned height, char depth,
     png->interlace_method = 0;
     png->compression_method = 0;
 
-    int rv_pcp = png_check_png(png);
-    if (rv_pcp)
-        return rv_pcp;
-
-    filtered = png->alloc((png->pitch + 1) * height);
-    if (!filtered)
-        return PNG_MEMORY_ERROR;
+    if ((err = png_check_png(png)))
+        return err;
 
-    for(i = 0; i < png->height; i++) {
-        filtered[i * (png->pitch + 1)] = 0;
-        memcpy(filtered + i*(png->pitch + 1) + 1,
-                        data + i*png->pitch, png->pitch);
-    }
-    png_filter(png, filtered);
-    png_write_ihdr(png);
+    if ((err = png_write_ihdr(png)))
+        return err;
 
     if (png->color_type == PNG_INDEXED) {
-        if ((err = png_write_plte(png))) {
-            png->free(filtered);
+        if ((err = png_write_plte(png)))
             return err;
-        }
     }
 
     if (transparency) {
-        if ((err = png_write_trns(png))) {
-            png->free(filtered);
+        if ((err = png_write_trns(png)))
             return err;
-        }
     }
 
-    png_write_idats(png, filtered);
-    png->free(filtered);
+    return PNG_NO_ERROR;
+}
+
+/* bytes of the writer's window, see png_write_setup() */
+#define PNG_WRITE_WINDOW_SIZE(pitch) (8 + PNG_IDAT_SIZE + 4 + (size_t)(pitch) + 2 * ((size_t)(pitch) + 1))
+
+static void
+png_write_cleanup(pnglite_t* png)
+{
+    if (png->zs) {
+        deflateEnd(png->zs);
+        png_free(png, png->zs, sizeof(z_stream));
+        png->zs = NULL;
+    }
+    png_free(png, png->window, PNG_WRITE_WINDOW_SIZE(png->pitch));
+    png->window = NULL;
+}
+
+/*  The writer's window holds the IDAT being filled, the unfiltered
+    row above the one being written, and two rows to try filters on. */
+
+static int
+png_write_setup(pnglite_t* png)
+{
+    const unsigned pitch = png->pitch;
+    int result;
+
+    if ((result = png_write_filter_type(png)) < 0)
+        return result;
+
+    png->window = png_alloc(png, PNG_WRITE_WINDOW_SIZE(pitch));
+    if (!png->window)
+        return PNG_MEMORY_ERROR;
+
+    memcpy(png->window + 4, "IDAT", 4);
+    memset(png->window + 8 + PNG_IDAT_SIZE + 4, 0, pitch);
+
+    if ((result = png_init_deflate(png)) != PNG_NO_ERROR) {
+        png_write_cleanup(png);
+        return result;
+    }
+    ((z_stream *)png->zs)->next_out = png->window + 8;
+    ((z_stream *)png->zs)->avail_out = PNG_IDAT_SIZE;
+
+    png->next_row = 0;
+
+    return PNG_NO_ERROR;
+}
+
+int
+pnglite_write_begin(pnglite_t* png, unsigned width, unsigned height, char depth,
+                        int color, int transparency)
+{
+    int err;
+
+    if ((err = png_write_header(png, width, height, depth, color, transparency)))
+        return err;
+
+    return png_write_setup(png);
+}
+
+int
+pnglite_write_rows(pnglite_t* png, const unsigned char* rows, unsigned nrows)
+{
+    const unsigned pitch = png->pitch;
+    const int filter_type = png_write_filter_type(png);
+    unsigned char *up, *trial, *filtered;
+    unsigned i;
+    int err;
+
+    if (!png->window || !png->zs)
+        return PNG_WRONG_ARGUMENTS;
+
+    if (nrows > png->height - png->next_row) {
+        png_write_cleanup(png);
+        return PNG_WRONG_ARGUMENTS;
+    }
+
+    up = png->window + 8 + PNG_IDAT_SIZE + 4;
+    trial = up + pitch;
+
+    for (i = 0; i < nrows; i++) {
+        const unsigned char *row = rows + (size_t)i * pitch;
+
+        filtered = png_filter_scanline(png, filter_type, row, up, trial);
+        memcpy(up, row, pitch);
+
+        if ((err = png_deflate_data(png, filtered, pitch + 1, Z_NO_FLUSH)) != PNG_NO_ERROR) {
+            png_write_cleanup(png);
+            return err;
+        }
+        png->next_row += 1;
+    }
 
     return PNG_NO_ERROR;
 }
 
+int
+pnglite_write_end(pnglite_t* png)
+{
+    int err;
+
+    if (!png->window || !png->zs)
+        return PNG_WRONG_ARGUMENTS;
+
+    if (png->next_row != png->height)
+        err = PNG_WRONG_ARGUMENTS;
+    else if ((err = png_deflate_data(png, NULL, 0, Z_FINISH)) == PNG_NO_ERROR)
+        err = png_write_iend(png);
+
+    png_write_cleanup(png);
+
+    return err;
+}
+
+int
+pnglite_write_image(pnglite_t* png, unsigned width, unsigned height, char depth,
+                        int color, int transparency, unsigned char* data)
+{
+    int err;
+
+    if ((err = png_write_header(png, width, height, depth, color, transparency)))
+        return err;
+
+#ifdef PNG_THREADS
+    if (png->threads > 1 && (size_t)height * (png->pitch + 1) > PNG_STRIP_SIZE) {
+        unsigned char *filtered = png_alloc(png, (size_t)(png->pitch + 1) * height);
+
+        if (!filtered)
+            return PNG_MEMORY_ERROR;
+        if ((err = png_filter(png, filtered, data)) == PNG_NO_ERROR)
+            err = png_write_idats_parallel(png, filtered);
+        png_free(png, filtered, (size_t)(png->pitch + 1) * height);
+
+        return err;
+    }
+#endif
+
+    if ((err = png_write_setup(png)))
+        return err;
+
+    if ((err = pnglite_write_rows(png, data, height)))
+        return err;
+
+    return pnglite_write_end(png);
+}
+
 const char* pnglite_error_string(int error)
 {
     switch(error) {
@@ -1235,6 +4720,10 @@ const char* pnglite_error_string(int error)
         return "Unknown filter method used in scanline.";
     case PNG_DONE:
         return "PNG done";
+    case PNG_NEED_MORE:
+        return "More input is needed.";
+    case PNG_ROWS_READY:
+        return "Image rows can be read.";
     case PNG_NOT_SUPPORTED_16:
         return "16 bits per channel PNGs are not supported.";
     case PNG_TRNS_WRONG_COLORTYPE:
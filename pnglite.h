@@ -39,6 +39,8 @@ extern "C" {
     Negative numbers are error codes and 0 and up are okay responses. */
 enum
 {
+    PNG_ROWS_READY          =  3,
+    PNG_NEED_MORE           =  2,
     PNG_DONE                =  1,
     PNG_NO_ERROR            =  0,
     PNG_FILE_ERROR          = -1,
@@ -72,7 +74,20 @@ enum {
     PNG_FILTER_SUB          = 1,
     PNG_FILTER_UP           = 2,
     PNG_FILTER_AVERAGE      = 3,
-    PNG_FILTER_PAETH        = 4
+    PNG_FILTER_PAETH        = 4,
+    PNG_FILTER_ADAPTIVE     = 5     /* encoder picks one per row */
+};
+
+/*  Layouts images can be decoded to, see pnglite_t::out_format. All but the
+    first are 8-bit RGBA in the byte order named, whatever the color type
+    of the image: grey is copied to R, G and B, palette entries looked up,
+    tRNS made into alpha and alpha set to 255 where there's none. */
+enum {
+    PNG_FORMAT_AS_IS        = 0,    /* pixels as stored, sub-byte ones unpacked */
+    PNG_FORMAT_RGBA         = 1,
+    PNG_FORMAT_BGRA         = 2,
+    PNG_FORMAT_ARGB         = 3,
+    PNG_FORMAT_ABGR         = 4
 };
 
 /* Typedefs for callbacks. */
@@ -80,6 +95,27 @@ typedef size_t (*pnglite_read_callback_t)(void* output, size_t size, size_t nume
 typedef size_t (*pnglite_write_callback_t)(void* input, size_t size, size_t numel, void* user_pointer);
 typedef void * (*pnglite_alloc_t)(size_t s);
 typedef void   (*pnglite_free_t)(void* p);
+typedef void * (*pnglite_ctx_alloc_t)(void* ctx, size_t s);
+typedef void   (*pnglite_ctx_free_t)(void* ctx, void* p, size_t s);
+typedef int    (*pnglite_row_callback_t)(const unsigned char* row, unsigned y, void* user_pointer);
+typedef int    (*pnglite_preview_callback_t)(const unsigned char* image, unsigned pass, void* user_pointer);
+
+/*  Allocator with a context, in png_t::allocator. free gets the size that
+    was asked for and may be 0, for arenas that release everything at once. */
+typedef struct {
+    pnglite_ctx_alloc_t     alloc;
+    pnglite_ctx_free_t      free;
+    void*                   ctx;
+} pnglite_allocator_t;
+
+/* Bump allocator, see pnglite_arena_new(). */
+typedef struct pnglite_arena pnglite_arena_t;
+
+/* Inflate checkpoints for pnglite_read_rows_indexed(), see pnglite_index_build(). */
+typedef struct pnglite_index pnglite_index_t;
+
+/* Inflate state and buffers reused across images, see pnglite_decoder_new(). */
+typedef struct pnglite_decoder pnglite_decoder_t;
 
 typedef struct {
     void*                   zs;             /* pointer to z_stream */
@@ -90,12 +126,36 @@ typedef struct {
     pnglite_write_callback_t    write;
     pnglite_alloc_t             alloc;
     pnglite_free_t              free;
+    pnglite_allocator_t         allocator;  /* used instead of the above if its alloc is set, set before reading or writing */
     size_t                  chunk_size_limit;
     size_t                  image_data_limit;
     void*                   user_pointer;
 
-    unsigned char*          png_data;
-    unsigned                png_datalen;
+    unsigned char*          in;             /* input buffer */
+    size_t                  in_size;        /* allocated size of the above */
+    size_t                  in_len;         /* bytes in it */
+    size_t                  in_pos;         /* bytes of it parsed */
+    size_t                  skip;           /* bytes of an ignored chunk yet to be skipped */
+    size_t                  read_pos;       /* bytes taken from the read callback */
+    size_t                  read_ahead;     /* bytes to read at least whenever input runs out, 0 = exactly what's needed */
+    unsigned                chunk_length;   /* of the IDAT being inflated */
+    unsigned                idat_crc;       /* its CRC so far */
+    unsigned                idat_unchecked; /* bytes at its end the above doesn't cover yet */
+    unsigned char           state;          /* parser state */
+    unsigned char           push;           /* input comes from pnglite_push() */
+    unsigned char           mem;            /* input is the pnglite_init_mem() buffer */
+    unsigned char           idat_seen;
+    unsigned char           decoded;        /* all scanlines are reconstructed */
+    unsigned char           simd;           /* SIMD extensions found at run time */
+    unsigned char*          window;         /* two-scanline unfilter window */
+    unsigned char*          scanline;       /* scanline being reconstructed, filter type first */
+    unsigned char*          prev_scanline;  /* the one above it */
+    unsigned char*          unpacked;       /* sub-byte pixels of a scanline, unpacked, or converted pixels */
+    unsigned char*          lut;            /* out_format pixel for each palette index or grey level */
+    unsigned char*          unpack_lut;     /* sub-byte pixels of each byte value, 8 bytes apiece */
+    unsigned char*          image;          /* whole decoded image when handing out rows of an interlaced one */
+    pnglite_index_t*        index;          /* checkpoints being recorded by pnglite_index_build() */
+    pnglite_decoder_t*      decoder;        /* to borrow inflate state and buffers from, set before reading */
 
     unsigned char           palette[4*256];
     unsigned char           colorkey[6];
@@ -109,8 +169,21 @@ typedef struct {
     unsigned char           compression_method;
     unsigned char           filter_method;
     unsigned char           interlace_method;
+    unsigned char           write_filter;   /* filter type pnglite_write_image() uses, PNG_FILTER_ADAPTIVE by default */
+    unsigned                threads;        /* threads to deflate or deinterlace with, 0 = just the caller's */
+    unsigned char           out_format;     /* PNG_FORMAT_* pixels are decoded to, set before reading */
+    unsigned char           premultiply;    /* multiply colors by alpha as they're decoded, set before reading */
+    unsigned char           scale_grey;     /* sub-byte grey levels come out scaled to 0..255, set before reading */
     unsigned char           stride;
     unsigned                pitch;
+
+    unsigned                pass;           /* Adam7 pass being decoded, 0..6 */
+    unsigned                pass_width;
+    unsigned                pass_height;
+    unsigned                pass_pitch;
+    unsigned                pass_row;       /* scanlines of the pass decoded so far */
+    unsigned                scanline_fill;  /* bytes of the next scanline inflated so far */
+    unsigned                next_row;       /* image rows handed out so far */
 } pnglite_t;
 
 /**
@@ -135,6 +208,97 @@ int pnglite_init(pnglite_t *png, void* user_pointer,
              pnglite_alloc_t pngalloc, pnglite_free_t pngfree,
              size_t chunk_size_limit, size_t image_data_limit);
 
+/**
+ * Initializes a png_t object for decoding input supplied with pnglite_push().
+ *
+ * Parameters are the same as for pnglite_init().
+ *
+ * @return PNG_NO_ERROR.
+ */
+int pnglite_init_push(pnglite_t *png, pnglite_alloc_t pngalloc, pnglite_free_t pngfree,
+                  size_t chunk_size_limit, size_t image_data_limit);
+
+/**
+ * Initializes a png_t object for decoding a PNG file that is all in memory.
+ *
+ * Chunks are parsed, CRC checked and inflated right where they are,
+ * without copying any of the file. The buffer must stay valid until
+ * reading is done.
+ *
+ * @param png the png_t object
+ * @param buf the PNG file
+ * @param len its length
+ *
+ * The rest of the parameters are the same as for pnglite_init().
+ *
+ * @return PNG_NO_ERROR.
+ */
+int pnglite_init_mem(pnglite_t *png, const void* buf, size_t len, pnglite_alloc_t pngalloc,
+                 pnglite_free_t pngfree, size_t chunk_size_limit, size_t image_data_limit);
+
+/**
+ * Creates a decoder context to read a series of images with.
+ *
+ * Set png_t::decoder to it after initializing each png_t object. Reading
+ * then takes the inflate state and the input, unfilter and deinterlace
+ * buffers from the context and hands them back when done, so once the
+ * largest image has been read no more memory is allocated. A context
+ * may serve one image at a time.
+ *
+ * @param pngalloc allocation routine for it and its buffers, 0 = malloc
+ * @param pngfree free routine, 0 = free
+ *
+ * @return the context, or NULL if out of memory.
+ */
+pnglite_decoder_t* pnglite_decoder_new(pnglite_alloc_t pngalloc, pnglite_free_t pngfree);
+
+/**
+ * Frees a decoder context and everything it holds. No image may be
+ * being read with it.
+ *
+ * @param decoder the context; may be NULL
+ */
+void pnglite_decoder_free(pnglite_decoder_t* decoder);
+
+/**
+ * Creates a bump arena to serve the allocations of reading or writing
+ * an image. Memory is taken from malloc a block at a time and handed out
+ * in order; freeing gives back only the latest allocation, the rest stays
+ * until pnglite_arena_reset(). An arena may not be used from several
+ * threads at once, so png_t::threads has to be 1 or less with it.
+ *
+ * @param block_size bytes to take from malloc at a time, 0 = 64K
+ *
+ * @return the arena, or NULL if out of memory.
+ */
+pnglite_arena_t* pnglite_arena_new(size_t block_size);
+
+/**
+ * An allocator for png_t::allocator that allocates from an arena.
+ *
+ * @param arena the arena
+ *
+ * @return the allocator.
+ */
+pnglite_allocator_t pnglite_arena_allocator(pnglite_arena_t* arena);
+
+/**
+ * Releases everything allocated from an arena in one go, typically after
+ * pnglite_read_image() or pnglite_write_image() returned. If it took more
+ * than one block, they are replaced with a single one big enough for all,
+ * so reading or writing the same sizes again doesn't call malloc.
+ *
+ * @param arena the arena
+ */
+void pnglite_arena_reset(pnglite_arena_t* arena);
+
+/**
+ * Frees an arena and all its memory.
+ *
+ * @param arena the arena; may be NULL
+ */
+void pnglite_arena_free(pnglite_arena_t* arena);
+
 /**
  * Reads and checks a header from the stream.
  *
@@ -147,6 +311,22 @@ int pnglite_read_header(pnglite_t* png);
  * Writes decoded image data into given buffer.
  *
  * @param png the png_t object
+ * If png_t::threads is over 1, the passes of an interlaced image are
+ * inflated into a temporary buffer of about the image size, then unfiltered
+ * and deinterlaced concurrently, up to one thread per pass.
+ *
+ * If png_t::out_format is set, pixels are converted to that layout as
+ * each scanline is reconstructed and are 4 bytes each; so are those of
+ * all the other read functions, save for pnglite_read_image_scaled()
+ * and pnglite_read_region(), which don't convert. 16-bit images can't be
+ * converted.
+ *
+ * If png_t::premultiply is set, colors of pixels with alpha come out
+ * multiplied by it, rounded: RGBA and greyscale+alpha pixels, and with
+ * png_t::out_format set also palette entries and tRNS keys. Same as
+ * out_format, it's for images of up to 8 bits and all read functions
+ * but those two.
+ *
  * @param data the output buffer,
  *    not less than width*height*(bytes per pixel) bytes.
  *
@@ -154,9 +334,230 @@ int pnglite_read_header(pnglite_t* png);
  */
 int pnglite_read_image(pnglite_t* png, unsigned char* data);
 
+/**
+ * Same as pnglite_read_image(), but with rows pitch bytes apart in the
+ * output buffer, so they can go straight into a padded surface.
+ *
+ * @param png the png_t object
+ * @param data the output buffer, not less than
+ *    (height-1)*pitch + width*(bytes per pixel) bytes.
+ * @param pitch bytes from the start of one row to that of the next,
+ *    not less than width*(bytes per pixel)
+ *
+ * @return PNG_NO_ERROR on success, PNG_WRONG_ARGUMENTS if the pitch is
+ *    too small, otherwise an error code.
+ */
+int pnglite_read_image_pitch(pnglite_t* png, unsigned char* data, size_t pitch);
+
+/**
+ * Same as pnglite_read_image(), but for interlaced images a preview is
+ * made in the output buffer after Adam7 passes 1, 3 and 5 are decoded:
+ * each 8x8, 4x4 or 2x2 block is filled with the one pixel known in it.
+ *
+ * @param png the png_t object
+ * @param data the output buffer,
+ *    not less than width*height*(bytes per pixel) bytes.
+ * @param preview called with the output buffer and the number of the pass
+ *    just done (1, 3 or 5). Returning non-zero stops decoding there,
+ *    leaving the preview in the buffer; nothing more gets inflated.
+ * @param user_pointer passed to the callback
+ *
+ * @return PNG_NO_ERROR on success, whatever the callback returned if it
+ *    stopped decoding, otherwise an error code.
+ */
+int pnglite_read_image_progressive(pnglite_t* png, unsigned char* data,
+                                   pnglite_preview_callback_t preview, void* user_pointer);
+
+/**
+ * Decodes the image scaled down by 2, 4 or 8 in both dimensions,
+ * without ever holding it in full.
+ *
+ * Each block of pixels of non-interlaced images is averaged, save for
+ * indexed color ones, where the top left pixel of the block is taken.
+ * Interlaced images always get the top left pixel, since that's all
+ * Adam7 passes 1, 3 or 5 and those before them have; the rest of the
+ * image data is not even inflated.
+ *
+ * @param png the png_t object
+ * @param data the output buffer, not less than
+ *    ((width + (1<<shift) - 1) >> shift) * ((height + (1<<shift) - 1) >> shift)
+ *    * (bytes per pixel) bytes.
+ * @param shift 1, 2 or 3 for 1/2, 1/4 or 1/8 scale, 0 is pnglite_read_image().
+ *
+ * @return PNG_NO_ERROR on success, PNG_WRONG_ARGUMENTS if png_t::out_format
+ *    or png_t::premultiply is set, otherwise an error code.
+ */
+int pnglite_read_image_scaled(pnglite_t* png, unsigned char* data, unsigned shift);
+
+/**
+ * Decodes a rectangular part of the image.
+ *
+ * Rows above the region are still inflated and reconstructed, but only
+ * as far right as the region reaches, and nothing below the region is
+ * even inflated (save for earlier Adam7 passes of interlaced images),
+ * so the rest of the stream is not checked.
+ *
+ * @param png the png_t object
+ * @param x left column of the region
+ * @param y top row of the region
+ * @param w region width
+ * @param h region height
+ * @param out the output buffer, not less than w*h*(bytes per pixel) bytes.
+ *
+ * @return PNG_NO_ERROR on success, PNG_WRONG_ARGUMENTS if the region is
+ *    empty or not within the image or png_t::out_format or
+ *    png_t::premultiply is set, otherwise an error code.
+ */
+int pnglite_read_region(pnglite_t* png, unsigned x, unsigned y, unsigned w, unsigned h, unsigned char* out);
+
+/**
+ * Decodes the image, recording checkpoints to restart inflate from.
+ *
+ * A checkpoint is taken at the first deflate block boundary at least
+ * strip_rows scanlines past the previous one, and holds the 32K inflate
+ * window, the bit position within the stream and the scanline above,
+ * so a later pnglite_read_rows_indexed() only needs to inflate from the
+ * nearest checkpoint. Interlaced images can't be indexed.
+ *
+ * @param png the png_t object, with header read
+ * @param data the output buffer as for pnglite_read_image(), or NULL
+ *    to only build the index.
+ * @param strip_rows scanlines between checkpoints, at least
+ * @param index set to the new index, to be freed with pnglite_index_free()
+ *
+ * @return PNG_NO_ERROR on success, PNG_WRONG_ARGUMENTS if the image is
+ *    interlaced or strip_rows is 0, otherwise an error code.
+ */
+int pnglite_index_build(pnglite_t* png, unsigned char* data, unsigned strip_rows, pnglite_index_t** index);
+
+/**
+ * Decodes some rows of the image, starting at the nearest checkpoint.
+ *
+ * The stream is skipped forward to the checkpoint with the read callback,
+ * so it must be at the start of the same PNG file the index was built from,
+ * with only the header read. The IDAT chunk the checkpoint is in has its
+ * CRC left unchecked. Like the other read functions, this can be done once
+ * per png_t; for more rows, rewind the stream and start over.
+ *
+ * @param png the png_t object, with header read
+ * @param index from pnglite_index_build() or pnglite_index_load()
+ * @param first_row first row to decode
+ * @param nrows how many rows to decode
+ * @param out the output buffer, not less than nrows*width*(bytes per pixel) bytes.
+ *
+ * @return PNG_NO_ERROR on success, PNG_WRONG_ARGUMENTS if the rows are not
+ *    within the image or the index is for another one, otherwise an error code.
+ */
+int pnglite_read_rows_indexed(pnglite_t* png, const pnglite_index_t* index,
+                              unsigned first_row, unsigned nrows, unsigned char* out);
+
+/**
+ * Writes an index out as a sidecar, its checkpoints deflated.
+ *
+ * @param png the png_t object, for its allocator
+ * @param index the index
+ * @param write_fun write callback for the sidecar
+ * @param user_pointer passed to the callback
+ *
+ * @return PNG_NO_ERROR on success, otherwise an error code.
+ */
+int pnglite_index_save(pnglite_t* png, const pnglite_index_t* index,
+                       pnglite_write_callback_t write_fun, void* user_pointer);
+
+/**
+ * Reads an index back from a sidecar written by pnglite_index_save().
+ *
+ * @param png the png_t object of the image, with header read
+ * @param read_fun read callback for the sidecar
+ * @param user_pointer passed to the callback
+ * @param index set to the index, to be freed with pnglite_index_free()
+ *
+ * @return PNG_NO_ERROR on success, PNG_WRONG_ARGUMENTS if the index is
+ *    for another image, PNG_CORRUPTED if it is not valid,
+ *    otherwise an error code.
+ */
+int pnglite_index_load(pnglite_t* png, pnglite_read_callback_t read_fun, void* user_pointer,
+                       pnglite_index_t** index);
+
+/**
+ * Frees an index.
+ *
+ * @param index the index, may be NULL
+ */
+void pnglite_index_free(pnglite_index_t* index);
+
+/**
+ * Reads the next few rows of decoded image data into given buffer.
+ *
+ * Rows of non-interlaced images are handed out as soon as they are
+ * reconstructed. Interlaced images are decoded whole on the first call,
+ * since none of their rows is final before the last pass is.
+ *
+ * @param png the png_t object, with header read
+ * @param buf the output buffer,
+ *    not less than nrows*width*(bytes per pixel) bytes.
+ * @param nrows how many rows to read at most
+ *
+ * @return number of rows read, 0 once all of them have been read
+ *    (or, in push mode, until more input is pushed),
+ *    or a (negative) error code.
+ */
+int pnglite_read_next_rows(pnglite_t* png, unsigned char* buf, unsigned nrows);
+
+/**
+ * Decodes image data, passing each row to the callback as soon as it is ready.
+ *
+ * Same as pnglite_read_next_rows(), but rows are not copied anywhere: the row
+ * pointer is only valid for the duration of the callback call.
+ *
+ * @param png the png_t object, with header read
+ * @param callback called with each row and its number, top to bottom.
+ *    Returning non-zero stops decoding.
+ * @param user_pointer passed to the callback
+ *
+ * @return PNG_NO_ERROR on success, whatever the callback returned if it
+ *    stopped decoding, otherwise an error code.
+ */
+int pnglite_read_rows(pnglite_t* png, pnglite_row_callback_t callback, void* user_pointer);
+
+/**
+ * Feeds the decoder with whatever bytes of the PNG stream have arrived.
+ *
+ * The bytes are always taken in whole; they are buffered until a complete
+ * chunk is there. Header fields are valid once anything but PNG_NEED_MORE
+ * or an error is returned. On PNG_ROWS_READY, call pnglite_read_next_rows()
+ * or pnglite_read_rows() until no more rows come out, then push again,
+ * with no new bytes if need be.
+ *
+ * @param png the png_t object, initialized with pnglite_init_push()
+ * @param bytes next part of the stream
+ * @param len its length; may be 0
+ *
+ * @return PNG_NEED_MORE if all input has been parsed,
+ *    PNG_ROWS_READY if there's image data to decode,
+ *    PNG_DONE once IEND is reached and all rows were read,
+ *    otherwise an error code.
+ */
+int pnglite_push(pnglite_t* png, const void* bytes, size_t len);
+
+/**
+ * Frees whatever the decoder holds if reading an image is abandoned
+ * before pnglite_read_next_rows() returned 0 or pnglite_push() PNG_DONE,
+ * or right after the header with png_t::read_ahead set.
+ *
+ * @param png the png_t object
+ */
+void pnglite_read_abort(pnglite_t* png);
+
 /**
  * Writes out given image data.
  *
+ * Same as pnglite_write_begin(), pnglite_write_rows() for all rows and
+ * pnglite_write_end(). Rows are filtered according to png_t::write_filter.
+ * If png_t::threads is over 1, large images are deflated in strips by that
+ * many threads instead, each strip written as an IDAT of its own;
+ * the allocator must be thread-safe then.
+ *
  * @param width
  * @param height
  * @param depth
@@ -168,6 +569,49 @@ int pnglite_read_image(pnglite_t* png, unsigned char* data);
  */
 int pnglite_write_image(pnglite_t* png, unsigned width, unsigned height, char depth, int color, int transparency, unsigned char* data);
 
+/**
+ * Starts writing an image a few rows at a time.
+ *
+ * Writes out the header; image data is then filtered, deflated and written
+ * out in IDAT chunks of at most 64K as rows are given to pnglite_write_rows(),
+ * so besides the deflate state only a few rows worth of memory is needed.
+ *
+ * @param png the png_t object set for writing
+ * @param width
+ * @param height
+ * @param depth
+ * @param color
+ * @param transparency
+ *
+ * @return PNG_NO_ERROR on success, otherwise an error code.
+ */
+int pnglite_write_begin(pnglite_t* png, unsigned width, unsigned height, char depth, int color, int transparency);
+
+/**
+ * Writes out the next few rows of image data.
+ *
+ * @param png the png_t object, with pnglite_write_begin() done
+ * @param rows the rows, width*(bytes per pixel) bytes each, top to bottom
+ * @param nrows how many rows there are
+ *
+ * @return PNG_NO_ERROR on success, otherwise an error code;
+ *    writing can't be continued after an error.
+ */
+int pnglite_write_rows(pnglite_t* png, const unsigned char* rows, unsigned nrows);
+
+/**
+ * Finishes writing the image once all of its rows were written.
+ *
+ * Also frees whatever pnglite_write_begin() allocated, so it should be called
+ * to abandon writing too.
+ *
+ * @param png the png_t object
+ *
+ * @return PNG_NO_ERROR on success, PNG_WRONG_ARGUMENTS if rows are missing,
+ *    otherwise an error code.
+ */
+int pnglite_write_end(pnglite_t* png);
+
 /**
  * Returns a string representation of an error code
  *
@@ -1,8 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "SDL.h"
 #include "SDL_pnglite.h"
 #include "SDL_image.h"
+#include "pnglite.h"
 
 #if defined(_WIN32)
 # include <stdlib.h>
@@ -167,6 +169,90 @@ done:
     return rv;
 }
 
+/*  Loads through SDL_RWops, which SDL_LoadPNG() only falls back to when it
+    can't mmap() the file, and compares with ref if there's one. Then with
+    freesrc=0 from a memory stream with junk in front: a good load has to
+    match too, a failed one on the file cut in half has to seek back. */
+int test_load_rw(const char *fname, SDL_Surface *ref, int loud) {
+    SDL_Surface *rw_surf = NULL;
+    SDL_RWops *rwo = NULL;
+    Uint8 *buf = NULL;
+    const int junk = 7;
+    Sint64 sz = -1, pos;
+    int rv = 0, cut;
+
+    if (loud) {
+        fprintf(stderr, "SDL_LoadPNG_RW():\n");
+    }
+    rw_surf = SDL_LoadPNG_RW(SDL_RWFromFile(fname, "rb"), 1);
+    if (NULL == rw_surf) {
+        if (loud || ref) {
+            fprintf(stderr, "SDL_LoadPNG_RW(%s): %s\n", fname, SDL_GetError());
+        }
+        rv += 1;
+    } else {
+        if (ref) {
+            rv += compare_surfaces(fname, ref, rw_surf, loud);
+        }
+        SDL_FreeSurface(rw_surf);
+        rw_surf = NULL;
+    }
+
+    if (NULL != (rwo = SDL_RWFromFile(fname, "rb"))) {
+        sz = SDL_RWsize(rwo);
+        if (sz > 0 && NULL != (buf = SDL_malloc(junk + sz))) {
+            SDL_memset(buf, 'x', junk);
+            if (1 != SDL_RWread(rwo, buf + junk, (size_t)sz, 1))
+                sz = -1;
+        }
+        SDL_RWclose(rwo);
+        rwo = NULL;
+    }
+    if (NULL == buf || sz <= 0) {
+        fprintf(stderr, "test_load_rw(%s): can't read the file: %s\n", fname, SDL_GetError());
+        rv += 1;
+        goto exit;
+    }
+
+    for (cut = 0; cut < 2; cut++) {
+        rwo = SDL_RWFromConstMem(buf, junk + (cut ? (int)sz / 2 : (int)sz));
+        if (NULL == rwo) {
+            fprintf(stderr, "SDL_RWFromConstMem(): %s\n", SDL_GetError());
+            rv += 1;
+            goto exit;
+        }
+        SDL_RWseek(rwo, junk, RW_SEEK_SET);
+        rw_surf = SDL_LoadPNG_RW(rwo, 0);
+        if (rw_surf) {
+            if (cut) {
+                fprintf(stderr, "test_load_rw(%s): loaded a file cut to %d bytes\n", fname, (int)sz / 2);
+                rv += 1;
+            } else if (ref) {
+                rv += compare_surfaces(fname, ref, rw_surf, loud);
+            }
+            SDL_FreeSurface(rw_surf);
+            rw_surf = NULL;
+        } else {
+            pos = SDL_RWtell(rwo);
+            if (pos != junk) {
+                fprintf(stderr, "test_load_rw(%s): failed load left the stream at %d, not %d\n",
+                        fname, (int)pos, junk);
+                rv += 1;
+            }
+            if (!cut && ref) {
+                fprintf(stderr, "SDL_LoadPNG_RW(%s, 0): %s\n", fname, SDL_GetError());
+                rv += 1;
+            }
+        }
+        SDL_RWclose(rwo);
+        rwo = NULL;
+    }
+
+  exit:
+    if (buf) { SDL_free(buf); }
+    return rv;
+}
+
 int test_load(const char *fname, int expected_ok, int loud, int no_si) {
     SDL_Surface *si_surf = NULL, *spl_surf = NULL;
     int rv = 0;
@@ -201,6 +287,7 @@ int test_load(const char *fname, int expected_ok, int loud, int no_si) {
             rv += compare_surfaces(fname, si_surf, spl_surf ,loud);
         }
     }
+    rv += test_load_rw(fname, si_surf ? si_surf : spl_surf, loud);
     if (si_surf) { SDL_FreeSurface(si_surf); }
     if (spl_surf) { SDL_FreeSurface(spl_surf); }
     return expected_ok ? rv : 0;
@@ -267,8 +354,1841 @@ int test_save(const char *fname, int expected_ok, int loud) {
     return expected_ok ? rv : 0;
 }
 
+/*  SDL_LoadPNG_RW_Format() for each format pnglite decodes to directly,
+    and one it doesn't, against SDL converting what SDL_LoadPNG_RW() gives.
+    Pixels are compared as colors, SDL has no say in what goes to the
+    unused byte of the X formats, which has to be 255. */
+static const Uint32 load_formats[] = {
+    SDL_PIXELFORMAT_RGBA8888, SDL_PIXELFORMAT_ARGB8888,
+    SDL_PIXELFORMAT_BGRA8888, SDL_PIXELFORMAT_ABGR8888,
+    SDL_PIXELFORMAT_RGBX8888, SDL_PIXELFORMAT_RGB888,
+    SDL_PIXELFORMAT_BGRX8888, SDL_PIXELFORMAT_BGR888,
+    SDL_PIXELFORMAT_RGB565
+};
+
+Uint32 get_pixel(const SDL_Surface *surf, int x, int y) {
+    const Uint8 *p = (const Uint8 *)surf->pixels + y * surf->pitch + x * surf->format->BytesPerPixel;
+    if (surf->format->BytesPerPixel == 2)
+        return *(const Uint16 *)p;
+    return *(const Uint32 *)p;
+}
+
+int test_load_format(const char *fname, int expected_ok, int loud) {
+    SDL_Surface *spl_surf = NULL, *want = NULL, *got = NULL;
+    Uint32 format, unused, wp, gp;
+    Uint8 wc[4], gc[4];
+    size_t f;
+    int rv = 0, x, y, fails;
+
+    spl_surf = SDL_LoadPNG_RW(SDL_RWFromFile(fname, "rb"), 1);
+    if (NULL == spl_surf) {
+        if (loud) {
+            fprintf(stderr, "SDL_LoadPNG_RW(%s): %s\n", fname, SDL_GetError());
+        }
+        return expected_ok ? 1 : 0;
+    }
+    for (f = 0; f < sizeof(load_formats) / sizeof(load_formats[0]); f++) {
+        format = load_formats[f];
+        if (loud) {
+            fprintf(stderr, "SDL_LoadPNG_RW_Format(%s):\n", SDL_GetPixelFormatName(format));
+        }
+        want = SDL_ConvertSurfaceFormat(spl_surf, format, 0);
+        if (NULL == want) {
+            fprintf(stderr, "SDL_ConvertSurfaceFormat(%s, %s): %s\n", fname,
+                    SDL_GetPixelFormatName(format), SDL_GetError());
+            rv += 1;
+            continue;
+        }
+        got = SDL_LoadPNG_RW_Format(SDL_RWFromFile(fname, "rb"), 1, format);
+        if (NULL == got) {
+            fprintf(stderr, "SDL_LoadPNG_RW_Format(%s, %s): %s\n", fname,
+                    SDL_GetPixelFormatName(format), SDL_GetError());
+            rv += 1;
+            goto next;
+        }
+        if (got->format->format != format || got->w != want->w || got->h != want->h) {
+            fprintf(stderr, "test_load_format(%s): got %s %dx%d, want %s %dx%d\n", fname,
+                    SDL_GetPixelFormatName(got->format->format), got->w, got->h,
+                    SDL_GetPixelFormatName(format), want->w, want->h);
+            rv += 1;
+            goto next;
+        }
+        unused = 0;
+        if (got->format->BytesPerPixel == 4 && got->format->Amask == 0)
+            unused = ~(got->format->Rmask | got->format->Gmask | got->format->Bmask);
+        fails = 0;
+        for (y = 0; y < got->h; y++) {
+            for (x = 0; x < got->w; x++) {
+                wp = get_pixel(want, x, y);
+                gp = get_pixel(got, x, y);
+                SDL_GetRGBA(wp, want->format, &wc[0], &wc[1], &wc[2], &wc[3]);
+                SDL_GetRGBA(gp, got->format, &gc[0], &gc[1], &gc[2], &gc[3]);
+                if (memcmp(wc, gc, 4) || (gp & unused) != unused) {
+                    if (fails == 0) {
+                        fprintf(stderr, "test_load_format(%s): %s (%d,%d) is %08x, want %08x\n", fname,
+                                SDL_GetPixelFormatName(format), x, y, (unsigned)gp, (unsigned)wp);
+                    }
+                    fails += 1;
+                }
+            }
+        }
+        if (fails) {
+            fprintf(stderr, "test_load_format(%s): %s pixel data mismatch (%d pixels)\n", fname,
+                    SDL_GetPixelFormatName(format), fails);
+            rv += 1;
+        }
+      next:
+        if (got) { SDL_FreeSurface(got); got = NULL; }
+        SDL_FreeSurface(want);
+    }
+    SDL_FreeSurface(spl_surf);
+    return expected_ok ? rv : 0;
+}
+
+/*  SDL_LoadPNG_RW_Premultiplied() against SDL_LoadPNG_RW(): the palette
+    of indexed surfaces and the pixels of RGBA ones have to be multiplied
+    by alpha, rounded. RGBA ones are then saved with
+    SDL_SavePNG_RW_Premultiplied() and read back with IMG_LoadPNG_RW(),
+    which has to give c * 255 / a of the premultiplied colors, rounded,
+    so within 255 / 2a + 1/2 of the straight ones, and black where alpha
+    is zero whatever the color there. */
+int test_premultiplied(const char *fname, int expected_ok, int loud) {
+    SDL_Surface *spl_surf = NULL, *pm_surf = NULL, *si_surf = NULL, *converted;
+    SDL_Color *sc, *pc;
+    SDL_RWops *rwo = NULL;
+    void *rwo_buf = NULL;
+    int rwo_buf_sz;
+    const Uint8 *s, *p, *o;
+    unsigned want;
+    int rv = 0, i, x, y, c, a, fails = 0;
+
+    spl_surf = SDL_LoadPNG_RW(SDL_RWFromFile(fname, "rb"), 1);
+    pm_surf = SDL_LoadPNG_RW_Premultiplied(SDL_RWFromFile(fname, "rb"), 1, 0);
+    if (NULL == spl_surf || NULL == pm_surf) {
+        if (loud || (spl_surf && expected_ok)) {
+            fprintf(stderr, "SDL_LoadPNG_RW_Premultiplied(%s): %s\n", fname, SDL_GetError());
+        }
+        rv = 1;
+        goto exit;
+    }
+    if (pm_surf->format->format != spl_surf->format->format) {
+        fprintf(stderr, "test_premultiplied(%s): pixel format %s, not %s\n", fname,
+                SDL_GetPixelFormatName(pm_surf->format->format),
+                SDL_GetPixelFormatName(spl_surf->format->format));
+        rv = 1;
+        goto exit;
+    }
+
+    if (spl_surf->format->palette) {
+        if (loud) {
+            fprintf(stderr, "premultiplied palette:\n");
+        }
+        if (pm_surf->format->palette->ncolors != spl_surf->format->palette->ncolors) {
+            fprintf(stderr, "test_premultiplied(%s): palette ncolors %d, not %d\n", fname,
+                    pm_surf->format->palette->ncolors, spl_surf->format->palette->ncolors);
+            rv = 1;
+            goto exit;
+        }
+        for (i = 0; i < spl_surf->format->palette->ncolors; i++) {
+            sc = &spl_surf->format->palette->colors[i];
+            pc = &pm_surf->format->palette->colors[i];
+            if (pc->a != sc->a || pc->r != (sc->r * sc->a + 127) / 255
+                    || pc->g != (sc->g * sc->a + 127) / 255 || pc->b != (sc->b * sc->a + 127) / 255) {
+                fprintf(stderr, "test_premultiplied(%s): palette[%d] is %02x%02x%02x%02x, straight %02x%02x%02x%02x\n",
+                        fname, i, pc->r, pc->g, pc->b, pc->a, sc->r, sc->g, sc->b, sc->a);
+                rv += 1;
+            }
+        }
+        for (y = 0; y < spl_surf->h; y++) {
+            if (memcmp((Uint8 *)pm_surf->pixels + y * pm_surf->pitch,
+                       (Uint8 *)spl_surf->pixels + y * spl_surf->pitch, spl_surf->w)) {
+                fprintf(stderr, "test_premultiplied(%s): row %d indices differ\n", fname, y);
+                rv += 1;
+            }
+        }
+        goto exit;
+    }
+    if (!spl_surf->format->Amask) {
+        /* colorkeyed or opaque, nothing to multiply */
+        rv += compare_surfaces(fname, spl_surf, pm_surf, loud);
+        goto exit;
+    }
+
+    if (loud) {
+        fprintf(stderr, "premultiplied pixels:\n");
+    }
+    for (y = 0; y < spl_surf->h; y++) {
+        s = (const Uint8 *)spl_surf->pixels + y * spl_surf->pitch;
+        p = (const Uint8 *)pm_surf->pixels + y * pm_surf->pitch;
+        for (x = 0; x < 4 * spl_surf->w; x += 4) {
+            for (c = 0; c < 3; c++)
+                if (p[x + c] != (s[x + c] * s[x + 3] + 127) / 255)
+                    break;
+            if (c < 3 || p[x + 3] != s[x + 3]) {
+                if (fails == 0) {
+                    fprintf(stderr, "test_premultiplied(%s): (%d,%d) is %02x%02x%02x%02x, straight %02x%02x%02x%02x\n",
+                            fname, x / 4, y, p[x], p[x + 1], p[x + 2], p[x + 3], s[x], s[x + 1], s[x + 2], s[x + 3]);
+                }
+                fails += 1;
+            }
+        }
+    }
+    if (fails) {
+        fprintf(stderr, "test_premultiplied(%s): pixel data mismatch (%d pixels)\n", fname, fails);
+        rv += 1;
+        goto exit;
+    }
+
+    if (loud) {
+        fprintf(stderr, "SDL_SavePNG_RW_Premultiplied():\n");
+    }
+    /* color where alpha is zero mustn't make it out */
+    for (y = 0; y < pm_surf->h; y++) {
+        Uint8 *row = (Uint8 *)pm_surf->pixels + y * pm_surf->pitch;
+        for (x = 0; x < 4 * pm_surf->w; x += 4)
+            if (row[x + 3] == 0)
+                row[x] = row[x + 1] = row[x + 2] = 255;
+    }
+    rwo_buf_sz = 5 * spl_surf->w * spl_surf->h + 65536;
+    rwo_buf = SDL_malloc(rwo_buf_sz);
+    if (NULL == rwo_buf) {
+        fprintf(stderr, "SDL_malloc(): %s\n", SDL_GetError());
+        rv = 1;
+        goto exit;
+    }
+    rwo = SDL_RWFromMem(rwo_buf, rwo_buf_sz);
+    if (NULL == rwo) {
+        fprintf(stderr, "SDL_RWFromMem(): %s\n", SDL_GetError());
+        rv = 1;
+        goto exit;
+    }
+    if (-1 == SDL_SavePNG_RW_Premultiplied(pm_surf, rwo, 0)) {
+        fprintf(stderr, "%s: SDL_SavePNG_RW_Premultiplied(): %s\n", fname, SDL_GetError());
+        rv = 1;
+        goto exit;
+    }
+    SDL_RWseek(rwo, 0, RW_SEEK_SET);
+    si_surf = IMG_LoadPNG_RW(rwo);
+    if (NULL == si_surf) {
+        fprintf(stderr, "IMG_LoadPNG_RW(%s): %s\n", fname, SDL_GetError());
+        rv = 1;
+        goto exit;
+    }
+    if (si_surf->format->format != spl_surf->format->format) {
+        converted = SDL_ConvertSurface(si_surf, spl_surf->format, 0);
+        if (NULL == converted) {
+            fprintf(stderr, "test_premultiplied(%s): pixel format convert failed: %s\n", fname, SDL_GetError());
+            rv = 1;
+            goto exit;
+        }
+        SDL_FreeSurface(si_surf);
+        si_surf = converted;
+    }
+    if (si_surf->w != spl_surf->w || si_surf->h != spl_surf->h) {
+        fprintf(stderr, "test_premultiplied(%s): read back %dx%d, not %dx%d\n", fname,
+                si_surf->w, si_surf->h, spl_surf->w, spl_surf->h);
+        rv = 1;
+        goto exit;
+    }
+    for (y = 0; y < spl_surf->h; y++) {
+        s = (const Uint8 *)spl_surf->pixels + y * spl_surf->pitch;
+        p = (const Uint8 *)pm_surf->pixels + y * pm_surf->pitch;
+        o = (const Uint8 *)si_surf->pixels + y * si_surf->pitch;
+        for (x = 0; x < 4 * spl_surf->w; x += 4) {
+            a = s[x + 3];
+            for (c = 0; c < 3; c++) {
+                want = a ? (p[x + c] * 255u + a / 2) / a : 0;
+                if (want > 255)
+                    want = 255;
+                if (o[x + c] != want || 2 * a * abs(o[x + c] - s[x + c]) > 255 + a)
+                    break;
+            }
+            if (c < 3 || o[x + 3] != a) {
+                if (fails == 0) {
+                    fprintf(stderr, "test_premultiplied(%s): read back (%d,%d) as %02x%02x%02x%02x, straight %02x%02x%02x%02x\n",
+                            fname, x / 4, y, o[x], o[x + 1], o[x + 2], o[x + 3], s[x], s[x + 1], s[x + 2], s[x + 3]);
+                }
+                fails += 1;
+            }
+        }
+    }
+    if (fails) {
+        fprintf(stderr, "test_premultiplied(%s): round trip mismatch (%d pixels)\n", fname, fails);
+        rv += 1;
+    }
+
+  exit:
+    if (si_surf) { SDL_FreeSurface(si_surf); }
+    if (pm_surf) { SDL_FreeSurface(pm_surf); }
+    if (spl_surf) { SDL_FreeSurface(spl_surf); }
+    if (rwo) { SDL_FreeRW(rwo); }
+    if (rwo_buf) { SDL_free(rwo_buf); }
+    return expected_ok ? rv : 0;
+}
+
+/*  pnglite API tests. Each decodes a file some other way than the
+    reference, pnglite_read_image() through a read callback, and compares
+    the results. Files the reference can't decode are skipped. */
+
+typedef struct {
+    const unsigned char *buf;
+    size_t len;
+    size_t pos;
+    unsigned calls;                 /* read callback calls */
+} mem_reader_t;
+
+/* read callback over a memory buffer; NULL output skips */
+size_t mem_read(void *out, size_t size, size_t numel, void *user_pointer) {
+    mem_reader_t *r = user_pointer;
+    size_t n = size ? (r->len - r->pos) / size : 0;
+
+    if (n > numel)
+        n = numel;
+    if (out)
+        memcpy(out, r->buf + r->pos, n * size);
+    r->pos += n * size;
+    r->calls += 1;
+    return n;
+}
+
+typedef struct {
+    unsigned char *buf;
+    size_t len;
+    size_t size;
+} mem_writer_t;
+
+size_t mem_write(void *in, size_t size, size_t numel, void *user_pointer) {
+    mem_writer_t *w = user_pointer;
+    size_t n = size * numel;
+
+    if (w->size - w->len < n) {
+        size_t size2 = w->size ? w->size : 65536;
+        unsigned char *buf;
+        while (size2 - w->len < n)
+            size2 *= 2;
+        if (NULL == (buf = realloc(w->buf, size2)))
+            return 0;
+        w->buf = buf;
+        w->size = size2;
+    }
+    memcpy(w->buf + w->len, in, n);
+    w->len += n;
+    return numel;
+}
+
+unsigned char *load_file(const char *fname, size_t *len) {
+    FILE *fp;
+    unsigned char *buf = NULL;
+    long sz;
+
+    if (NULL == (fp = fopen(fname, "rb")))
+        return NULL;
+    if ((0 == fseek(fp, 0, SEEK_END)) && ((sz = ftell(fp)) > 0) && (0 == fseek(fp, 0, SEEK_SET))) {
+        buf = malloc((size_t)sz);
+        if (buf && (fread(buf, 1, (size_t)sz, fp) != (size_t)sz)) {
+            free(buf);
+            buf = NULL;
+        }
+        *len = (size_t)sz;
+    }
+    fclose(fp);
+    return buf;
+}
+
+/* malloc with a size header, keeping tabs on the bytes in use */
+size_t alloc_live = 0, alloc_peak = 0, alloc_calls = 0;
+
+void *counting_alloc(size_t s) {
+    size_t *p = malloc(s + 16);
+
+    if (NULL == p)
+        return NULL;
+    p[0] = s;
+    alloc_live += s;
+    alloc_calls += 1;
+    if (alloc_live > alloc_peak)
+        alloc_peak = alloc_live;
+    return (unsigned char *)p + 16;
+}
+
+void counting_free(void *p) {
+    if (p) {
+        size_t *h = (size_t *)((unsigned char *)p - 16);
+        alloc_live -= h[0];
+        free(h);
+    }
+}
+
+void counting_reset(void) {
+    alloc_live = alloc_peak = alloc_calls = 0;
+}
+
+/* the file, its header and pnglite_read_image() of it */
+typedef struct {
+    const char *fname;
+    const unsigned char *file;
+    size_t len;
+    pnglite_t hdr;
+    unsigned char *image;
+    size_t rowbytes;
+    int loud;
+} api_case_t;
+
+typedef int (*api_test_t)(const api_case_t *c);
+
+/* png set to read the file through mem_read() */
+void init_png(pnglite_t *png, mem_reader_t *r, const api_case_t *c) {
+    r->buf = c->file;
+    r->len = c->len;
+    r->pos = 0;
+    r->calls = 0;
+    pnglite_init(png, r, mem_read, 0, 0, 0, 0, 0);
+}
+
+/* same, header read */
+int open_png(pnglite_t *png, mem_reader_t *r, const api_case_t *c) {
+    init_png(png, r, c);
+    return pnglite_read_header(png);
+}
+
+/* counts rows that differ from the reference, first_row on, rows pitch bytes apart */
+int compare_rows(const api_case_t *c, const char *what, const unsigned char *rows, size_t pitch,
+                 unsigned first_row, unsigned nrows) {
+    unsigned y;
+    int fails = 0;
+
+    for (y = 0; y < nrows; y++) {
+        if (0 != memcmp(rows + y * pitch, c->image + (first_row + y) * c->rowbytes, c->rowbytes)) {
+            if (0 == fails)
+                fprintf(stderr, "%s: %s: row %u differs\n", c->fname, what, first_row + y);
+            fails += 1;
+        }
+    }
+    return fails;
+}
+
+/* calls f on every chunk: its type, data and length; stops at the first non-zero return */
+int for_each_chunk(const unsigned char *file, size_t len,
+                   int (*f)(const unsigned char *type, const unsigned char *data, size_t length, void *user),
+                   void *user) {
+    size_t pos = 8, length;
+    int rv;
+
+    while (len - pos >= 12) {
+        length = ((size_t)file[pos] << 24) | (file[pos + 1] << 16) | (file[pos + 2] << 8) | file[pos + 3];
+        if (length > len - pos - 12)
+            break;
+        if (0 != (rv = f(file + pos + 4, file + pos + 8, length, user)))
+            return rv;
+        pos += 12 + length;
+    }
+    return 0;
+}
+
+int largest_chunk(const unsigned char *type, const unsigned char *data, size_t length, void *user) {
+    (void)type; (void)data;
+    if (length > *(size_t *)user)
+        *(size_t *)user = length;
+    return 0;
+}
+
+/*  Image data is inflated and reconstructed a scanline at a time: besides
+    the output, decoding takes no more than the largest chunk (twice over
+    while the input buffer grows), a few scanlines, lookup tables and the
+    inflate state. */
+int test_stream(const api_case_t *c) {
+    pnglite_t png;
+    mem_reader_t r;
+    unsigned char *image;
+    size_t chunk = 0, bound;
+    int rv, fails = 0;
+
+    for_each_chunk(c->file, c->len, largest_chunk, &chunk);
+    image = malloc(c->rowbytes * c->hdr.height);
+    counting_reset();
+    r.buf = c->file;
+    r.len = c->len;
+    r.pos = r.calls = 0;
+    pnglite_init(&png, &r, mem_read, 0, counting_alloc, counting_free, 0, 0);
+    if ((PNG_NO_ERROR != (rv = pnglite_read_header(&png))) || (PNG_NO_ERROR != (rv = pnglite_read_image(&png, image)))) {
+        fprintf(stderr, "%s: pnglite_read_image(): %s\n", c->fname, pnglite_error_string(rv));
+        free(image);
+        return 1;
+    }
+    fails += compare_rows(c, "counting allocator", image, c->rowbytes, 0, c->hdr.height);
+
+    bound = 2 * (chunk + 12 + 16) + 3 * ((size_t)png.pitch + 1) + 8 * (size_t)png.width + 12 * 256 + 65536;
+    if (alloc_peak > bound) {
+        fprintf(stderr, "%s: decoding took %lu bytes, more than %lu\n", c->fname,
+                (unsigned long)alloc_peak, (unsigned long)bound);
+        fails += 1;
+    }
+    if (alloc_live != 0) {
+        fprintf(stderr, "%s: %lu bytes left allocated\n", c->fname, (unsigned long)alloc_live);
+        fails += 1;
+    }
+    if (c->loud)
+        fprintf(stderr, "    peak %lu bytes, image %lu\n", (unsigned long)alloc_peak,
+                (unsigned long)(c->rowbytes * c->hdr.height));
+    free(image);
+    return fails;
+}
+
+/* same numbers on every run and platform */
+unsigned test_seed = 1;
+
+unsigned test_rand(unsigned n) {
+    test_seed = test_seed * 1103515245u + 12345u;
+    return (test_seed >> 16) % n;
+}
+
+/*  Rows are read in batches of random sizes; all come out once and in
+    order, same as pnglite_read_image() gives them. */
+int test_next_rows(const api_case_t *c) {
+    pnglite_t png;
+    mem_reader_t r;
+    unsigned char *image;
+    unsigned y = 0;
+    int rv, fails = 0;
+
+    image = malloc(c->rowbytes * c->hdr.height);
+    open_png(&png, &r, c);
+    while ((rv = pnglite_read_next_rows(&png, image + y * c->rowbytes, 1 + test_rand(c->hdr.height))) > 0)
+        y += rv;
+    if (rv < 0) {
+        fprintf(stderr, "%s: pnglite_read_next_rows(): %s\n", c->fname, pnglite_error_string(rv));
+        fails += 1;
+    } else if (y != c->hdr.height) {
+        fprintf(stderr, "%s: pnglite_read_next_rows() gave %u rows of %u\n", c->fname, y, c->hdr.height);
+        fails += 1;
+    } else {
+        fails += compare_rows(c, "pnglite_read_next_rows()", image, c->rowbytes, 0, c->hdr.height);
+    }
+    free(image);
+    return fails;
+}
+
+typedef struct {
+    const api_case_t *c;
+    unsigned next_row;
+    unsigned stop_row;              /* row to return non-zero at */
+    int fails;
+} row_check_t;
+
+/* pnglite_read_rows() callback comparing each row with the reference */
+int check_row(const unsigned char *row, unsigned y, void *user_pointer) {
+    row_check_t *rc = user_pointer;
+
+    if (y != rc->next_row) {
+        if (0 == rc->fails)
+            fprintf(stderr, "%s: row %u came instead of %u\n", rc->c->fname, y, rc->next_row);
+        rc->fails += 1;
+    }
+    rc->fails += compare_rows(rc->c, "pnglite_read_rows()", row, 0, y, 1);
+    rc->next_row = y + 1;
+    return y == rc->stop_row ? 7 : 0;
+}
+
+/*  Each row is passed to the callback once, in order; decoding stops
+    when the callback says so. */
+int test_read_rows(const api_case_t *c) {
+    pnglite_t png;
+    mem_reader_t r;
+    row_check_t rc;
+    int rv, fails = 0;
+
+    rc.c = c;
+    rc.next_row = 0;
+    rc.stop_row = c->hdr.height;
+    rc.fails = 0;
+    open_png(&png, &r, c);
+    if (PNG_NO_ERROR != (rv = pnglite_read_rows(&png, check_row, &rc))) {
+        fprintf(stderr, "%s: pnglite_read_rows(): %s\n", c->fname, pnglite_error_string(rv));
+        fails += 1;
+    } else if (rc.next_row != c->hdr.height) {
+        fprintf(stderr, "%s: pnglite_read_rows() gave %u rows of %u\n", c->fname, rc.next_row, c->hdr.height);
+        fails += 1;
+    }
+
+    rc.next_row = 0;
+    rc.stop_row = c->hdr.height / 2;
+    open_png(&png, &r, c);
+    if (7 != (rv = pnglite_read_rows(&png, check_row, &rc))) {
+        fprintf(stderr, "%s: pnglite_read_rows() stopped at row %u returned %d\n", c->fname, rc.stop_row, rv);
+        fails += 1;
+    } else if (rc.next_row != rc.stop_row + 1) {
+        fprintf(stderr, "%s: pnglite_read_rows() went on to row %u past %u\n", c->fname, rc.next_row, rc.stop_row);
+        fails += 1;
+    }
+    pnglite_read_abort(&png);
+    return fails + rc.fails;
+}
+
+typedef struct {
+    unsigned char *image;
+    size_t rowbytes;
+    unsigned rows;                  /* rows handed out so far */
+} row_copy_t;
+
+/* pnglite_read_rows() callback putting rows in place */
+int copy_row(const unsigned char *row, unsigned y, void *user_pointer) {
+    row_copy_t *rc = user_pointer;
+
+    memcpy(rc->image + y * rc->rowbytes, row, rc->rowbytes);
+    rc->rows = y + 1;
+    return 0;
+}
+
+/*  Pushes the first len bytes of file in slices of 1..max_slice bytes,
+    reading rows into rc->image whenever they are ready, with
+    pnglite_read_rows() if by_callback is set, in random batches with
+    pnglite_read_next_rows() otherwise. Returns what pnglite_push() last
+    said or an error from reading rows. */
+int push_file(pnglite_t *png, const unsigned char *file, size_t len, unsigned max_slice,
+              int by_callback, row_copy_t *rc) {
+    size_t pos = 0, n;
+    int rv, got;
+
+    pnglite_init_push(png, 0, 0, 0, 0);
+    do {
+        n = 1 + test_rand(max_slice);
+        if (n > len - pos)
+            n = len - pos;
+        rv = pnglite_push(png, file + pos, n);
+        pos += n;
+        while (PNG_ROWS_READY == rv) {
+            if (by_callback) {
+                if (PNG_NO_ERROR != (got = pnglite_read_rows(png, copy_row, rc)))
+                    return got;
+            } else {
+                while ((got = pnglite_read_next_rows(png, rc->image + rc->rows * rc->rowbytes,
+                                                     1 + test_rand(png->height))) > 0)
+                    rc->rows += got;
+                if (got < 0)
+                    return got;
+            }
+            rv = pnglite_push(png, NULL, 0);
+        }
+    } while ((PNG_NEED_MORE == rv) && (pos < len));
+    return rv;
+}
+
+/*  The file is pushed a byte at a time, then in random slices; rows come
+    out the same as pnglite_read_image() gives them. */
+int test_push(const api_case_t *c) {
+    pnglite_t png;
+    row_copy_t rc;
+    unsigned max_slice[] = { 1, 4096 };
+    unsigned i, by_callback;
+    int rv, fails = 0;
+    char what[64];
+
+    rc.image = malloc(c->rowbytes * c->hdr.height);
+    rc.rowbytes = c->rowbytes;
+    for (i = 0; i < sizeof(max_slice) / sizeof(max_slice[0]); i++) {
+        for (by_callback = 0; by_callback < 2; by_callback++) {
+            sprintf(what, "%s, slices up to %u bytes", by_callback ? "pnglite_read_rows()" : "pnglite_read_next_rows()",
+                    max_slice[i]);
+            memset(rc.image, 0, c->rowbytes * c->hdr.height);
+            rc.rows = 0;
+            if (PNG_DONE != (rv = push_file(&png, c->file, c->len, max_slice[i], by_callback, &rc))) {
+                fprintf(stderr, "%s: %s: pnglite_push(): %s\n", c->fname, what, pnglite_error_string(rv));
+                pnglite_read_abort(&png);
+                fails += 1;
+            } else if (rc.rows != c->hdr.height) {
+                fprintf(stderr, "%s: %s: %u rows of %u\n", c->fname, what, rc.rows, c->hdr.height);
+                fails += 1;
+            } else {
+                fails += compare_rows(c, what, rc.image, c->rowbytes, 0, c->hdr.height);
+            }
+        }
+    }
+    free(rc.image);
+    return fails;
+}
+
+int oversize_idat(const unsigned char *type, const unsigned char *data, size_t length, void *user) {
+    (void)data; (void)user;
+    return (0 == memcmp(type, "IDAT", 4)) && (length > 65536);
+}
+
+/*  Images of 8 bits and up are written out with pnglite_write_begin(),
+    pnglite_write_rows() in random batches and pnglite_write_end(), with
+    each filter type; reading them back gives the same pixels, palette and
+    tRNS, and no IDAT is over 64K. The writer takes palette entries as
+    RGBA quads, not the way the reader leaves them. */
+int test_write_rows(const api_case_t *c) {
+    pnglite_t png;
+    mem_writer_t w;
+    mem_reader_t r;
+    unsigned char *image;
+    unsigned y, n, i, filter;
+    int rv, fails = 0;
+    char what[64];
+
+    if (c->hdr.depth < 8)
+        return 0;
+    image = malloc(c->rowbytes * c->hdr.height);
+    for (filter = PNG_FILTER_NONE; filter <= PNG_FILTER_ADAPTIVE; filter++) {
+        sprintf(what, "written with filter %u", filter);
+        memset(&w, 0, sizeof(w));
+        pnglite_init(&png, &w, 0, mem_write, 0, 0, 0, 0);
+        png.write_filter = filter;
+        for (i = 0; i < 256; i++) {
+            png.palette[4 * i + 0] = c->hdr.palette[3 * i + 0];
+            png.palette[4 * i + 1] = c->hdr.palette[3 * i + 1];
+            png.palette[4 * i + 2] = c->hdr.palette[3 * i + 2];
+            png.palette[4 * i + 3] = c->hdr.palette[768 + i];
+        }
+        memcpy(png.colorkey, c->hdr.colorkey, sizeof(png.colorkey));
+        png.palette_size = c->hdr.palette_size;
+        rv = pnglite_write_begin(&png, c->hdr.width, c->hdr.height, c->hdr.depth, c->hdr.color_type,
+                                 c->hdr.transparency_present);
+        for (y = 0; (PNG_NO_ERROR == rv) && (y < c->hdr.height); y += n) {
+            n = 1 + test_rand(c->hdr.height - y);
+            rv = pnglite_write_rows(&png, c->image + y * c->rowbytes, n);
+        }
+        if (PNG_NO_ERROR == rv) {
+            rv = pnglite_write_end(&png);
+        } else {
+            pnglite_write_end(&png);
+        }
+        if (PNG_NO_ERROR != rv) {
+            fprintf(stderr, "%s: %s: %s\n", c->fname, what, pnglite_error_string(rv));
+            fails += 1;
+        } else {
+            r.buf = w.buf;
+            r.len = w.len;
+            r.pos = r.calls = 0;
+            pnglite_init(&png, &r, mem_read, 0, 0, 0, 0, 0);
+            if ((PNG_NO_ERROR != (rv = pnglite_read_header(&png))) || (PNG_NO_ERROR != (rv = pnglite_read_image(&png, image)))) {
+                fprintf(stderr, "%s: %s, reading it back: %s\n", c->fname, what, pnglite_error_string(rv));
+                fails += 1;
+            } else {
+                fails += compare_rows(c, what, image, c->rowbytes, 0, c->hdr.height);
+                if ((png.palette_size != c->hdr.palette_size) ||
+                    (0 != memcmp(png.palette, c->hdr.palette, 3 * png.palette_size)) ||
+                    (0 != memcmp(png.palette + 768, c->hdr.palette + 768, png.palette_size))) {
+                    fprintf(stderr, "%s: %s: palette differs\n", c->fname, what);
+                    fails += 1;
+                }
+                if ((png.transparency_present != c->hdr.transparency_present) ||
+                    (png.transparency_present && (0 != memcmp(png.colorkey, c->hdr.colorkey, 6)))) {
+                    fprintf(stderr, "%s: %s: tRNS differs\n", c->fname, what);
+                    fails += 1;
+                }
+            }
+            if (for_each_chunk(w.buf, w.len, oversize_idat, NULL)) {
+                fprintf(stderr, "%s: %s: IDAT over 64K\n", c->fname, what);
+                fails += 1;
+            }
+        }
+        free(w.buf);
+    }
+    free(image);
+    return fails;
+}
+
+int count_idat(const unsigned char *type, const unsigned char *data, size_t length, void *user) {
+    (void)data; (void)length;
+    if (0 == memcmp(type, "IDAT", 4))
+        *(unsigned *)user += 1;
+    return 0;
+}
+
+/*  An RGBA image of 843K filtered, smooth on the left and noise on the
+    right, written whole with pnglite_write_image() by no, one and four
+    deflate threads and with each filter type. Four threads deflate it in
+    4 strips, the last a partial one, joined by sync flushes and with
+    their Adler-32s combined; either way it is split in several IDATs,
+    and it reads back as it was. Not per file: PngSuite images are all
+    too small to be split in strips. */
+int test_write_threads(int loud) {
+    pnglite_t png;
+    mem_writer_t w;
+    mem_reader_t r;
+    const unsigned width = 301, height = 700;
+    const size_t rowbytes = (size_t)width * 4;
+    unsigned char *source, *image;
+    unsigned threads, filter, idats;
+    size_t x, y;
+    int rv, fails = 0;
+    char what[64];
+
+    source = malloc(rowbytes * height);
+    image = malloc(rowbytes * height);
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < rowbytes; x++)
+            source[y * rowbytes + x] = x < rowbytes / 2 ? (unsigned char)(x + y * (x & 3)) : (unsigned char)test_rand(256);
+    }
+
+    for (threads = 0; threads <= 4; threads += threads ? 3 : 1) {
+        for (filter = PNG_FILTER_NONE; filter <= PNG_FILTER_ADAPTIVE; filter++) {
+            sprintf(what, "%u threads, filter %u", threads, filter);
+            memset(&w, 0, sizeof(w));
+            pnglite_init(&png, &w, 0, mem_write, 0, 0, 0, 0);
+            png.threads = threads;
+            png.write_filter = filter;
+            if (PNG_NO_ERROR != (rv = pnglite_write_image(&png, width, height, 8, PNG_TRUECOLOR_ALPHA, 0, source))) {
+                fprintf(stderr, "write threads: %s: %s\n", what, pnglite_error_string(rv));
+                fails += 1;
+                free(w.buf);
+                continue;
+            }
+            idats = 0;
+            for_each_chunk(w.buf, w.len, count_idat, &idats);
+            if (loud)
+                fprintf(stderr, "    %s: %lu bytes, %u IDATs\n", what, (unsigned long)w.len, idats);
+            if (idats < 2) {
+                fprintf(stderr, "write threads: %s: %u IDATs\n", what, idats);
+                fails += 1;
+            }
+            r.buf = w.buf;
+            r.len = w.len;
+            r.pos = r.calls = 0;
+            pnglite_init(&png, &r, mem_read, 0, 0, 0, 0, 0);
+            if ((PNG_NO_ERROR != (rv = pnglite_read_header(&png))) || (PNG_NO_ERROR != (rv = pnglite_read_image(&png, image)))) {
+                fprintf(stderr, "write threads: %s, reading it back: %s\n", what, pnglite_error_string(rv));
+                fails += 1;
+            } else if (0 != memcmp(image, source, rowbytes * height)) {
+                fprintf(stderr, "write threads: %s: read back differs\n", what);
+                fails += 1;
+            }
+            free(w.buf);
+        }
+    }
+    free(image);
+    free(source);
+    return fails;
+}
+
+typedef struct {
+    unsigned passes;                /* bit per pass the callback was called after */
+    unsigned stop_pass;             /* pass to return non-zero after */
+} preview_check_t;
+
+int check_preview(const unsigned char *image, unsigned pass, void *user_pointer) {
+    preview_check_t *pc = user_pointer;
+
+    (void)image;
+    pc->passes |= 1u << pass;
+    return pass == pc->stop_pass ? 5 : 0;
+}
+
+/*  Decoded in full, the image is the same as pnglite_read_image() gives;
+    previews come after passes 1, 3 and 5 of interlaced images only, those
+    of them that aren't empty. Stopped after one of these, each 8x8, 4x4
+    or 2x2 block holds its top left pixel. */
+int test_progressive(const api_case_t *c) {
+    pnglite_t png;
+    mem_reader_t r;
+    preview_check_t pc;
+    unsigned char *image;
+    unsigned stop, block, x, y, passes = 0;
+    int rv, fails = 0;
+
+    if (c->hdr.interlace_method) {
+        /* passes 3 and 5 start at rows 4 and 2 */
+        passes = (1u << 1) | (c->hdr.height > 4 ? 1u << 3 : 0u) | (c->hdr.height > 2 ? 1u << 5 : 0u);
+    }
+
+    image = malloc(c->rowbytes * c->hdr.height);
+    pc.passes = 0;
+    pc.stop_pass = 0;
+    open_png(&png, &r, c);
+    if (PNG_NO_ERROR != (rv = pnglite_read_image_progressive(&png, image, check_preview, &pc))) {
+        fprintf(stderr, "%s: pnglite_read_image_progressive(): %s\n", c->fname, pnglite_error_string(rv));
+        fails += 1;
+    } else {
+        fails += compare_rows(c, "pnglite_read_image_progressive()", image, c->rowbytes, 0, c->hdr.height);
+    }
+    if (pc.passes != passes) {
+        fprintf(stderr, "%s: previews after passes %#x\n", c->fname, pc.passes);
+        fails += 1;
+    }
+
+    for (stop = 1; stop <= 5; stop += 2) {
+        if (0 == (passes & (1u << stop)))
+            continue;
+        block = 8 >> (stop / 2);
+        pc.stop_pass = stop;
+        open_png(&png, &r, c);
+        if (5 != (rv = pnglite_read_image_progressive(&png, image, check_preview, &pc))) {
+            fprintf(stderr, "%s: pnglite_read_image_progressive() stopped after pass %u returned %d\n",
+                    c->fname, stop, rv);
+            fails += 1;
+            continue;
+        }
+        for (y = 0; y < c->hdr.height; y++) {
+            for (x = 0; x < c->hdr.width; x++) {
+                if (0 != memcmp(image + y * c->rowbytes + x * c->hdr.stride,
+                                c->image + (y & ~(block - 1)) * c->rowbytes + (x & ~(block - 1)) * c->hdr.stride,
+                                c->hdr.stride)) {
+                    if (0 == fails)
+                        fprintf(stderr, "%s: preview after pass %u: pixel %u,%u differs\n", c->fname, stop, x, y);
+                    fails += 1;
+                }
+            }
+        }
+    }
+    free(image);
+    return fails;
+}
+
+/*  Scaled down by 2, 4 and 8, indexed color and interlaced images come
+    out with the top left pixel of each block of the reference, others
+    with the rounded average of the block. */
+int test_scaled(const api_case_t *c) {
+    pnglite_t png;
+    mem_reader_t r;
+    unsigned char *image, want;
+    unsigned shift, block, width, height, x, y, i, j, k, n, sum;
+    const unsigned stride = c->hdr.stride;
+    int pick, rv, fails;
+    int failcount = 0;
+
+    pick = c->hdr.interlace_method || (PNG_INDEXED == c->hdr.color_type);
+    image = malloc(c->rowbytes * c->hdr.height);
+    for (shift = 1; shift <= 3; shift++) {
+        block = 1 << shift;
+        width = (c->hdr.width + block - 1) >> shift;
+        height = (c->hdr.height + block - 1) >> shift;
+        open_png(&png, &r, c);
+        if (PNG_NO_ERROR != (rv = pnglite_read_image_scaled(&png, image, shift))) {
+            fprintf(stderr, "%s: pnglite_read_image_scaled(%u): %s\n", c->fname, shift, pnglite_error_string(rv));
+            failcount += 1;
+            continue;
+        }
+        fails = 0;
+        for (y = 0; y < height; y++) {
+            for (x = 0; x < width; x++) {
+                for (k = 0; k < stride; k++) {
+                    if (pick) {
+                        want = c->image[(y << shift) * c->rowbytes + (x << shift) * stride + k];
+                    } else {
+                        sum = n = 0;
+                        for (j = y << shift; (j < (y + 1) << shift) && (j < c->hdr.height); j++) {
+                            for (i = x << shift; (i < (x + 1) << shift) && (i < c->hdr.width); i++) {
+                                sum += c->image[j * c->rowbytes + i * stride + k];
+                                n += 1;
+                            }
+                        }
+                        want = (sum + n / 2) / n;
+                    }
+                    if (image[(y * width + x) * stride + k] != want) {
+                        if (0 == fails)
+                            fprintf(stderr, "%s: scaled by 1/%u: pixel %u,%u differs\n", c->fname, block, x, y);
+                        fails += 1;
+                    }
+                }
+            }
+        }
+        failcount += fails;
+    }
+    free(image);
+    return failcount;
+}
+
+/*  The whole image, its corners and random rectangles of it come out the
+    same as that part of the reference; empty regions and those reaching
+    out of the image are refused. */
+int test_region(const api_case_t *c) {
+    pnglite_t png;
+    mem_reader_t r;
+    unsigned char *image;
+    const unsigned w = c->hdr.width, h = c->hdr.height;
+    const size_t stride = c->hdr.stride;
+    unsigned rx, ry, rw, rh, i, y;
+    int rv, fails = 0;
+    char what[64];
+
+    image = malloc(c->rowbytes * h);
+    for (i = 0; i < 16; i++) {
+        switch (i) {
+        case 0: rx = 0; ry = 0; rw = w; rh = h; break;
+        case 1: rx = 0; ry = 0; rw = 1; rh = 1; break;
+        case 2: rx = w - 1; ry = 0; rw = 1; rh = 1; break;
+        case 3: rx = 0; ry = h - 1; rw = 1; rh = 1; break;
+        case 4: rx = w - 1; ry = h - 1; rw = 1; rh = 1; break;
+        case 5: rx = w / 2; ry = h / 2; rw = w - w / 2; rh = h - h / 2; break;
+        default:
+            rx = test_rand(w);
+            ry = test_rand(h);
+            rw = 1 + test_rand(w - rx);
+            rh = 1 + test_rand(h - ry);
+            break;
+        }
+        sprintf(what, "region %ux%u at %u,%u", rw, rh, rx, ry);
+        open_png(&png, &r, c);
+        if (PNG_NO_ERROR != (rv = pnglite_read_region(&png, rx, ry, rw, rh, image))) {
+            fprintf(stderr, "%s: %s: %s\n", c->fname, what, pnglite_error_string(rv));
+            fails += 1;
+            continue;
+        }
+        for (y = 0; y < rh; y++) {
+            if (0 != memcmp(image + y * rw * stride, c->image + (ry + y) * c->rowbytes + rx * stride, rw * stride)) {
+                fprintf(stderr, "%s: %s: row %u differs\n", c->fname, what, ry + y);
+                fails += 1;
+                break;
+            }
+        }
+    }
+
+    open_png(&png, &r, c);
+    if (PNG_WRONG_ARGUMENTS != (rv = pnglite_read_region(&png, 0, 0, 0, h, image))) {
+        fprintf(stderr, "%s: empty region: %s\n", c->fname, pnglite_error_string(rv));
+        fails += 1;
+    }
+    open_png(&png, &r, c);
+    if (PNG_WRONG_ARGUMENTS != (rv = pnglite_read_region(&png, w - 1, 0, 2, 1, image))) {
+        fprintf(stderr, "%s: region past the right edge: %s\n", c->fname, pnglite_error_string(rv));
+        fails += 1;
+    }
+    free(image);
+    return fails;
+}
+
+/* reads rows first_row.. through the index into image, compares them with the reference */
+int check_indexed_rows(const api_case_t *c, const pnglite_index_t *index, const char *what,
+                       unsigned char *image, unsigned first_row, unsigned nrows) {
+    pnglite_t png;
+    mem_reader_t r;
+    int rv;
+
+    open_png(&png, &r, c);
+    if (PNG_NO_ERROR != (rv = pnglite_read_rows_indexed(&png, index, first_row, nrows, image))) {
+        fprintf(stderr, "%s: %s: rows %u..%u: %s\n", c->fname, what, first_row, first_row + nrows - 1,
+                pnglite_error_string(rv));
+        return 1;
+    }
+    return compare_rows(c, what, image, c->rowbytes, first_row, nrows);
+}
+
+/* loads an index from the sidecar, returns what pnglite_index_load() did */
+int load_index(const api_case_t *c, const unsigned char *sidecar, size_t len, pnglite_index_t **index) {
+    pnglite_t png;
+    mem_reader_t r, sr;
+
+    open_png(&png, &r, c);
+    sr.buf = sidecar;
+    sr.len = len;
+    sr.pos = sr.calls = 0;
+    return pnglite_index_load(&png, mem_read, &sr, index);
+}
+
+/*  Indexes built with checkpoints 1, 7 and 64 rows apart decode the image
+    as it is and random runs of rows from their checkpoints, and do so the
+    same when saved to a sidecar and loaded back. Truncated sidecars and
+    those with the header damaged fail to load; a bit flipped in the
+    checkpoints either fails to load or makes no difference, padding bits
+    of the deflate stream being ignored. Interlaced images can't be
+    indexed. */
+int test_index(const api_case_t *c) {
+    pnglite_t png;
+    mem_reader_t r;
+    mem_writer_t w;
+    pnglite_index_t *index, *loaded;
+    unsigned char *image, *bad;
+    unsigned strip_rows[] = { 1, 7, 64 };
+    unsigned i, j, first, n;
+    size_t pos;
+    int rv, fails = 0;
+    char what[64];
+
+    image = malloc(c->rowbytes * c->hdr.height);
+    if (c->hdr.interlace_method) {
+        open_png(&png, &r, c);
+        if (PNG_WRONG_ARGUMENTS != (rv = pnglite_index_build(&png, image, 8, &index))) {
+            fprintf(stderr, "%s: indexing an interlaced image: %s\n", c->fname, pnglite_error_string(rv));
+            fails += 1;
+            if (PNG_NO_ERROR == rv)
+                pnglite_index_free(index);
+        }
+        free(image);
+        return fails;
+    }
+
+    for (i = 0; i < sizeof(strip_rows) / sizeof(strip_rows[0]); i++) {
+        sprintf(what, "index of %u-row strips", strip_rows[i]);
+        open_png(&png, &r, c);
+        if (PNG_NO_ERROR != (rv = pnglite_index_build(&png, image, strip_rows[i], &index))) {
+            fprintf(stderr, "%s: %s: pnglite_index_build(): %s\n", c->fname, what, pnglite_error_string(rv));
+            fails += 1;
+            continue;
+        }
+        fails += compare_rows(c, what, image, c->rowbytes, 0, c->hdr.height);
+
+        memset(&w, 0, sizeof(w));
+        if (PNG_NO_ERROR != (rv = pnglite_index_save(&png, index, mem_write, &w))) {
+            fprintf(stderr, "%s: %s: pnglite_index_save(): %s\n", c->fname, what, pnglite_error_string(rv));
+            fails += 1;
+            pnglite_index_free(index);
+            continue;
+        }
+        if (PNG_NO_ERROR != (rv = load_index(c, w.buf, w.len, &loaded))) {
+            fprintf(stderr, "%s: %s: pnglite_index_load(): %s\n", c->fname, what, pnglite_error_string(rv));
+            fails += 1;
+            loaded = NULL;
+        }
+
+        fails += check_indexed_rows(c, index, what, image, 0, c->hdr.height);
+        fails += check_indexed_rows(c, index, what, image, c->hdr.height - 1, 1);
+        for (j = 0; j < 8; j++) {
+            first = test_rand(c->hdr.height);
+            n = 1 + test_rand(c->hdr.height - first);
+            fails += check_indexed_rows(c, index, what, image, first, n);
+            if (loaded)
+                fails += check_indexed_rows(c, loaded, "loaded index", image, first, n);
+        }
+        pnglite_index_free(loaded);
+        pnglite_index_free(index);
+
+        /* damaged sidecars: cut short, magic or width off, a byte of the checkpoints off */
+        bad = malloc(w.len);
+        for (j = 0; j < 8; j++) {
+            memcpy(bad, w.buf, w.len);
+            n = (unsigned)w.len;
+            switch (j) {
+            case 0: n = w.len / 2; break;
+            case 1: n = w.len - 1; break;
+            case 2: bad[0] ^= 0x20; break;
+            case 3: bad[11] ^= 1; break;
+            default:
+                pos = 36 + test_rand((unsigned)w.len - 36);
+                bad[pos] ^= 1 << test_rand(8);
+                break;
+            }
+            if (PNG_NO_ERROR == (rv = load_index(c, bad, n, &loaded))) {
+                if (j < 4) {
+                    fprintf(stderr, "%s: %s: damaged sidecar %u loaded\n", c->fname, what, j);
+                    fails += 1;
+                } else {
+                    fails += check_indexed_rows(c, loaded, "damaged index", image, 0, c->hdr.height);
+                }
+                pnglite_index_free(loaded);
+            }
+        }
+        free(bad);
+        free(w.buf);
+    }
+    free(image);
+    return fails;
+}
+
+/*  Straight from memory, read whole or a few rows at a time, the image
+    comes out the same as through the read callback, and no part of the
+    file gets copied (save for IDATs joined for libdeflate). Cut short,
+    it fails. */
+int test_mem(const api_case_t *c) {
+    pnglite_t png;
+    unsigned char *image;
+    size_t lens[] = { c->len / 2, c->len - 1 };
+    size_t bound;
+    unsigned i, y = 0;
+    int rv, fails = 0;
+
+    image = malloc(c->rowbytes * c->hdr.height);
+    counting_reset();
+    pnglite_init_mem(&png, c->file, c->len, counting_alloc, counting_free, 0, 0);
+    if ((PNG_NO_ERROR != (rv = pnglite_read_header(&png))) || (PNG_NO_ERROR != (rv = pnglite_read_image(&png, image)))) {
+        fprintf(stderr, "%s: pnglite_init_mem(), pnglite_read_image(): %s\n", c->fname, pnglite_error_string(rv));
+        fails += 1;
+    } else {
+        fails += compare_rows(c, "pnglite_init_mem()", image, c->rowbytes, 0, c->hdr.height);
+        bound = 3 * ((size_t)png.pitch + 1) + 8 * (size_t)png.width + 12 * 256 + 65536;
+#ifdef PNG_LIBDEFLATE
+        /* non-interlaced image data is inflated in one go, split IDATs joined first */
+        bound += ((size_t)png.pitch + 1) * png.height + c->len;
+#endif
+        if (alloc_peak > bound) {
+            fprintf(stderr, "%s: decoding from memory took %lu bytes, more than %lu\n", c->fname,
+                    (unsigned long)alloc_peak, (unsigned long)bound);
+            fails += 1;
+        }
+    }
+
+    pnglite_init_mem(&png, c->file, c->len, 0, 0, 0, 0);
+    if (PNG_NO_ERROR != (rv = pnglite_read_header(&png))) {
+        fprintf(stderr, "%s: pnglite_init_mem(), pnglite_read_header(): %s\n", c->fname, pnglite_error_string(rv));
+        fails += 1;
+    } else {
+        memset(image, 0, c->rowbytes * c->hdr.height);
+        while ((rv = pnglite_read_next_rows(&png, image + y * c->rowbytes, 1 + test_rand(c->hdr.height))) > 0)
+            y += rv;
+        if (rv < 0) {
+            fprintf(stderr, "%s: pnglite_init_mem(), pnglite_read_next_rows(): %s\n", c->fname, pnglite_error_string(rv));
+            fails += 1;
+        } else {
+            fails += compare_rows(c, "pnglite_init_mem(), pnglite_read_next_rows()", image, c->rowbytes, 0, c->hdr.height);
+        }
+    }
+
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        pnglite_init_mem(&png, c->file, lens[i], 0, 0, 0, 0);
+        if ((PNG_NO_ERROR == (rv = pnglite_read_header(&png))) && (PNG_NO_ERROR == (rv = pnglite_read_image(&png, image)))) {
+            fprintf(stderr, "%s: pnglite_init_mem() of %lu bytes out of %lu decoded\n", c->fname,
+                    (unsigned long)lens[i], (unsigned long)c->len);
+            fails += 1;
+        }
+    }
+    free(image);
+    return fails;
+}
+
+/*  Whatever the read-ahead, the image comes out the same; reading ahead
+    the whole file takes a single call of the read callback, save for the
+    one finding its end. */
+int test_read_ahead(const api_case_t *c) {
+    pnglite_t png;
+    mem_reader_t r;
+    unsigned char *image;
+    size_t read_ahead[] = { 1, 100, 4096, 1 << 20 };
+    unsigned i, calls = 0;
+    int rv, fails = 0;
+    char what[64];
+
+    image = malloc(c->rowbytes * c->hdr.height);
+    for (i = 0; i < sizeof(read_ahead) / sizeof(read_ahead[0]); i++) {
+        sprintf(what, "read-ahead of %lu", (unsigned long)read_ahead[i]);
+        r.buf = c->file;
+        r.len = c->len;
+        r.pos = r.calls = 0;
+        pnglite_init(&png, &r, mem_read, 0, 0, 0, 0, 0);
+        png.read_ahead = read_ahead[i];
+        if ((PNG_NO_ERROR != (rv = pnglite_read_header(&png))) || (PNG_NO_ERROR != (rv = pnglite_read_image(&png, image)))) {
+            fprintf(stderr, "%s: %s: %s\n", c->fname, what, pnglite_error_string(rv));
+            pnglite_read_abort(&png);
+            fails += 1;
+            continue;
+        }
+        fails += compare_rows(c, what, image, c->rowbytes, 0, c->hdr.height);
+        if (c->loud)
+            fprintf(stderr, "    %s: %u reads\n", what, r.calls);
+        if ((read_ahead[i] >= c->len) && (r.calls > 2)) {
+            fprintf(stderr, "%s: %s: %u reads of a %lu byte file\n", c->fname, what, r.calls, (unsigned long)c->len);
+            fails += 1;
+        }
+        if (calls && (r.calls > calls)) {
+            fprintf(stderr, "%s: %s: %u reads, more than with less read-ahead\n", c->fname, what, r.calls);
+            fails += 1;
+        }
+        calls = r.calls;
+    }
+    free(image);
+    return fails;
+}
+
+/*  Read into rows padded by a few bytes, by one thread or several, the
+    image is the same and the padding left alone; a pitch short of a row
+    is refused. */
+int test_pitch(const api_case_t *c) {
+    pnglite_t png;
+    mem_reader_t r;
+    unsigned char *image;
+    size_t pitch = c->rowbytes + 13, size = pitch * c->hdr.height, i;
+    unsigned y, threads;
+    int rv, fails = 0;
+
+    image = malloc(size);
+    for (threads = 0; threads <= 4; threads += 4) {
+        memset(image, 0xa5, size);
+        open_png(&png, &r, c);
+        png.threads = threads;
+        if (PNG_NO_ERROR != (rv = pnglite_read_image_pitch(&png, image, pitch))) {
+            fprintf(stderr, "%s: pnglite_read_image_pitch(), %u threads: %s\n", c->fname, threads,
+                    pnglite_error_string(rv));
+            fails += 1;
+            continue;
+        }
+        fails += compare_rows(c, "pnglite_read_image_pitch()", image, pitch, 0, c->hdr.height);
+        for (y = 0; y < c->hdr.height; y++) {
+            for (i = c->rowbytes; i < pitch; i++) {
+                if (0xa5 != image[y * pitch + i]) {
+                    fprintf(stderr, "%s: pnglite_read_image_pitch(), %u threads: padding of row %u written\n",
+                            c->fname, threads, y);
+                    fails += 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    open_png(&png, &r, c);
+    if (PNG_WRONG_ARGUMENTS != (rv = pnglite_read_image_pitch(&png, image, c->rowbytes - 1))) {
+        fprintf(stderr, "%s: pnglite_read_image_pitch() short of a row: %s\n", c->fname, pnglite_error_string(rv));
+        fails += 1;
+    }
+    pnglite_read_abort(&png);
+    free(image);
+    return fails;
+}
+
+/* channel positions in each PNG_FORMAT_*, red, green, blue, alpha */
+const unsigned char format_order[5][4] = {
+    { 0, 0, 0, 0 }, { 0, 1, 2, 3 }, { 2, 1, 0, 3 }, { 1, 2, 3, 0 }, { 3, 2, 1, 0 }
+};
+
+/* pixel x,y of the reference made into RGBA */
+void reference_rgba(const api_case_t *c, unsigned x, unsigned y, unsigned char *rgba) {
+    const pnglite_t *h = &c->hdr;
+    const unsigned char *p = c->image + y * c->rowbytes + x * h->stride;
+
+    switch (h->color_type) {
+    case PNG_GREYSCALE:
+        rgba[0] = rgba[1] = rgba[2] = p[0] * 255 / ((1 << h->depth) - 1);
+        rgba[3] = (h->transparency_present && (p[0] == h->colorkey[1])) ? 0 : 255;
+        break;
+    case PNG_TRUECOLOR:
+        memcpy(rgba, p, 3);
+        rgba[3] = (h->transparency_present && (p[0] == h->colorkey[1]) && (p[1] == h->colorkey[3]) &&
+                   (p[2] == h->colorkey[5])) ? 0 : 255;
+        break;
+    case PNG_INDEXED:
+        memcpy(rgba, h->palette + 3 * p[0], 3);
+        rgba[3] = h->palette[768 + p[0]];
+        break;
+    case PNG_GREYSCALE_ALPHA:
+        rgba[0] = rgba[1] = rgba[2] = p[0];
+        rgba[3] = p[1];
+        break;
+    default:
+        memcpy(rgba, p, 4);
+        break;
+    }
+}
+
+/* counts pixels of image, in format, that differ from the reference made into RGBA */
+int compare_rgba(const api_case_t *c, const char *what, const unsigned char *image, unsigned format) {
+    unsigned char rgba[4];
+    unsigned x, y, k;
+    int fails = 0;
+
+    for (y = 0; y < c->hdr.height; y++) {
+        for (x = 0; x < c->hdr.width; x++) {
+            reference_rgba(c, x, y, rgba);
+            for (k = 0; k < 4; k++) {
+                if (image[(y * c->hdr.width + x) * 4 + format_order[format][k]] != rgba[k]) {
+                    if (0 == fails)
+                        fprintf(stderr, "%s: %s: pixel %u,%u differs\n", c->fname, what, x, y);
+                    fails += 1;
+                    break;
+                }
+            }
+        }
+    }
+    return fails;
+}
+
+/*  Decoded to each of the RGBA layouts, by one thread or several, pixels
+    are those of the reference with grey scaled up, palette looked up and
+    tRNS made into alpha. */
+int test_out_format(const api_case_t *c) {
+    pnglite_t png;
+    mem_reader_t r;
+    unsigned char *image;
+    unsigned format, threads;
+    int rv, fails = 0;
+    char what[64];
+
+    image = malloc(4 * (size_t)c->hdr.width * c->hdr.height);
+    for (format = PNG_FORMAT_RGBA; format <= PNG_FORMAT_ABGR; format++) {
+        for (threads = 0; threads <= 4; threads += 4) {
+            sprintf(what, "out_format %u, %u threads", format, threads);
+            open_png(&png, &r, c);
+            png.out_format = format;
+            png.threads = threads;
+            if (PNG_NO_ERROR != (rv = pnglite_read_image(&png, image))) {
+                fprintf(stderr, "%s: %s: %s\n", c->fname, what, pnglite_error_string(rv));
+                fails += 1;
+                continue;
+            }
+            fails += compare_rgba(c, what, image, format);
+        }
+    }
+    free(image);
+    return fails;
+}
+
+/*  Premultiplied, colors are c*a/255 rounded: those of greyscale+alpha
+    and RGBA pixels as they are, and in the RGBA layouts those of palette
+    entries and tRNS keys too. Other pixels as they are don't change. */
+int test_premultiply(const api_case_t *c) {
+    pnglite_t png;
+    mem_reader_t r;
+    unsigned char *image, rgba[4], want;
+    const unsigned char *p, *q;
+    unsigned format, x, y, k, alpha, differs;
+    int rv, fails;
+    int failcount = 0;
+    char what[64];
+
+    image = malloc(4 * (size_t)c->hdr.width * c->hdr.height);
+    for (format = PNG_FORMAT_AS_IS; format <= PNG_FORMAT_ABGR; format++) {
+        sprintf(what, "premultiplied, out_format %u", format);
+        open_png(&png, &r, c);
+        png.out_format = format;
+        png.premultiply = 1;
+        if (PNG_NO_ERROR != (rv = pnglite_read_image(&png, image))) {
+            fprintf(stderr, "%s: %s: %s\n", c->fname, what, pnglite_error_string(rv));
+            failcount += 1;
+            continue;
+        }
+        fails = 0;
+        alpha = (PNG_GREYSCALE_ALPHA == c->hdr.color_type) || (PNG_TRUECOLOR_ALPHA == c->hdr.color_type);
+        for (y = 0; y < c->hdr.height; y++) {
+            for (x = 0; x < c->hdr.width; x++) {
+                differs = 0;
+                if (PNG_FORMAT_AS_IS == format) {
+                    p = image + y * c->rowbytes + x * c->hdr.stride;
+                    q = c->image + y * c->rowbytes + x * c->hdr.stride;
+                    for (k = 0; k < c->hdr.stride; k++) {
+                        want = (alpha && (k < c->hdr.stride - 1u)) ? (q[k] * q[c->hdr.stride - 1] * 2 + 255) / 510 : q[k];
+                        differs |= p[k] != want;
+                    }
+                } else {
+                    p = image + (y * c->hdr.width + x) * 4;
+                    reference_rgba(c, x, y, rgba);
+                    for (k = 0; k < 4; k++) {
+                        want = (k < 3) ? (rgba[k] * rgba[3] * 2 + 255) / 510 : rgba[3];
+                        differs |= p[format_order[format][k]] != want;
+                    }
+                }
+                if (differs) {
+                    if (0 == fails)
+                        fprintf(stderr, "%s: %s: pixel %u,%u differs\n", c->fname, what, x, y);
+                    fails += 1;
+                }
+            }
+        }
+        failcount += fails;
+    }
+    free(image);
+    return failcount;
+}
+
+/*  With scale_grey set, sub-byte grey levels come out scaled to 0..255,
+    by one thread or several; nothing else changes. */
+int test_scale_grey(const api_case_t *c) {
+    pnglite_t png;
+    mem_reader_t r;
+    unsigned char *image;
+    const size_t size = c->rowbytes * c->hdr.height;
+    const unsigned max = (1 << c->hdr.depth) - 1;
+    const int scaled = (PNG_GREYSCALE == c->hdr.color_type) && (c->hdr.depth < 8);
+    unsigned threads;
+    size_t i;
+    int rv, fails = 0;
+
+    image = malloc(size);
+    for (threads = 0; threads <= 4; threads += 4) {
+        open_png(&png, &r, c);
+        png.scale_grey = 1;
+        png.threads = threads;
+        if (PNG_NO_ERROR != (rv = pnglite_read_image(&png, image))) {
+            fprintf(stderr, "%s: scale_grey, %u threads: %s\n", c->fname, threads, pnglite_error_string(rv));
+            fails += 1;
+            continue;
+        }
+        for (i = 0; i < size; i++) {
+            if (image[i] != (scaled ? c->image[i] * 255 / max : c->image[i])) {
+                fprintf(stderr, "%s: scale_grey, %u threads: pixel %lu,%lu differs\n", c->fname, threads,
+                        (unsigned long)(i % c->rowbytes), (unsigned long)(i / c->rowbytes));
+                fails += 1;
+                break;
+            }
+        }
+    }
+    free(image);
+    return fails;
+}
+
+/*  Read through a decoder context, whole or a few rows at a time, the
+    image is the same as without; once the context has served the image,
+    reading it again allocates nothing. */
+int test_decoder(const api_case_t *c) {
+    pnglite_t png;
+    mem_reader_t r;
+    pnglite_decoder_t *decoder;
+    unsigned char *image;
+    unsigned i, y;
+    int rv, fails = 0;
+    char what[64];
+
+    image = malloc(c->rowbytes * c->hdr.height);
+    counting_reset();
+    if (NULL == (decoder = pnglite_decoder_new(counting_alloc, counting_free))) {
+        fprintf(stderr, "%s: pnglite_decoder_new() failed\n", c->fname);
+        free(image);
+        return 1;
+    }
+    for (i = 0; i < 4; i++) {
+        sprintf(what, "decoder context, %s %u", i & 1 ? "pnglite_read_next_rows()" : "pnglite_read_image()", i / 2 + 1);
+        r.buf = c->file;
+        r.len = c->len;
+        r.pos = r.calls = 0;
+        pnglite_init(&png, &r, mem_read, 0, counting_alloc, counting_free, 0, 0);
+        png.decoder = decoder;
+        alloc_calls = 0;
+        if (PNG_NO_ERROR != (rv = pnglite_read_header(&png))) {
+            fprintf(stderr, "%s: %s: %s\n", c->fname, what, pnglite_error_string(rv));
+            fails += 1;
+            continue;
+        }
+        if (i & 1) {
+            y = 0;
+            while ((rv = pnglite_read_next_rows(&png, image + y * c->rowbytes, 1 + test_rand(c->hdr.height))) > 0)
+                y += rv;
+        } else {
+            rv = pnglite_read_image(&png, image);
+        }
+        if (rv < 0) {
+            fprintf(stderr, "%s: %s: %s\n", c->fname, what, pnglite_error_string(rv));
+            fails += 1;
+            continue;
+        }
+        fails += compare_rows(c, what, image, c->rowbytes, 0, c->hdr.height);
+        if ((i >= 2) && (0 != alloc_calls)) {
+            fprintf(stderr, "%s: %s: %lu allocations\n", c->fname, what, (unsigned long)alloc_calls);
+            fails += 1;
+        }
+    }
+    pnglite_decoder_free(decoder);
+    if (0 != alloc_live) {
+        fprintf(stderr, "%s: %lu bytes left allocated\n", c->fname, (unsigned long)alloc_live);
+        fails += 1;
+    }
+    free(image);
+    return fails;
+}
+
+typedef struct {
+    size_t live;                    /* bytes in use */
+    unsigned mismatches;            /* frees given the wrong size */
+} sized_alloc_t;
+
+void *sized_alloc(void *ctx, size_t s) {
+    sized_alloc_t *sa = ctx;
+    size_t *p = malloc(s + 16);
+
+    if (NULL == p)
+        return NULL;
+    p[0] = s;
+    sa->live += s;
+    return (unsigned char *)p + 16;
+}
+
+void sized_free(void *ctx, void *p, size_t s) {
+    sized_alloc_t *sa = ctx;
+    size_t *h;
+
+    if (NULL == p)
+        return;
+    h = (size_t *)((unsigned char *)p - 16);
+    if (h[0] != s)
+        sa->mismatches += 1;
+    sa->live -= h[0];
+    free(h);
+}
+
+/*  Through an allocator with a context, every free is given the size
+    that was asked for and all memory is given back. Out of arenas with
+    big and small blocks, and again after a reset, the image is the same
+    as pnglite_read_image() gives. */
+int test_allocator(const api_case_t *c) {
+    pnglite_t png;
+    mem_reader_t r;
+    sized_alloc_t sa = { 0, 0 };
+    pnglite_arena_t *arena;
+    unsigned char *image;
+    size_t block_size[] = { 0, 4096 };
+    unsigned i, j, y;
+    int rv, fails = 0;
+    char what[64];
+
+    image = malloc(c->rowbytes * c->hdr.height);
+    for (i = 0; i < 2; i++) {
+        init_png(&png, &r, c);
+        png.allocator.alloc = sized_alloc;
+        png.allocator.free = sized_free;
+        png.allocator.ctx = &sa;
+        rv = pnglite_read_header(&png);
+        if ((PNG_NO_ERROR == rv) && i) {
+            y = 0;
+            while ((rv = pnglite_read_next_rows(&png, image + y * c->rowbytes, 1 + test_rand(c->hdr.height))) > 0)
+                y += rv;
+        } else if (PNG_NO_ERROR == rv) {
+            rv = pnglite_read_image(&png, image);
+        }
+        if (rv < 0) {
+            fprintf(stderr, "%s: sized allocator: %s\n", c->fname, pnglite_error_string(rv));
+            fails += 1;
+        } else {
+            fails += compare_rows(c, "sized allocator", image, c->rowbytes, 0, c->hdr.height);
+        }
+    }
+    if (sa.mismatches || sa.live) {
+        fprintf(stderr, "%s: sized allocator: %u frees of the wrong size, %lu bytes left allocated\n",
+                c->fname, sa.mismatches, (unsigned long)sa.live);
+        fails += 1;
+    }
+
+    for (i = 0; i < sizeof(block_size) / sizeof(block_size[0]); i++) {
+        if (NULL == (arena = pnglite_arena_new(block_size[i]))) {
+            fprintf(stderr, "%s: pnglite_arena_new() failed\n", c->fname);
+            fails += 1;
+            continue;
+        }
+        for (j = 0; j < 2; j++) {
+            sprintf(what, "arena of %lu byte blocks, %s", (unsigned long)block_size[i], j ? "reset" : "new");
+            init_png(&png, &r, c);
+            png.allocator = pnglite_arena_allocator(arena);
+            if ((PNG_NO_ERROR != (rv = pnglite_read_header(&png))) || (PNG_NO_ERROR != (rv = pnglite_read_image(&png, image)))) {
+                fprintf(stderr, "%s: %s: %s\n", c->fname, what, pnglite_error_string(rv));
+                fails += 1;
+            } else {
+                fails += compare_rows(c, what, image, c->rowbytes, 0, c->hdr.height);
+            }
+            pnglite_arena_reset(arena);
+        }
+        pnglite_arena_free(arena);
+    }
+    free(image);
+    return fails;
+}
+
+/* CRC of PNG chunks, a bit at a time */
+unsigned chunk_crc(const unsigned char *p, size_t len) {
+    unsigned crc = 0xffffffffu;
+    int k;
+
+    while (len--) {
+        crc ^= *p++;
+        for (k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1)));
+    }
+    return crc ^ 0xffffffffu;
+}
+
+void put_ul(unsigned char *p, unsigned v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+typedef struct {
+    unsigned char *out;             /* file being made */
+    size_t len;
+    unsigned char *idat;            /* image data gathered */
+    size_t idat_len;
+    unsigned nidats;                /* IDATs it was split in */
+    size_t idat_pos[8];             /* where each starts in out */
+    size_t idat_size[8];            /* its length */
+} rechunk_t;
+
+void put_chunk(rechunk_t *rc, const char *type, const unsigned char *data, size_t length) {
+    unsigned char *p = rc->out + rc->len;
+
+    put_ul(p, (unsigned)length);
+    memcpy(p + 4, type, 4);
+    memcpy(p + 8, data, length);
+    put_ul(p + 8 + length, chunk_crc(p + 4, length + 4));
+    rc->len += 12 + length;
+}
+
+int rechunk(const unsigned char *type, const unsigned char *data, size_t length, void *user) {
+    rechunk_t *rc = user;
+    size_t piece, pos;
+
+    if (0 == memcmp(type, "IDAT", 4)) {
+        memcpy(rc->idat + rc->idat_len, data, length);
+        rc->idat_len += length;
+        return 0;
+    }
+    if (rc->idat_len && !rc->nidats) {
+        /* the image data is all in, split it in 8 */
+        piece = (rc->idat_len + 7) / 8;
+        for (pos = 0; pos < rc->idat_len; pos += piece) {
+            if (piece > rc->idat_len - pos)
+                piece = rc->idat_len - pos;
+            rc->idat_pos[rc->nidats] = rc->len;
+            rc->idat_size[rc->nidats] = piece;
+            rc->nidats += 1;
+            put_chunk(rc, "IDAT", rc->idat + pos, piece);
+        }
+    }
+    put_chunk(rc, (const char *)type, data, length);
+    return 0;
+}
+
+/* rows pnglite_push() hands out given the first len bytes of file */
+unsigned pushed_rows(const api_case_t *c, const unsigned char *file, size_t len, unsigned char *image) {
+    pnglite_t png;
+    row_copy_t rc;
+
+    rc.image = image;
+    rc.rowbytes = c->rowbytes;
+    rc.rows = 0;
+    push_file(&png, file, len, 4096, 0, &rc);
+    pnglite_read_abort(&png);
+    return rc.rows;
+}
+
+/*  The image data is split in up to 8 IDATs, then a bit of the CRC or of
+    the first, middle or last byte of one of them is flipped. Read whole,
+    by several threads, a row at a time, by callback, pushed or from
+    memory, the image fails with PNG_CRC_ERROR, not with an inflate or
+    filter error, and none of the rows handed out before that come from
+    the damaged IDAT or differ from the reference. */
+int test_crc(const api_case_t *c) {
+    pnglite_t png;
+    mem_reader_t r;
+    rechunk_t rc;
+    row_copy_t copy;
+    api_case_t bad;
+    unsigned char *image;
+    unsigned damage, idat, way, rows, max_rows;
+    unsigned char flip;
+    size_t at;
+    int rv, fails = 0;
+    char what[96];
+    const char *ways[] = { "pnglite_read_image()", "pnglite_read_image(), 4 threads", "pnglite_read_next_rows()",
+                           "pnglite_read_rows()", "pnglite_push()", "pnglite_init_mem()" };
+    const char *damages[] = { "CRC", "first byte", "middle byte", "last byte" };
+
+    memset(&rc, 0, sizeof(rc));
+    rc.out = malloc(c->len + 8 * 12);
+    rc.idat = malloc(c->len);
+    memcpy(rc.out, c->file, 8);
+    rc.len = 8;
+    for_each_chunk(c->file, c->len, rechunk, &rc);
+    image = malloc(c->rowbytes * c->hdr.height);
+    if ((rows = pushed_rows(c, rc.out, rc.len, image)) != c->hdr.height) {
+        fprintf(stderr, "%s: split in %u IDATs: %u rows of %u\n", c->fname, rc.nidats, rows, c->hdr.height);
+        fails += 1;
+    }
+
+    bad = *c;
+    bad.len = rc.len;
+    for (damage = 0; damage < 4; damage++) {
+        idat = test_rand(rc.nidats);
+        at = rc.idat_pos[idat] + 8;
+        switch (damage) {
+        case 0: at += rc.idat_size[idat] + test_rand(4); break;
+        case 1: break;
+        case 2: at += rc.idat_size[idat] / 2; break;
+        default: at += rc.idat_size[idat] - 1; break;
+        }
+        max_rows = pushed_rows(c, rc.out, rc.idat_pos[idat], image);
+        flip = 1 << test_rand(8);
+        rc.out[at] ^= flip;
+        bad.file = rc.out;
+
+        for (way = 0; way < sizeof(ways) / sizeof(ways[0]); way++) {
+            sprintf(what, "%s of IDAT %u of %u flipped, %s", damages[damage], idat + 1, rc.nidats, ways[way]);
+            memset(image, 0, c->rowbytes * c->hdr.height);
+            rows = 0;
+            if (5 == way)
+                pnglite_init_mem(&png, bad.file, bad.len, 0, 0, 0, 0);
+            else if (4 != way)
+                init_png(&png, &r, &bad);
+            rv = (4 == way) ? PNG_NO_ERROR : pnglite_read_header(&png);
+            if (PNG_NO_ERROR != rv) {
+                /* the header is before the damage */
+            } else if ((0 == way) || (1 == way) || (5 == way)) {
+                png.threads = (1 == way) ? 4 : 0;
+                rv = pnglite_read_image(&png, image);
+            } else if (2 == way) {
+                while ((rv = pnglite_read_next_rows(&png, image + rows * c->rowbytes, 1)) > 0)
+                    rows += rv;
+            } else {
+                copy.image = image;
+                copy.rowbytes = c->rowbytes;
+                copy.rows = 0;
+                if (3 == way)
+                    rv = pnglite_read_rows(&png, copy_row, &copy);
+                else
+                    rv = push_file(&png, bad.file, bad.len, 4096, 0, &copy);
+                rows = copy.rows;
+            }
+            if (PNG_CRC_ERROR != rv) {
+                fprintf(stderr, "%s: %s: %s\n", c->fname, what, pnglite_error_string(rv));
+                fails += 1;
+            }
+            if (rows > max_rows) {
+                fprintf(stderr, "%s: %s: %u rows handed out, only %u before the damage\n", c->fname, what, rows, max_rows);
+                fails += 1;
+            }
+            fails += compare_rows(c, what, image, c->rowbytes, 0, rows);
+            pnglite_read_abort(&png);
+        }
+        rc.out[at] ^= flip;
+    }
+    free(image);
+    free(rc.idat);
+    free(rc.out);
+    return fails;
+}
+
+struct {
+    const char *name;
+    api_test_t test;
+} api_tests[] = {
+    { "STREAM", test_stream },
+    { "NEXT ROWS", test_next_rows },
+    { "READ ROWS", test_read_rows },
+    { "PUSH", test_push },
+    { "WRITE ROWS", test_write_rows },
+    { "PROGRESSIVE", test_progressive },
+    { "SCALED", test_scaled },
+    { "REGION", test_region },
+    { "INDEX", test_index },
+    { "MEM", test_mem },
+    { "READ AHEAD", test_read_ahead },
+    { "PITCH", test_pitch },
+    { "OUT FORMAT", test_out_format },
+    { "PREMULTIPLY", test_premultiply },
+    { "SCALE GREY", test_scale_grey },
+    { "DECODER", test_decoder },
+    { "ALLOCATOR", test_allocator },
+    { "CRC", test_crc },
+};
+
+int run_api_test(const char *fname, api_test_t test, int loud) {
+    api_case_t c;
+    mem_reader_t r;
+    unsigned char *file;
+    size_t len = 0;
+    int rv, fails;
+
+    if (NULL == (file = load_file(fname, &len))) {
+        fprintf(stderr, "can't read %s\n", fname);
+        return 1;
+    }
+    c.fname = fname;
+    c.file = file;
+    c.len = len;
+    c.loud = loud;
+    c.image = NULL;
+    rv = open_png(&c.hdr, &r, &c);
+    if (PNG_NO_ERROR == rv) {
+        c.rowbytes = (size_t)c.hdr.width * c.hdr.stride;
+        c.image = malloc(c.rowbytes * c.hdr.height);
+        rv = c.image ? pnglite_read_image(&c.hdr, c.image) : PNG_MEMORY_ERROR;
+    }
+    if (PNG_NO_ERROR != rv) {
+        if (loud)
+            fprintf(stderr, "    skipped, pnglite_read_image(): %s\n", pnglite_error_string(rv));
+        free(c.image);
+        free(file);
+        return 0;
+    }
+    fails = test(&c);
+    free(c.image);
+    free(file);
+    return fails;
+}
+
 int main(int argc, char *argv[]) {
     int i, fails = 0, loud = 0, failcount = 0, no_si = 0;
+    size_t t;
     char *fname;
 
     loud = getenv("LOUD") != NULL;
@@ -302,6 +2222,56 @@ int main(int argc, char *argv[]) {
             }
         }
     }
+    fprintf(stderr, "=== TEST LOAD FORMAT =====================================\n");
+    for (i = 1; i < argc; i++) {
+        fname = argv[i];
+        if (loud) { fprintf(stderr, "%s : \n", fname); }
+        fails = test_load_format(fname, expected_ok(fname), loud);
+        failcount += fails ? 1 : 0;
+        if (loud) {
+            if (fails == 0) {
+                fprintf(stderr, "%s: OK\n", fname);
+            } else {
+                fprintf(stderr, "%s: FAIL\n", fname);
+            }
+        }
+    }
+    fprintf(stderr, "=== TEST PREMULTIPLIED =====================================\n");
+    for (i = 1; i < argc; i++) {
+        fname = argv[i];
+        if (loud) { fprintf(stderr, "%s : \n", fname); }
+        fails = test_premultiplied(fname, expected_ok(fname), loud);
+        failcount += fails ? 1 : 0;
+        if (loud) {
+            if (fails == 0) {
+                fprintf(stderr, "%s: OK\n", fname);
+            } else {
+                fprintf(stderr, "%s: FAIL\n", fname);
+            }
+        }
+    }
+    for (t = 0; t < sizeof(api_tests) / sizeof(api_tests[0]); t++) {
+        fprintf(stderr, "=== TEST %s =====================================\n", api_tests[t].name);
+        for (i = 1; i < argc; i++) {
+            fname = argv[i];
+            if (loud) { fprintf(stderr, "%s : \n", fname); }
+            fails = run_api_test(fname, api_tests[t].test, loud);
+            failcount += fails ? 1 : 0;
+            if (loud) {
+                if (fails == 0) {
+                    fprintf(stderr, "%s: OK\n", fname);
+                } else {
+                    fprintf(stderr, "%s: FAIL\n", fname);
+                }
+            }
+        }
+    }
+    fprintf(stderr, "=== TEST WRITE THREADS =====================================\n");
+    fails = test_write_threads(loud);
+    failcount += fails ? 1 : 0;
+    if (loud) {
+        fprintf(stderr, "write threads: %s\n", fails ? "FAIL" : "OK");
+    }
     fprintf(stderr, "=== TEST FAILURES: %d =====================================\n", failcount);
     IMG_Quit();
 #if defined(_WIN32)